@@ -0,0 +1,3 @@
+#!/bin/sh
+# Headless build: server pipeline, benchmarks and shaper
+g++ -std=c++17 -O2 -pthread fixed_mytry2.cpp -o fixed_mytry2
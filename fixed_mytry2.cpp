@@ -1,7 +1,9 @@
 // ISS_stream_control.cpp
 // Build: cl /EHsc mytry.cpp /link Gdiplus.lib Ws2_32.lib Gdi32.lib User32.lib Ole32.lib
 // NOTE: Run vcvars64.bat before compiling for x64 build.
+// Headless build (server, bench, shaper): g++ -std=c++17 -O2 -pthread mytry.cpp -o mytry
 
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <windowsx.h>
@@ -13,6 +15,16 @@
 #include <mmdeviceapi.h>
 #include <audioclient.h>
 #include <functiondiscoverykeys_devpkey.h>
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <time.h>
+#include <unistd.h>
+#endif
 
 #include <iostream>
 #include <vector>
@@ -25,13 +37,86 @@
 #include <cstring>
 #include <limits>
 #include <sstream>
-
+#include <fstream>
+#include <memory>
+#include <chrono>
+#include <list>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <condition_variable>
+#include <queue>
+#include <random>
+
+#ifdef _WIN32
 #pragma comment(lib, "Ws2_32.lib")
 #pragma comment(lib, "Gdiplus.lib")
 #pragma comment(lib, "Ole32.lib")
 
 using namespace Gdiplus;
 
+inline bool SetRecvTimeout(SOCKET s, int ms) {
+    DWORD tout = ms;
+    return setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char*)&tout, sizeof(tout)) == 0;
+}
+inline bool SetSendTimeout(SOCKET s, int ms) {
+    DWORD tout = ms;
+    return setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (char*)&tout, sizeof(tout)) == 0;
+}
+#else
+// ---------- posix ----------
+// Elsewhere the server pipeline, the benchmarks and the shaper build
+// headless with g++ -std=c++17 -O2 -pthread: screen and window capture,
+// audio, input injection and the client are Windows only. These stand in
+// for the Win32 and Winsock names the portable code uses.
+typedef uint8_t BYTE;
+typedef uint32_t DWORD;
+typedef unsigned long ULONG;
+typedef void* HWND;
+typedef int SOCKET;
+const SOCKET INVALID_SOCKET = -1;
+const int SOCKET_ERROR = -1;
+const int SD_SEND = SHUT_WR;
+const int SD_BOTH = SHUT_RDWR;
+struct WSADATA {};
+struct WSABUF { ULONG len; char* buf; };
+#define MAKEWORD(a, b) ((a) | (b) << 8)
+inline int WSAStartup(int, WSADATA*) { return 0; }
+inline int WSACleanup() { return 0; }
+inline int closesocket(SOCKET s) { return close(s); }
+inline int InetPton(int family, const char* text, void* addr) { return inet_pton(family, text, addr); }
+inline DWORD GetCurrentProcessId() { return (DWORD)getpid(); }
+inline void Sleep(DWORD ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+inline void CoInitialize(void*) {}
+inline void CoUninitialize() {}
+// Sends up to 64 of the buffers as a partial send; a closed peer fails
+// the send instead of raising SIGPIPE
+inline int WSASend(SOCKET s, WSABUF* bufs, DWORD count, DWORD* sent, DWORD, void*, void*) {
+    iovec iov[64];
+    DWORD n = count < 64 ? count : 64;
+    for (DWORD i=0; i<n; ++i) { iov[i].iov_base = bufs[i].buf; iov[i].iov_len = bufs[i].len; }
+    msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    ssize_t r = sendmsg(s, &msg, MSG_NOSIGNAL);
+    if (r < 0) return SOCKET_ERROR;
+    *sent = (DWORD)r;
+    return 0;
+}
+// Winsock takes the timeout as a DWORD of milliseconds, POSIX as a timeval;
+// given a DWORD, Linux fails with EINVAL and the call blocks forever
+inline bool SetRecvTimeout(SOCKET s, int ms) {
+    timeval tout = { ms / 1000, (ms % 1000) * 1000 };
+    return setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tout, sizeof(tout)) == 0;
+}
+inline bool SetSendTimeout(SOCKET s, int ms) {
+    timeval tout = { ms / 1000, (ms % 1000) * 1000 };
+    return setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tout, sizeof(tout)) == 0;
+}
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
 // Forward declaration
 class Client;
 
@@ -56,143 +141,4448 @@ int recvAll(SOCKET s, char* buf, int len) {
     }
     return rec;
 }
+// Sends a list of buffers with WSASend, picking up after partial sends.
+// The buffers are advanced past what went out; calls counts WSASend calls.
+int sendGather(SOCKET s, WSABUF* bufs, DWORD count, int& calls) {
+    int sent = 0;
+    DWORD i = 0;
+    while (i < count) {
+        if (bufs[i].len == 0) { ++i; continue; }
+        DWORD r = 0;
+        calls++;
+        if (WSASend(s, bufs + i, count - i, &r, 0, NULL, NULL) == SOCKET_ERROR) return SOCKET_ERROR;
+        if (r == 0) return sent;
+        sent += (int)r;
+        while (i < count && r >= bufs[i].len) { r -= bufs[i].len; ++i; }
+        if (i < count) { bufs[i].buf += r; bufs[i].len -= r; }
+    }
+    return sent;
+}
+
+// ---------- wire format ----------
+// The video channel carries messages. Each one starts with a fixed 16-byte
+// header of little-endian fields: magic (uint32), version (uint8), message
+// type (uint8), flags (uint16), record count (uint32), body size (uint32).
+// A MSG_FRAME body is the frame geometry (width, height, tile width, tile
+// height) and then per record: type, x, y, w, h, payload size, payload.
+// All of these except the payload are LEB128 varints. Integers inside
+// payloads are little-endian.
+//
+// A frame is one message with MSG_FLAG_END_OF_FRAME. A streamed frame
+// (--framing=stream) is any number of messages without the flag, one per
+// burst of records that are ready, closed by a message with it. The client
+// applies records in the order they arrive. Copies always come before new
+// pixels, and a cache reference never precedes the record that fills its
+// slot; apart from that, streamed records come in no fixed order.
+// Records other than cache stores may span several tiles (see MergeRects).
+//
+// JPEG payloads are a table id (the JPEG quality) and an abbreviated JPEG
+// without quantisation and Huffman tables. The tables for an id are sent
+// once per session in a REC_JPEG_TABLES record ahead of the first record
+// that uses them.
+const uint32_t WIRE_MAGIC = 0x49535333;
+const uint8_t WIRE_VERSION = 2;
+const size_t WIRE_HEADER_BYTES = 16;
+const size_t WIRE_RECORD_BYTES = 12;    // typical serialized record header, for budgets
+const uint32_t WIRE_MAX_BODY = 256 * 1024 * 1024;
+
+enum MessageType : uint8_t {
+    MSG_FRAME = 1,
+    MSG_UDP_SETUP = 2,      // body: session token (uint32); video continues over UDP
+};
+const uint16_t MSG_FLAG_END_OF_FRAME = 1;
+
+enum RecordType : uint32_t {
+    REC_JPEG = 0,   // payload: JPEG image of the w x h rectangle at x,y
+    REC_COPY = 1,   // payload: source x, y; the w x h block moves to x,y
+    REC_JPEG_STORE = 2,   // payload: cache slot, JPEG; also kept in the client tile cache
+    REC_CACHE_REF = 3,    // payload: cache slot; draw the cached w x h tile at x,y
+    REC_FILL = 4,         // payload: BGRX color of the whole rectangle
+    REC_PALETTE = 5,      // payload: palette and run-length indices (EncodePaletteRLE)
+    REC_LOSSLESS = 6,     // payload: LosslessEncoder output
+    REC_LOSSLESS_STORE = 7,   // payload: cache slot, LosslessEncoder output
+    REC_JPEG_HALF = 8,    // payload: JPEG of the rectangle at half resolution (Downscale2x)
+    REC_VIDEO = 9,        // payload: VideoEncoder frame of the rectangle; inter frames continue the previous REC_VIDEO
+    REC_JPEG_TABLES = 10, // payload: table id, tables-only JPEG (SOI, DQT, DHT, EOI); empty rectangle
+};
+
+// Control messages (client to server) start with a type byte: 1 mouse
+// move, 2/3 button down/up, 4 key, 5 frame ack with the uint64 total of
+// video bytes the client has processed, 6 the uint32 sequence number of
+// a UDP video message the client gave up on
+const uint8_t CTRL_FRAME_ACK = 5;
+const uint8_t CTRL_VIDEO_LOST = 6;
+
+const uint32_t MAX_CACHE_SLOTS = 65536;
+
+// LEB128 unsigned varint
+inline void PutVarint(std::vector<BYTE>& out, uint32_t v) {
+    while (v >= 0x80) { out.push_back((BYTE)(v | 0x80)); v >>= 7; }
+    out.push_back((BYTE)v);
+}
+// Fails on a cut-off varint and on one that doesn't fit 32 bits
+inline bool GetVarint(const BYTE*& p, const BYTE* end, uint32_t& v) {
+    v = 0;
+    for (int shift=0; shift<35 && p < end; shift+=7) {
+        BYTE b = *p++;
+        if (shift == 28 && b > 0x0F) return false;
+        v |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+inline void PutLE16(BYTE* p, uint16_t v) { p[0] = (BYTE)v; p[1] = (BYTE)(v >> 8); }
+inline void PutLE32(BYTE* p, uint32_t v) { for (int i=0; i<4; ++i) p[i] = (BYTE)(v >> (8 * i)); }
+inline uint16_t GetLE16(const BYTE* p) { return (uint16_t)(p[0] | p[1] << 8); }
+inline uint32_t GetLE32(const BYTE* p) { return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24; }
+
+struct WireHeader {
+    uint8_t version, type;
+    uint16_t flags;
+    uint32_t count, bodySize;
+};
+
+inline void PutWireHeader(BYTE* p, uint8_t type, uint16_t flags, uint32_t count, uint32_t bodySize) {
+    PutLE32(p, WIRE_MAGIC);
+    p[4] = WIRE_VERSION;
+    p[5] = type;
+    PutLE16(p + 6, flags);
+    PutLE32(p + 8, count);
+    PutLE32(p + 12, bodySize);
+}
+
+// Reads a message header; false if the magic doesn't match
+inline bool ParseWireHeader(const BYTE* p, WireHeader& h) {
+    if (GetLE32(p) != WIRE_MAGIC) return false;
+    h.version = p[4];
+    h.type = p[5];
+    h.flags = GetLE16(p + 6);
+    h.count = GetLE32(p + 8);
+    h.bodySize = GetLE32(p + 12);
+    return true;
+}
+
+// Whether a receiver can go on to read the body: the version this build
+// speaks and a plausible body size. Anything else ends the stream.
+inline bool WireHeaderReadable(const WireHeader& h) {
+    return h.version == WIRE_VERSION && h.bodySize <= WIRE_MAX_BODY;
+}
+
+// A piece of an outgoing message
+struct WireSpan {
+    const BYTE* data;
+    size_t size;
+};
+
+// Serializes a MSG_FRAME message. Headers go into one buffer, reused
+// between messages; payloads stay where they are and the message comes
+// out as a list of spans for a gathering send, so they are never copied.
+// Payloads up to WIRE_INLINE_BYTES are copied next to their header
+// instead, as a separate span would cost more than the copy.
+const size_t WIRE_INLINE_BYTES = 256;
+
+class FrameWriter {
+public:
+    void begin(int width, int height, int tileW, int tileH) {
+        m_buf.resize(WIRE_HEADER_BYTES);
+        m_payloads.clear();
+        m_payloadBytes = 0;
+        m_count = 0;
+        PutVarint(m_buf, (uint32_t)width);
+        PutVarint(m_buf, (uint32_t)height);
+        PutVarint(m_buf, (uint32_t)tileW);
+        PutVarint(m_buf, (uint32_t)tileH);
+    }
+    // data must stay valid until the message has been sent
+    void add(uint32_t type, int x, int y, int w, int h, const BYTE* data, size_t size) {
+        PutVarint(m_buf, type);
+        PutVarint(m_buf, (uint32_t)x);
+        PutVarint(m_buf, (uint32_t)y);
+        PutVarint(m_buf, (uint32_t)w);
+        PutVarint(m_buf, (uint32_t)h);
+        PutVarint(m_buf, (uint32_t)size);
+        if (size <= WIRE_INLINE_BYTES) {
+            m_buf.insert(m_buf.end(), data, data + size);
+        } else {
+            m_payloads.push_back({ m_buf.size(), data, size });
+            m_payloadBytes += size;
+        }
+        m_count++;
+    }
+    // Fills in the header and returns the message in order
+    const std::vector<WireSpan>& finish(bool endOfFrame) {
+        PutWireHeader(m_buf.data(), MSG_FRAME, endOfFrame ? MSG_FLAG_END_OF_FRAME : 0, m_count, (uint32_t)(size() - WIRE_HEADER_BYTES));
+        m_spans.clear();
+        size_t from = 0;
+        for (const Payload& p : m_payloads) {
+            m_spans.push_back({ m_buf.data() + from, p.offset - from });
+            m_spans.push_back({ p.data, p.size });
+            from = p.offset;
+        }
+        if (from < m_buf.size()) m_spans.push_back({ m_buf.data() + from, m_buf.size() - from });
+        return m_spans;
+    }
+    size_t size() const { return m_buf.size() + m_payloadBytes; }
+    uint32_t records() const { return m_count; }
+
+private:
+    struct Payload { size_t offset; const BYTE* data; size_t size; };  // offset: where in m_buf it belongs
+    std::vector<BYTE> m_buf;
+    std::vector<Payload> m_payloads;
+    std::vector<WireSpan> m_spans;
+    size_t m_payloadBytes = 0;
+    uint32_t m_count = 0;
+};
+
+struct WireRecord {
+    uint32_t type, x, y, w, h, size;
+    const BYTE* data;
+};
+
+// Walks the body of a MSG_FRAME message: geometry() once, then next()
+// for each record. Both return false on truncated or malformed data.
+class FrameReader {
+public:
+    FrameReader(const BYTE* body, size_t size) : m_p(body), m_end(body + size) {}
+    bool geometry(uint32_t& width, uint32_t& height, uint32_t& tileW, uint32_t& tileH) {
+        return GetVarint(m_p, m_end, width) && GetVarint(m_p, m_end, height) &&
+               GetVarint(m_p, m_end, tileW) && GetVarint(m_p, m_end, tileH);
+    }
+    bool next(WireRecord& rec) {
+        if (!GetVarint(m_p, m_end, rec.type) || !GetVarint(m_p, m_end, rec.x) || !GetVarint(m_p, m_end, rec.y) ||
+            !GetVarint(m_p, m_end, rec.w) || !GetVarint(m_p, m_end, rec.h) || !GetVarint(m_p, m_end, rec.size)) return false;
+        if (rec.size > (size_t)(m_end - m_p)) return false;
+        rec.data = m_p;
+        m_p += rec.size;
+        return true;
+    }
+    bool done() const { return m_p == m_end; }
+
+private:
+    const BYTE* m_p;
+    const BYTE* m_end;
+};
+
+// ---------- multiplexed connection ----------
+// Control, audio and video share one TCP connection. Each side opens with
+// MUX_HELLO (uint32, little-endian); after that the stream is a sequence
+// of chunks: channel (uint8), reserved (uint8), payload size (uint16) and
+// at most MUX_CHUNK_BYTES of payload. A message on a channel goes out as
+// consecutive chunks of that channel, so each channel reads back as the
+// plain byte stream it was on its own socket.
+//
+// Between chunks the sender always picks the lowest channel number with
+// data waiting, so control and audio never wait behind more than one
+// video chunk, however large the video message is.
+//
+// Received chunks wait in a per-channel inbox until that channel's reader
+// takes them. Reading from the socket pauses only while the inboxes
+// together hold MUX_INBOX_BYTES, which is TCP backpressure for the whole
+// connection. A reader that gives up calls closeChannel(), and from then
+// on its channel's data is thrown away, so it cannot stall the others.
+const uint32_t MUX_HELLO = 0x314D5349;     // "ISM1"
+const size_t MUX_HEADER_BYTES = 4;
+const size_t MUX_CHUNK_BYTES = 16384;
+const int MUX_SEND_BUFFER = 256 * 1024;    // SO_SNDBUF; the rest queues where the scheduler can reorder it
+const size_t MUX_INBOX_BYTES = 4 << 20;    // unread bytes of all channels before reading pauses
+const int MUX_TIMEOUT = -2;                // MuxConnection::recv: nothing arrived in time
+
+enum MuxChannel {
+    MUX_CONTROL = 0,    // client to server input and acks
+    MUX_AUDIO = 1,      // server to client PCM
+    MUX_VIDEO = 2,      // server to client wire format messages
+    MUX_CHANNELS = 3,
+};
+
+class MuxConnection {
+public:
+    MuxConnection() {}
+    ~MuxConnection() { stop(); close(); }
+
+    // Takes over a connected socket, sends the hello and starts reading
+    bool start(SOCKET s) {
+        m_socket = s;
+        int sndbuf = MUX_SEND_BUFFER;
+        setsockopt(s, SOL_SOCKET, SO_SNDBUF, (char*)&sndbuf, sizeof(sndbuf));
+        BYTE hello[4];
+        PutLE32(hello, MUX_HELLO);
+        if (sendAll(s, (char*)hello, 4) != 4) return false;
+        m_reader = std::thread(&MuxConnection::readLoop, this);
+        return true;
+    }
+
+    // Ends the connection: blocked send() and recv() calls return, the
+    // reader exits. The socket stays open until close(), after every
+    // thread that used it is gone.
+    void stop() {
+        if (m_socket == INVALID_SOCKET) return;
+        ::shutdown(m_socket, SD_BOTH);
+        {
+            std::lock_guard<std::mutex> lock(m_recvMutex);
+            m_recvClosed = true;
+            m_recvCv.notify_all();
+        }
+        if (m_reader.joinable()) m_reader.join();
+        std::lock_guard<std::mutex> lock(m_sendMutex);
+        failPending();
+    }
+    void close() {
+        if (m_socket != INVALID_SOCKET) closesocket(m_socket);
+        m_socket = INVALID_SOCKET;
+    }
+    bool connected() const { return m_socket != INVALID_SOCKET; }
+
+    // Nobody will read channel any more: what it holds and whatever still
+    // arrives for it is discarded, and recv() on it returns at once
+    void closeChannel(int channel) {
+        std::lock_guard<std::mutex> lock(m_recvMutex);
+        Inbox& in = m_inbox[channel];
+        m_unread -= in.data.size() - in.read;
+        in.data.clear();
+        in.read = 0;
+        in.closed = true;
+        m_recvCv.notify_all();
+    }
+
+    // Sends one message on a channel and returns once all of it has been
+    // handed to the socket. Concurrent senders take turns chunk by chunk
+    // in channel order; whichever of them is not waiting on the socket
+    // writes for the others, so there is no writer thread and no copy.
+    // calls counts the WSASend calls made for this message.
+    bool send(int channel, const WireSpan* spans, size_t count, int* calls = nullptr) {
+        Pending p;
+        p.spans = spans;
+        p.count = count;
+        std::unique_lock<std::mutex> lock(m_sendMutex);
+        if (m_sendFailed) return false;
+        m_pending[channel].push_back(&p);
+        // a chunk of ours still on its way keeps p alive even after a failure
+        while (!p.done || m_inflight == &p) {
+            if (m_writing) { m_sendCv.wait(lock); continue; }
+            m_writing = true;
+            while (!p.done && !m_sendFailed) writeChunk(lock);
+            m_writing = false;
+            m_sendCv.notify_all();
+        }
+        if (calls) *calls += p.calls;
+        return !p.failed;
+    }
+    bool send(int channel, const void* data, size_t size) {
+        WireSpan span = { (const BYTE*)data, size };
+        return send(channel, &span, 1);
+    }
+
+    // Reads exactly len bytes of a channel, like recvAll. Returns len, a
+    // short count once the connection has ended, or MUX_TIMEOUT if
+    // timeoutMs passed before the first byte arrived.
+    int recv(int channel, void* buf, int len, int timeoutMs = -1) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(max(timeoutMs, 0));
+        std::unique_lock<std::mutex> lock(m_recvMutex);
+        Inbox& in = m_inbox[channel];
+        int got = 0;
+        while (got < len) {
+            size_t avail = in.data.size() - in.read;
+            if (avail > 0) {
+                size_t n = min(avail, (size_t)(len - got));
+                memcpy((BYTE*)buf + got, in.data.data() + in.read, n);
+                in.read += n;
+                got += (int)n;
+                m_unread -= n;
+                if (in.read == in.data.size()) {
+                    in.data.clear();
+                    in.read = 0;
+                }
+                if (m_readerWaiting) m_recvCv.notify_all();
+                continue;
+            }
+            if (m_recvClosed || in.closed) break;
+            if (timeoutMs >= 0 && got == 0) {
+                if (m_recvCv.wait_until(lock, deadline) == std::cv_status::timeout && in.data.size() == in.read && !m_recvClosed) return MUX_TIMEOUT;
+            } else {
+                m_recvCv.wait(lock);
+            }
+        }
+        return got;
+    }
+
+private:
+    struct Pending {
+        const WireSpan* spans = nullptr;
+        size_t count = 0;
+        size_t span = 0, offset = 0;    // how far chunks have been cut
+        int calls = 0;
+        bool done = false, failed = false;
+    };
+    struct Inbox {
+        std::vector<BYTE> data;
+        size_t read = 0;
+        bool closed = false;    // no reader: incoming data is dropped
+    };
+    static const int MAX_CHUNK_SPANS = 32;
+
+    SOCKET m_socket = INVALID_SOCKET;
+    std::thread m_reader;
+    std::mutex m_sendMutex;
+    std::condition_variable m_sendCv;
+    std::deque<Pending*> m_pending[MUX_CHANNELS];
+    Pending* m_inflight = nullptr;     // the message a chunk is being sent from
+    bool m_writing = false, m_sendFailed = false;
+    std::mutex m_recvMutex;
+    std::condition_variable m_recvCv;
+    Inbox m_inbox[MUX_CHANNELS];
+    size_t m_unread = 0;                // bytes in all inboxes
+    bool m_recvClosed = false, m_readerWaiting = false;
+
+    // Cuts the next chunk from the most urgent pending message and sends
+    // it without holding the lock
+    void writeChunk(std::unique_lock<std::mutex>& lock) {
+        int channel = 0;
+        while (channel < MUX_CHANNELS && m_pending[channel].empty()) channel++;
+        Pending* next = m_pending[channel].front();
+        BYTE header[MUX_HEADER_BYTES];
+        WSABUF bufs[1 + MAX_CHUNK_SPANS];
+        DWORD n = 1;
+        size_t room = MUX_CHUNK_BYTES;
+        while (room > 0 && next->span < next->count && n < 1 + MAX_CHUNK_SPANS) {
+            const WireSpan& s = next->spans[next->span];
+            size_t take = min(room, s.size - next->offset);
+            if (take > 0) bufs[n++] = { (ULONG)take, (char*)s.data + next->offset };
+            next->offset += take;
+            room -= take;
+            if (next->offset == s.size) { next->span++; next->offset = 0; }
+        }
+        bool last = next->span == next->count;
+        if (last) m_pending[channel].pop_front();
+        header[0] = (BYTE)channel;
+        header[1] = 0;
+        PutLE16(header + 2, (uint16_t)(MUX_CHUNK_BYTES - room));
+        bufs[0] = { (ULONG)MUX_HEADER_BYTES, (char*)header };
+
+        m_inflight = next;
+        lock.unlock();
+        int calls = 0;
+        int payload = (int)(MUX_CHUNK_BYTES - room);
+        int r = payload > 0 ? sendGather(m_socket, bufs, n, calls) : 0;
+        lock.lock();
+        m_inflight = nullptr;
+        next->calls += calls;
+        // a short send (peer closed) leaves the stream mid-chunk: nothing
+        // after it can be framed
+        if (payload > 0 && r != (int)MUX_HEADER_BYTES + payload) {
+            next->failed = true;
+            failPending();
+        }
+        if (last || next->done) {
+            next->done = true;
+            m_sendCv.notify_all();
+        }
+    }
+    // Called with m_sendMutex held
+    void failPending() {
+        m_sendFailed = true;
+        for (auto& queue : m_pending) {
+            for (Pending* p : queue) p->failed = p->done = true;
+            queue.clear();
+        }
+        m_sendCv.notify_all();
+    }
+
+    void readLoop() {
+        std::vector<BYTE> chunk(MUX_CHUNK_BYTES);
+        BYTE header[MUX_HEADER_BYTES];
+        if (recvAll(m_socket, (char*)header, 4) != 4 || GetLE32(header) != MUX_HELLO) {
+            std::cerr << "Peer did not open a multiplexed connection\n";
+        } else {
+            while (recvAll(m_socket, (char*)header, (int)MUX_HEADER_BYTES) == (int)MUX_HEADER_BYTES) {
+                int channel = header[0];
+                int size = GetLE16(header + 2);
+                if (channel >= MUX_CHANNELS || size > (int)MUX_CHUNK_BYTES) {
+                    std::cerr << "Invalid chunk on connection\n";
+                    break;
+                }
+                if (size > 0 && recvAll(m_socket, (char*)chunk.data(), size) != size) break;
+                std::unique_lock<std::mutex> lock(m_recvMutex);
+                Inbox& in = m_inbox[channel];
+                if (in.closed) continue;
+                // readers that fall behind slow the peer down rather than use memory
+                m_readerWaiting = true;
+                while (m_unread >= MUX_INBOX_BYTES && !in.closed && !m_recvClosed) m_recvCv.wait(lock);
+                m_readerWaiting = false;
+                if (m_recvClosed) break;
+                if (in.closed) continue;
+                // drop what has been read once it dominates the buffer
+                if (in.read > 65536 && in.read * 2 > in.data.size()) {
+                    in.data.erase(in.data.begin(), in.data.begin() + in.read);
+                    in.read = 0;
+                }
+                in.data.insert(in.data.end(), chunk.data(), chunk.data() + size);
+                m_unread += size;
+                m_recvCv.notify_all();
+            }
+        }
+        std::lock_guard<std::mutex> lock(m_recvMutex);
+        m_recvClosed = true;
+        m_recvCv.notify_all();
+    }
+};
+
+// ---------- udp video transport ----------
+// With --transport=udp the video channel leaves the TCP connection, so a
+// lost packet holds up only the message it belongs to. The server
+// announces a session token in a MSG_UDP_SETUP message on the video
+// channel; the client repeats UDP_HELLO datagrams with that token to the
+// address and port it connected to until video arrives. Each message then
+// travels as datagrams with a 24-byte header of little-endian fields:
+// kind (uint8), reserved (uint8), index (uint16), message sequence number
+// (uint32), fragment count (uint16), reserved (uint16), message size
+// (uint32) and stream offset (uint64, the bytes of all earlier messages).
+//
+// A message is cut into fragments of UDP_FRAGMENT_BYTES. After every
+// UDP_FEC_GROUP fragments comes a parity datagram, the XOR of the group,
+// which restores any one fragment of it. The client NACKs what is still
+// missing and the server resends it from its history. A message that
+// makes no progress for UDP_GIVE_UP_MS is skipped: the client reports it
+// with CTRL_VIDEO_LOST and the server refreshes the tiles it carried.
+// Messages are applied in sequence order, as on TCP.
+enum UdpKind : uint8_t {
+    UDP_DATA = 1,       // index: fragment number
+    UDP_PARITY = 2,     // index: group number; payload as long as the group's first fragment
+    UDP_HELLO = 3,      // client to server; sequence number: the session token
+    UDP_NACK = 4,       // client to server; payload: uint16 fragment numbers, or UDP_NACK_ALL
+};
+const size_t UDP_HEADER_BYTES = 24;
+const size_t UDP_FRAGMENT_BYTES = 1200;     // datagrams stay under a 1500-byte MTU
+const uint32_t UDP_FEC_GROUP = 8;
+const uint16_t UDP_NACK_ALL = 0xFFFF;       // the client has seen nothing of the message
+const int UDP_NACK_MS = 30;                 // quiet time before a gap is NACKed, and between NACKs
+const int UDP_GIVE_UP_MS = 300;
+const int UDP_PROBE_MS = 40;                // after this much idle time the last fragment is repeated
+const size_t UDP_HISTORY_BYTES = 16 << 20;  // sent messages kept for resends and loss repair
+const uint32_t UDP_WINDOW = 4096;           // messages the client tracks ahead of the next one due
+
+struct UdpHeader {
+    uint8_t kind;
+    uint16_t index;
+    uint32_t seq;
+    uint16_t count;
+    uint32_t size;
+    uint64_t offset;
+};
+inline void PutUdpHeader(BYTE* p, const UdpHeader& h) {
+    p[0] = h.kind;
+    p[1] = 0;
+    PutLE16(p + 2, h.index);
+    PutLE32(p + 4, h.seq);
+    PutLE16(p + 8, h.count);
+    PutLE16(p + 10, 0);
+    PutLE32(p + 12, h.size);
+    PutLE32(p + 16, (uint32_t)h.offset);
+    PutLE32(p + 20, (uint32_t)(h.offset >> 32));
+}
+inline bool ParseUdpHeader(const BYTE* p, size_t size, UdpHeader& h) {
+    if (size < UDP_HEADER_BYTES) return false;
+    h.kind = p[0];
+    h.index = GetLE16(p + 2);
+    h.seq = GetLE32(p + 4);
+    h.count = GetLE16(p + 8);
+    h.size = GetLE32(p + 12);
+    h.offset = GetLE32(p + 16) | (uint64_t)GetLE32(p + 20) << 32;
+    return true;
+}
+inline uint32_t UdpFragmentCount(size_t size) { return size == 0 ? 1 : (uint32_t)((size + UDP_FRAGMENT_BYTES - 1) / UDP_FRAGMENT_BYTES); }
+inline size_t UdpFragmentBytes(size_t size, uint32_t index) { return min(UDP_FRAGMENT_BYTES, size - (size_t)index * UDP_FRAGMENT_BYTES); }
+
+#ifdef _WIN32
+#ifndef SIO_UDP_CONNRESET
+#define SIO_UDP_CONNRESET _WSAIOW(IOC_VENDOR, 12)
+#endif
+// Without this an ICMP port unreachable makes later recvfrom calls fail
+inline void IgnoreUdpConnReset(SOCKET s) {
+    BOOL off = FALSE;
+    DWORD bytes = 0;
+    WSAIoctl(s, SIO_UDP_CONNRESET, &off, sizeof(off), NULL, 0, &bytes, NULL, NULL);
+}
+#else
+// only unconnected sockets on Windows see the error
+inline void IgnoreUdpConnReset(SOCKET) {}
+#endif
+
+struct UdpCounters {
+    uint64_t datagrams = 0, parity = 0, resent = 0, probes = 0;
+};
+
+// Server side. send() is called by one thread at a time; a service thread
+// answers hellos and NACKs and probes for lost tails.
+class UdpVideoSender {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    UdpVideoSender() {}
+    ~UdpVideoSender() { stop(); close(); }
+
+    // Takes over a bound socket and waits up to waitMs for the client's hello
+    bool start(SOCKET s, uint32_t token, int waitMs) {
+        m_socket = s;
+        m_token = token;
+        IgnoreUdpConnReset(s);
+        int sndbuf = 4 << 20;
+        setsockopt(s, SOL_SOCKET, SO_SNDBUF, (char*)&sndbuf, sizeof(sndbuf));
+        SetRecvTimeout(s, UDP_PROBE_MS / 2);
+        m_stopping = false;
+        m_thread = std::thread(&UdpVideoSender::serviceLoop, this);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait_for(lock, std::chrono::milliseconds(waitMs), [this] { return m_peerKnown; });
+        return m_peerKnown;
+    }
+    void stop() {
+        m_stopping = true;
+        if (m_thread.joinable()) m_thread.join();
+    }
+    void close() {
+        if (m_socket != INVALID_SOCKET) closesocket(m_socket);
+        m_socket = INVALID_SOCKET;
+    }
+
+    // Spreads datagrams out at this rate; 0 sends as fast as the socket takes them
+    void setPacing(double kbps) { m_paceKbps = kbps; }
+
+    // Sends one message; datagrams counts what went out. A failed sendto
+    // counts as loss, repaired like any other.
+    bool send(const std::vector<WireSpan>& message, int& datagrams) {
+        size_t size = 0;
+        for (const WireSpan& span : message) size += span.size;
+        uint32_t count = UdpFragmentCount(size);
+        if (count >= UDP_NACK_ALL) return false;
+        UdpHeader h;
+        const BYTE* data;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_peerKnown) return false;
+            Sent sent;
+            if (!m_spare.empty()) {
+                sent.bytes.swap(m_spare.back());
+                m_spare.pop_back();
+                sent.bytes.clear();
+            }
+            for (const WireSpan& span : message) sent.bytes.insert(sent.bytes.end(), span.data, span.data + span.size);
+            h = { UDP_DATA, 0, m_nextSeq++, (uint16_t)count, (uint32_t)size, m_offset };
+            sent.seq = h.seq;
+            sent.offset = h.offset;
+            m_offset += size;
+            m_historyBytes += size;
+            m_history.push_back(std::move(sent));
+            // only this thread changes the history, so the bytes stay put after unlocking
+            data = m_history.back().bytes.data();
+            while (m_historyBytes > UDP_HISTORY_BYTES && m_history.size() > 1) {
+                m_historyBytes -= m_history.front().bytes.size();
+                if (m_spare.size() < 4) m_spare.push_back(std::move(m_history.front().bytes));
+                m_history.pop_front();
+            }
+        }
+        BYTE parity[UDP_FRAGMENT_BYTES];
+        for (uint32_t i=0; i<count; ++i) {
+            const BYTE* fragment = data + (size_t)i * UDP_FRAGMENT_BYTES;
+            size_t n = UdpFragmentBytes(size, i);
+            if (i % UDP_FEC_GROUP == 0) memset(parity, 0, sizeof(parity));
+            for (size_t k=0; k<n; ++k) parity[k] ^= fragment[k];
+            h.kind = UDP_DATA;
+            h.index = (uint16_t)i;
+            pace(n);
+            sendDatagram(m_sendBuf, h, fragment, n);
+            datagrams++;
+            if (i % UDP_FEC_GROUP == UDP_FEC_GROUP - 1 || i == count - 1) {
+                uint32_t group = i / UDP_FEC_GROUP;
+                h.kind = UDP_PARITY;
+                h.index = (uint16_t)group;
+                size_t groupBytes = UdpFragmentBytes(size, group * UDP_FEC_GROUP);
+                pace(groupBytes);
+                sendDatagram(m_sendBuf, h, parity, groupBytes);
+                datagrams++;
+                m_counters.parity++;
+            }
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_counters.datagrams += datagrams;
+        m_lastSend = Clock::now();
+        m_probed = false;
+        return true;
+    }
+
+    // Calls fn for message seq and every message sent after it, oldest
+    // first; false if seq has already left the history
+    bool replay(uint32_t seq, const std::function<void(uint32_t, const std::vector<BYTE>&)>& fn) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_history.empty() || seq - m_history.front().seq >= m_history.size()) return false;
+        for (size_t i=seq - m_history.front().seq; i<m_history.size(); ++i) fn(m_history[i].seq, m_history[i].bytes);
+        return true;
+    }
+
+    UdpCounters counters() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_counters;
+    }
+
+private:
+    struct Sent {
+        uint32_t seq = 0;
+        uint64_t offset = 0;
+        std::vector<BYTE> bytes;
+    };
+
+    SOCKET m_socket = INVALID_SOCKET;
+    uint32_t m_token = 0;
+    std::thread m_thread;
+    std::atomic<bool> m_stopping{false};
+    std::atomic<double> m_paceKbps{0};
+    Clock::time_point m_paceNext;
+    std::vector<BYTE> m_sendBuf;            // send() only
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    sockaddr_in m_peer = {};
+    bool m_peerKnown = false;
+    uint32_t m_nextSeq = 0;
+    uint64_t m_offset = 0;
+    std::deque<Sent> m_history;
+    size_t m_historyBytes = 0;
+    std::vector<std::vector<BYTE>> m_spare;
+    Clock::time_point m_lastSend;
+    bool m_probed = true;
+    UdpCounters m_counters;
+
+    void pace(size_t bytes) {
+        double kbps = m_paceKbps;
+        if (kbps <= 0) return;
+        Clock::time_point now = Clock::now();
+        if (m_paceNext < now) m_paceNext = now;
+        // timers are too coarse for single datagrams, so sleeps come in slices
+        if (m_paceNext - now > std::chrono::milliseconds(4)) std::this_thread::sleep_until(m_paceNext - std::chrono::milliseconds(2));
+        m_paceNext += std::chrono::microseconds((int64_t)((bytes + UDP_HEADER_BYTES) * 8000 / kbps));
+    }
+
+    void sendDatagram(std::vector<BYTE>& buf, const UdpHeader& h, const BYTE* payload, size_t size) {
+        buf.resize(UDP_HEADER_BYTES + size);
+        PutUdpHeader(buf.data(), h);
+        memcpy(buf.data() + UDP_HEADER_BYTES, payload, size);
+        sendto(m_socket, (const char*)buf.data(), (int)buf.size(), 0, (const sockaddr*)&m_peer, sizeof(m_peer));
+    }
+
+    // Fragment index of a message in the history again; called with m_mutex held
+    void resend(std::vector<BYTE>& buf, const Sent& sent, uint32_t index) {
+        size_t size = sent.bytes.size();
+        UdpHeader h = { UDP_DATA, (uint16_t)index, sent.seq, (uint16_t)UdpFragmentCount(size), (uint32_t)size, sent.offset };
+        sendDatagram(buf, h, sent.bytes.data() + (size_t)index * UDP_FRAGMENT_BYTES, UdpFragmentBytes(size, index));
+    }
+
+    void serviceLoop() {
+        std::vector<BYTE> in(UDP_HEADER_BYTES + UDP_FRAGMENT_BYTES), out;
+        while (!m_stopping) {
+            sockaddr_in from = {};
+            socklen_t fromLen = sizeof(from);
+            int r = recvfrom(m_socket, (char*)in.data(), (int)in.size(), 0, (sockaddr*)&from, &fromLen);
+            UdpHeader h;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (r > 0 && ParseUdpHeader(in.data(), r, h)) {
+                if (h.kind == UDP_HELLO && h.seq == m_token && !m_peerKnown) {
+                    m_peer = from;
+                    m_peerKnown = true;
+                    m_cv.notify_all();
+                } else if (h.kind == UDP_NACK && m_peerKnown && from.sin_addr.s_addr == m_peer.sin_addr.s_addr && from.sin_port == m_peer.sin_port &&
+                           !m_history.empty() && h.seq - m_history.front().seq < m_history.size()) {
+                    const Sent& sent = m_history[h.seq - m_history.front().seq];
+                    uint32_t count = UdpFragmentCount(sent.bytes.size());
+                    for (int i=UDP_HEADER_BYTES; i + 2 <= r; i += 2) {
+                        uint16_t index = GetLE16(in.data() + i);
+                        if (index == UDP_NACK_ALL) {
+                            for (uint32_t k=0; k<count; ++k) resend(out, sent, k);
+                            m_counters.resent += count;
+                        } else if (index < count) {
+                            resend(out, sent, index);
+                            m_counters.resent++;
+                        }
+                    }
+                }
+            }
+            // a lost tail would otherwise go unnoticed until the next message
+            if (!m_probed && !m_history.empty() && Clock::now() - m_lastSend > std::chrono::milliseconds(UDP_PROBE_MS)) {
+                const Sent& last = m_history.back();
+                resend(out, last, UdpFragmentCount(last.bytes.size()) - 1);
+                m_probed = true;
+                m_counters.probes++;
+            }
+        }
+    }
+};
+
+// A message handed on by UdpVideoReceiver, or a skipped one
+struct UdpDelivery {
+    uint32_t seq = 0;
+    bool lost = false;
+    std::vector<BYTE> message;      // header and body
+    uint64_t endOffset = 0;         // stream offset after it; 0 if unknown
+};
+
+// Client side: reassembles messages, restores single losses per group
+// from parity, NACKs the rest and hands messages on in sequence order
+class UdpVideoReceiver {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    UdpVideoReceiver() {}
+    ~UdpVideoReceiver() { stop(); }
+
+    bool start(const sockaddr_in& server, uint32_t token) {
+        m_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (m_socket == INVALID_SOCKET) return false;
+        IgnoreUdpConnReset(m_socket);
+        // a frame arrives faster than it is reassembled
+        int rcvbuf = 4 << 20;
+        setsockopt(m_socket, SOL_SOCKET, SO_RCVBUF, (char*)&rcvbuf, sizeof(rcvbuf));
+        SetRecvTimeout(m_socket, 10);
+        if (connect(m_socket, (const sockaddr*)&server, sizeof(server)) == SOCKET_ERROR) {
+            closesocket(m_socket);
+            m_socket = INVALID_SOCKET;
+            return false;
+        }
+        m_token = token;
+        m_thread = std::thread(&UdpVideoReceiver::receiveLoop, this);
+        return true;
+    }
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+            m_cv.notify_all();
+        }
+        if (m_thread.joinable()) m_thread.join();
+        if (m_socket != INVALID_SOCKET) closesocket(m_socket);
+        m_socket = INVALID_SOCKET;
+    }
+
+    // Waits for the next message or skip; false once stopped
+    bool next(UdpDelivery& out) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_ready.empty() && !m_stopping) m_cv.wait(lock);
+        if (m_ready.empty()) return false;
+        out = std::move(m_ready.front());
+        m_ready.pop_front();
+        return true;
+    }
+
+    uint64_t repaired() const { return m_repaired; }
+
+private:
+    struct Partial {
+        uint32_t count = 0;             // 0: nothing seen yet, only later messages
+        uint32_t size = 0, missing = 0;
+        uint64_t offset = 0;
+        std::vector<BYTE> data;
+        std::vector<uint8_t> have;
+        std::vector<std::vector<BYTE>> parity;     // per group, empty until it arrives
+        Clock::time_point lastActivity, lastNack;
+    };
+
+    SOCKET m_socket = INVALID_SOCKET;
+    uint32_t m_token = 0;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<UdpDelivery> m_ready;
+    bool m_stopping = false;
+    // receive thread only
+    std::unordered_map<uint32_t, Partial> m_partial;
+    uint32_t m_nextSeq = 0, m_endSeq = 0;      // messages [m_nextSeq, m_endSeq) are being tracked
+    std::vector<BYTE> m_scratch;
+    Clock::time_point m_lastScan;
+    std::atomic<uint64_t> m_repaired{0};
+
+    void receiveLoop() {
+        std::vector<BYTE> buf(UDP_HEADER_BYTES + UDP_FRAGMENT_BYTES);
+        Clock::time_point lastHello;
+        bool gotData = false;
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_stopping) break;
+            }
+            Clock::time_point now = Clock::now();
+            if (!gotData && now - lastHello > std::chrono::milliseconds(100)) {
+                UdpHeader hello = { UDP_HELLO, 0, m_token, 0, 0, 0 };
+                PutUdpHeader(buf.data(), hello);
+                ::send(m_socket, (const char*)buf.data(), (int)UDP_HEADER_BYTES, 0);
+                lastHello = now;
+            }
+            int r = recv(m_socket, (char*)buf.data(), (int)buf.size(), 0);
+            UdpHeader h;
+            if (r > 0 && ParseUdpHeader(buf.data(), r, h) && (h.kind == UDP_DATA || h.kind == UDP_PARITY)) {
+                gotData = true;
+                onDatagram(h, buf.data() + UDP_HEADER_BYTES, r - UDP_HEADER_BYTES);
+            }
+            deliver();
+        }
+    }
+
+    void onDatagram(const UdpHeader& h, const BYTE* payload, size_t size) {
+        // already delivered or skipped, or too far ahead to be plausible
+        if (h.seq - m_nextSeq >= UDP_WINDOW) return;
+        if (h.count == 0 || h.count == UDP_NACK_ALL || UdpFragmentCount(h.size) != h.count) return;
+        Clock::time_point now = Clock::now();
+        // messages skipped over are missing as a whole
+        while (h.seq - m_endSeq < UDP_WINDOW) {
+            Partial& gap = m_partial[m_endSeq++];
+            gap.lastActivity = gap.lastNack = now;
+        }
+        Partial& p = m_partial[h.seq];
+        if (p.count == 0) {
+            p.count = h.count;
+            p.size = h.size;
+            p.offset = h.offset;
+            p.missing = h.count;
+            p.data.resize(h.size);
+            p.have.assign(h.count, 0);
+            p.parity.resize((h.count + UDP_FEC_GROUP - 1) / UDP_FEC_GROUP);
+        } else if (p.count != h.count || p.size != h.size) {
+            return;
+        }
+        p.lastActivity = now;
+        uint32_t group;
+        if (h.kind == UDP_DATA) {
+            if (h.index >= p.count || p.have[h.index] || size != UdpFragmentBytes(p.size, h.index)) return;
+            memcpy(p.data.data() + (size_t)h.index * UDP_FRAGMENT_BYTES, payload, size);
+            p.have[h.index] = 1;
+            p.missing--;
+            group = h.index / UDP_FEC_GROUP;
+        } else {
+            group = h.index;
+            if (group >= p.parity.size() || size != UdpFragmentBytes(p.size, group * UDP_FEC_GROUP)) return;
+            p.parity[group].assign(payload, payload + size);
+        }
+        repair(p, group);
+    }
+
+    // One missing fragment of a group is the XOR of its parity and the rest
+    void repair(Partial& p, uint32_t group) {
+        if (group >= p.parity.size() || p.parity[group].empty()) return;
+        uint32_t first = group * UDP_FEC_GROUP, last = min(first + UDP_FEC_GROUP, p.count);
+        uint32_t lostIndex = 0, lost = 0;
+        for (uint32_t i=first; i<last; ++i) {
+            if (!p.have[i]) { lostIndex = i; lost++; }
+        }
+        if (lost != 1) return;
+        m_scratch = p.parity[group];
+        for (uint32_t i=first; i<last; ++i) {
+            if (i == lostIndex) continue;
+            const BYTE* fragment = p.data.data() + (size_t)i * UDP_FRAGMENT_BYTES;
+            size_t n = UdpFragmentBytes(p.size, i);
+            for (size_t k=0; k<n; ++k) m_scratch[k] ^= fragment[k];
+        }
+        memcpy(p.data.data() + (size_t)lostIndex * UDP_FRAGMENT_BYTES, m_scratch.data(), UdpFragmentBytes(p.size, lostIndex));
+        p.have[lostIndex] = 1;
+        p.missing--;
+        m_repaired++;
+    }
+
+    // Hands on complete messages in order, skips the next one due once it
+    // has stalled for too long and NACKs the gaps
+    void deliver() {
+        Clock::time_point now = Clock::now();
+        std::vector<UdpDelivery> out;
+        while (m_nextSeq != m_endSeq) {
+            auto it = m_partial.find(m_nextSeq);
+            Partial& p = it->second;
+            bool complete = p.count > 0 && p.missing == 0;
+            if (!complete && now - p.lastActivity < std::chrono::milliseconds(UDP_GIVE_UP_MS)) break;
+            UdpDelivery d;
+            d.seq = m_nextSeq;
+            d.lost = !complete;
+            if (complete) {
+                d.message.swap(p.data);
+                d.endOffset = p.offset + p.size;
+            } else if (p.count > 0) {
+                d.endOffset = p.offset + p.size;
+            } else {
+                auto after = m_partial.find(m_nextSeq + 1);
+                if (after != m_partial.end() && after->second.count > 0) d.endOffset = after->second.offset;
+            }
+            out.push_back(std::move(d));
+            m_partial.erase(it);
+            m_nextSeq++;
+        }
+        if (!out.empty()) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (UdpDelivery& d : out) m_ready.push_back(std::move(d));
+            m_cv.notify_all();
+        }
+
+        if (now - m_lastScan < std::chrono::milliseconds(5)) return;
+        m_lastScan = now;
+        std::vector<BYTE> nack;
+        for (uint32_t seq=m_nextSeq; seq!=m_endSeq; ++seq) {
+            Partial& p = m_partial[seq];
+            if (p.count > 0 && p.missing == 0) continue;
+            // a message still arriving gets time to finish, and its parity to arrive
+            bool laterSeen = seq + 1 != m_endSeq;
+            if (now - p.lastNack < std::chrono::milliseconds(UDP_NACK_MS)) continue;
+            if (!laterSeen && now - p.lastActivity < std::chrono::milliseconds(UDP_NACK_MS)) continue;
+            p.lastNack = now;
+            nack.assign(UDP_HEADER_BYTES, 0);
+            UdpHeader h = { UDP_NACK, 0, seq, 0, 0, 0 };
+            PutUdpHeader(nack.data(), h);
+            if (p.count == 0) {
+                nack.push_back((BYTE)UDP_NACK_ALL);
+                nack.push_back((BYTE)(UDP_NACK_ALL >> 8));
+            } else {
+                for (uint32_t i=0; i<p.count && nack.size() < UDP_HEADER_BYTES + UDP_FRAGMENT_BYTES; ++i) {
+                    if (p.have[i]) continue;
+                    nack.push_back((BYTE)i);
+                    nack.push_back((BYTE)(i >> 8));
+                }
+            }
+            ::send(m_socket, (const char*)nack.data(), (int)nack.size(), 0);
+        }
+    }
+};
+
+#ifdef _WIN32
+// Find the GDI+ JPEG encoder CLSID
+bool GetJpegEncoderClsid(CLSID& clsidJpeg) {
+    UINT nEnc = 0, sizeEnc = 0;
+    GetImageEncodersSize(&nEnc, &sizeEnc);
+    if (sizeEnc == 0 || nEnc == 0) return false;
+    ImageCodecInfo* pInfo = (ImageCodecInfo*)malloc(sizeEnc);
+    if (!pInfo) return false;
+    GetImageEncoders(nEnc, sizeEnc, pInfo);
+    clsidJpeg = CLSID{0};
+    for (UINT i=0;i<nEnc;++i) {
+        if (wcscmp(pInfo[i].MimeType, L"image/jpeg") == 0) { clsidJpeg = pInfo[i].Clsid; break;}
+    }
+    free(pInfo);
+    return !(clsidJpeg.Data1 == 0 && clsidJpeg.Data2 == 0);
+}
+
+// Save a GDI+ image as JPEG bytes
+bool SaveImageToJPEGBytes(Image& img, std::vector<BYTE>& out, ULONG quality) {
+    CLSID clsidJpeg;
+    if (!GetJpegEncoderClsid(clsidJpeg)) return false;
+
+    IStream* ist = nullptr;
+    if (CreateStreamOnHGlobal(NULL, TRUE, &ist) != S_OK) return false;
+
+    EncoderParameters ep;
+    ep.Count = 1;
+    EncoderParameter e;
+    e.Guid = EncoderQuality;
+    e.NumberOfValues = 1;
+    e.Type = EncoderParameterValueTypeLong;
+    e.Value = &quality;
+    ep.Parameter[0] = e;
+
+    bool ok = false;
+    if (img.Save(ist, &clsidJpeg, &ep) == Ok) {
+        HGLOBAL hg = NULL;
+        if (GetHGlobalFromStream(ist, &hg) == S_OK && hg) {
+            SIZE_T sz = GlobalSize(hg);
+            if (sz > 0) {
+                void* p = GlobalLock(hg);
+                if (p) {
+                    out.assign((BYTE*)p, (BYTE*)p + sz);
+                    GlobalUnlock(hg);
+                    ok = true;
+                }
+            }
+        }
+    }
+    if (ist) ist->Release();
+    return ok;
+}
+
+// Encode a region of a top-down 32bpp BGRA buffer to JPEG bytes via GDI+.
+// The server uses JpegEncoder; this is the baseline for "bench jpeg".
+bool EncodeBGRAToJPEGBytes(const BYTE* pixels, int stride, int w, int h, std::vector<BYTE>& out, ULONG quality=80) {
+    if (!pixels || w <= 0 || h <= 0) return false;
+    Bitmap region(w, h, stride, PixelFormat32bppRGB, (BYTE*)pixels);
+    if (region.GetLastStatus() != Ok) return false;
+    return SaveImageToJPEGBytes(region, out, quality);
+}
+
+// Decode JPEG bytes to HBITMAP
+HBITMAP DecodeJPEGBytesToHBITMAP(const BYTE* data, size_t len) {
+    if (!data || len == 0) return NULL;
+    HBITMAP hBmp = NULL;
+    HGLOBAL hGlobal = GlobalAlloc(GMEM_MOVEABLE, len);
+    if (!hGlobal) return NULL;
+    void* mem = GlobalLock(hGlobal);
+    if (!mem) { GlobalFree(hGlobal); return NULL; }
+    memcpy(mem, data, len);
+    GlobalUnlock(hGlobal);
+    IStream* ist = nullptr;
+    if (CreateStreamOnHGlobal(hGlobal, TRUE, &ist) != S_OK) { GlobalFree(hGlobal); return NULL; }
+    Bitmap* b = Bitmap::FromStream(ist, FALSE);
+    if (ist) ist->Release();
+    if (!b || b->GetLastStatus() != Ok) { delete b; GlobalFree(hGlobal); return NULL; }
+    b->GetHBITMAP(Color(0,0,0), &hBmp);
+    delete b;
+    GlobalFree(hGlobal);
+    return hBmp;
+}
+
+// Window selection dialog
+HWND g_selectedWindow = NULL;
+BOOL CALLBACK EnumWindowsProc(HWND hwnd, LPARAM lParam) {
+    if (!IsWindowVisible(hwnd)) return TRUE;
+
+    char title[256];
+    GetWindowTextA(hwnd, title, sizeof(title));
+    if (strlen(title) == 0) return TRUE;
+
+    std::vector<std::string>* windows = (std::vector<std::string>*)lParam;
+    std::stringstream ss;
+    ss << (void*)hwnd << "|" << title;
+    windows->push_back(ss.str());
+    return TRUE;
+}
+
+HWND SelectWindowToCapture() {
+    std::vector<std::string> windows;
+    EnumWindows(EnumWindowsProc, (LPARAM)&windows);
+
+    std::cout << "\nSelect what to capture:\n";
+    std::cout << "0. Full Screen (default)\n";
+    for (size_t i = 0; i < windows.size() && i < 20; ++i) {
+        size_t pos = windows[i].find('|');
+        std::string title = windows[i].substr(pos + 1);
+        std::cout << (i + 1) << ". " << title << "\n";
+    }
+
+    std::cout << "\nEnter choice (0-" << min(windows.size(), (size_t)20) << "): ";
+    std::string input;
+    std::getline(std::cin, input);
+
+    int choice = 0;
+    if (!input.empty()) choice = atoi(input.c_str());
+
+    if (choice == 0 || choice > (int)windows.size()) {
+        std::cout << "Capturing full screen\n";
+        return NULL;
+    }
+
+    size_t pos = windows[choice - 1].find('|');
+    std::string hwndStr = windows[choice - 1].substr(0, pos);
+    HWND hwnd = (HWND)strtoull(hwndStr.c_str(), NULL, 16);
+
+    std::cout << "Capturing window: " << windows[choice - 1].substr(pos + 1) << "\n";
+    return hwnd;
+}
+#endif
+
+// ---------- frame sources ----------
+// A frame source fills a top-down 32bpp BGRA buffer of width*height*4 bytes.
+// The server pipeline only sees this interface, so it can run on a live
+// desktop (GDI), on generated content or on a recorded capture file.
+class FrameSource {
+public:
+    virtual ~FrameSource() {}
+    virtual bool open(int& width, int& height) = 0;
+    virtual bool grab(BYTE* dst) = 0;
+    virtual void close() {}
+    // Live sources are paced by the capture interval; offline ones run flat out.
+    virtual bool realtime() const { return false; }
+};
+
+#ifdef _WIN32
+// Desktop or window capture via BitBlt + GetDIBits
+class GdiFrameSource : public FrameSource {
+public:
+    GdiFrameSource(HWND window) : m_window(window), m_screen(NULL), m_mem(NULL), m_bmp(NULL), m_old(NULL), m_w(0), m_h(0) {}
+    ~GdiFrameSource() { close(); }
+
+    bool open(int& width, int& height) override {
+        if (m_window) {
+            m_screen = GetDC(m_window);
+            RECT rect;
+            GetClientRect(m_window, &rect);
+            m_w = rect.right - rect.left;
+            m_h = rect.bottom - rect.top;
+        } else {
+            m_screen = GetDC(NULL);
+            m_w = GetSystemMetrics(SM_CXSCREEN);
+            m_h = GetSystemMetrics(SM_CYSCREEN);
+        }
+
+        if (!m_screen || m_w <= 0 || m_h <= 0) {
+            std::cerr << "Failed to get capture context\n";
+            close();
+            return false;
+        }
+
+        m_mem = CreateCompatibleDC(m_screen);
+        if (!m_mem) {
+            std::cerr << "CreateCompatibleDC failed\n";
+            close();
+            return false;
+        }
+
+        m_bmp = CreateCompatibleBitmap(m_screen, m_w, m_h);
+        if (!m_bmp) {
+            std::cerr << "CreateCompatibleBitmap failed\n";
+            close();
+            return false;
+        }
+
+        m_old = SelectObject(m_mem, m_bmp);
+        if (m_old == HGDI_ERROR) {
+            std::cerr << "SelectObject failed\n";
+            m_old = NULL;
+            close();
+            return false;
+        }
+
+        m_bi = BITMAPINFO{}; m_bi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+        m_bi.bmiHeader.biWidth = m_w; m_bi.bmiHeader.biHeight = -m_h;
+        m_bi.bmiHeader.biPlanes = 1; m_bi.bmiHeader.biBitCount = 32; m_bi.bmiHeader.biCompression = BI_RGB;
+
+        width = m_w; height = m_h;
+        return true;
+    }
+
+    bool grab(BYTE* dst) override {
+        if (!BitBlt(m_mem, 0,0, m_w, m_h, m_screen, 0, 0, SRCCOPY)) {
+            std::cerr<<"BitBlt failed\n";
+            return false;
+        }
+
+        // overlay cursor only for full screen
+        if (!m_window) {
+            CURSORINFO ci{}; ci.cbSize = sizeof(ci);
+            if (GetCursorInfo(&ci) && (ci.flags & CURSOR_SHOWING)) {
+                ICONINFO ii;
+                if (GetIconInfo(ci.hCursor, &ii)) {
+                    DrawIconEx(m_mem, ci.ptScreenPos.x - ii.xHotspot, ci.ptScreenPos.y - ii.yHotspot, ci.hCursor, 0,0,0,NULL,DI_NORMAL);
+                    if (ii.hbmMask) DeleteObject(ii.hbmMask);
+                    if (ii.hbmColor) DeleteObject(ii.hbmColor);
+                }
+            }
+        }
+
+        if (!GetDIBits(m_mem, m_bmp, 0, m_h, dst, &m_bi, DIB_RGB_COLORS)) {
+            std::cerr<<"GetDIBits failed\n";
+            return false;
+        }
+        return true;
+    }
+
+    void close() override {
+        if (m_mem && m_old) SelectObject(m_mem, m_old);
+        if (m_bmp) DeleteObject(m_bmp);
+        if (m_mem) DeleteDC(m_mem);
+        if (m_screen) ReleaseDC(m_window ? m_window : NULL, m_screen);
+        m_old = NULL; m_bmp = NULL; m_mem = NULL; m_screen = NULL;
+    }
+
+    bool realtime() const override { return true; }
+
+private:
+    HWND m_window;
+    HDC m_screen, m_mem;
+    HBITMAP m_bmp;
+    HGDIOBJ m_old;
+    BITMAPINFO m_bi;
+    int m_w, m_h;
+};
+#endif
+
+// Cheap deterministic hash for generated content
+inline uint32_t SynthHash(uint32_t x) {
+    x ^= x >> 16; x *= 0x7feb352d;
+    x ^= x >> 15; x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+// Generated desktop workloads for headless profiling:
+//   scroll - a text document scrolling up a few pixels per frame
+//   video  - a large region where every pixel changes every frame
+//   drag   - a window dragged across a static desktop
+//   typing - text appearing one glyph per frame with a blinking caret
+//   ide    - dark code editor with colored, antialiased text scrolling slowly
+class SyntheticFrameSource : public FrameSource {
+public:
+    SyntheticFrameSource(const std::string& pattern, int w, int h) : m_pattern(pattern), m_w(w), m_h(h), m_frame(0) {}
+
+    bool open(int& width, int& height) override {
+        if (m_w <= 0 || m_h <= 0) return false;
+        if (m_pattern != "scroll" && m_pattern != "video" && m_pattern != "drag" && m_pattern != "typing" && m_pattern != "ide") {
+            std::cerr << "Unknown synthetic pattern: " << m_pattern << "\n";
+            return false;
+        }
+        // static desktop background: vertical gradient with a taskbar
+        m_base.resize((size_t)m_w * m_h);
+        for (int y=0; y<m_h; ++y) {
+            uint32_t c = (y >= m_h - 40) ? 0xFF202020 : (0xFF000000 | ((20 + y * 60 / m_h) << 16) | ((60 + y * 80 / m_h) << 8) | (120 + y * 100 / m_h));
+            for (int x=0; x<m_w; ++x) m_base[(size_t)y * m_w + x] = c;
+        }
+        width = m_w; height = m_h;
+        m_frame = 0;
+        return true;
+    }
+
+    bool grab(BYTE* dst) override {
+        uint32_t* px = (uint32_t*)dst;
+        memcpy(px, m_base.data(), m_base.size() * 4);
+
+        if (m_pattern == "scroll") {
+            // document window covering most of the screen, scrolled by 3 rows per frame
+            int wx = m_w / 16, wy = m_h / 16, ww = m_w - 2 * wx, wh = m_h - 2 * wy - 40;
+            drawWindow(px, wx, wy, ww, wh);
+            drawText(px, wx + 8, wy + 32, ww - 16, wh - 40, m_frame * 3, 0x7fffffff);
+        } else if (m_pattern == "video") {
+            int vx = m_w / 5, vy = m_h / 5, vw = m_w * 3 / 5, vh = m_h * 3 / 5;
+            uint32_t t = (uint32_t)m_frame;
+            for (int y=0; y<vh; ++y) {
+                uint32_t* row = px + (size_t)(vy + y) * m_w + vx;
+                for (int x=0; x<vw; ++x) {
+                    uint32_t n = SynthHash((uint32_t)(y * vw + x) ^ (t * 0x9e3779b9)) & 0x1f;
+                    uint32_t r = (uint32_t)((x + t * 4) & 0xff) ^ n;
+                    uint32_t g = (uint32_t)((y + t * 2) & 0xff) ^ n;
+                    uint32_t b = (uint32_t)(((x + y) / 2 + t * 3) & 0xff);
+                    row[x] = 0xFF000000 | (r << 16) | (g << 8) | b;
+                }
+            }
+        } else if (m_pattern == "drag") {
+            int ww = min(640, m_w / 2), wh = min(420, m_h / 2);
+            int spanX = max(1, m_w - ww), spanY = max(1, m_h - 40 - wh);
+            int px0 = (m_frame * 12) % (2 * spanX), py0 = (m_frame * 7) % (2 * spanY);
+            int wx = px0 < spanX ? px0 : 2 * spanX - px0;
+            int wy = py0 < spanY ? py0 : 2 * spanY - py0;
+            drawWindow(px, wx, wy, ww, wh);
+            drawText(px, wx + 8, wy + 32, ww - 16, wh - 40, 0, 0x7fffffff);
+        } else if (m_pattern == "ide") {
+            int wx = m_w / 16, wy = m_h / 16, ww = m_w - 2 * wx, wh = m_h - 2 * wy - 40;
+            drawWindow(px, wx, wy, ww, wh);
+            for (int y=wy + 24; y<min(m_h, wy + wh); ++y)
+                for (int x=max(0, wx); x<min(m_w, wx + ww); ++x) px[(size_t)y * m_w + x] = IDE_BACKGROUND;
+            drawCode(px, wx + 8, wy + 32, ww - 16, wh - 40, m_frame * 2);
+        } else if (m_pattern == "typing") {
+            int wx = m_w / 16, wy = m_h / 16, ww = m_w - 2 * wx, wh = m_h - 2 * wy - 40;
+            drawWindow(px, wx, wy, ww, wh);
+            int caretX = -1, caretY = -1;
+            drawText(px, wx + 8, wy + 32, ww - 16, wh - 40, 0, m_frame, &caretX, &caretY);
+            if ((m_frame / 15) % 2 == 0 && caretX >= 0) {
+                int cx = wx + 8 + caretX, cy = wy + 32 + caretY;
+                for (int y=0; y<GLYPH_H && cy + y < m_h; ++y)
+                    for (int x=0; x<2 && cx + x < m_w; ++x) px[(size_t)(cy + y) * m_w + cx + x] = 0xFF000000;
+            }
+        }
+        ++m_frame;
+        return true;
+    }
+
+private:
+    static const int GLYPH_W = 8, GLYPH_H = 16;
+    std::string m_pattern;
+    int m_w, m_h;
+    int m_frame;
+    std::vector<uint32_t> m_base;
+
+    void drawWindow(uint32_t* px, int wx, int wy, int ww, int wh) {
+        for (int y=max(0, wy); y<min(m_h, wy + wh); ++y) {
+            uint32_t c = (y - wy < 24) ? 0xFF2B579A : 0xFFFFFFFF;
+            uint32_t* row = px + (size_t)y * m_w;
+            for (int x=max(0, wx); x<min(m_w, wx + ww); ++x) row[x] = c;
+        }
+    }
+
+    static const uint32_t IDE_BACKGROUND = 0xFF1E1E1E;
+
+    // Per-channel blend of two colors, weight a/4 on the first
+    static uint32_t Blend(uint32_t c1, uint32_t c2, int a) {
+        uint32_t out = 0xFF000000;
+        for (int sh=0; sh<24; sh+=8) {
+            uint32_t v = (((c1 >> sh) & 0xFF) * a + ((c2 >> sh) & 0xFF) * (4 - a)) / 4;
+            out |= v << sh;
+        }
+        return out;
+    }
+
+    // Like drawText, but tokens get syntax colors and glyph edges are
+    // smoothed against the editor background as font rendering does
+    void drawCode(uint32_t* px, int ox, int oy, int tw, int th, int scrollY) {
+        static const uint32_t tokenColors[] = { 0xFF9CDCFE, 0xFF569CD6, 0xFFCE9178, 0xFF6A9955, 0xFFD4D4D4, 0xFFC586C0 };
+        int cols = tw / GLYPH_W;
+        for (int y=0; y<th && oy + y < m_h; ++y) {
+            int docY = y + scrollY;
+            int line = docY / GLYPH_H, gy = docY % GLYPH_H;
+            if (gy < 3 || gy > 13) continue;
+            int indent = (int)(SynthHash((uint32_t)line * 7 + 3) % 5) * 4;
+            int lineLen = (int)(SynthHash((uint32_t)line + 1) % (uint32_t)max(1, cols - indent));
+            uint32_t* row = px + (size_t)(oy + y) * m_w + ox;
+            for (int c=indent; c<indent + lineLen; ++c) {
+                uint32_t glyph = SynthHash((uint32_t)(line * 131 + c) + 1);
+                if ((glyph & 7) == 0) continue;
+                uint32_t color = tokenColors[SynthHash((uint32_t)(line * 31 + c / 6)) % 6];
+                for (int gx=1; gx<GLYPH_W - 1; ++gx) {
+                    bool on = (glyph >> ((gy * 3 + gx) & 31)) & 1;
+                    bool left = gx > 1 && ((glyph >> ((gy * 3 + gx - 1) & 31)) & 1);
+                    bool right = gx < GLYPH_W - 2 && ((glyph >> ((gy * 3 + gx + 1) & 31)) & 1);
+                    if (on) row[c * GLYPH_W + gx] = (left && right) ? color : Blend(color, IDE_BACKGROUND, 3);
+                    else if (left || right) row[c * GLYPH_W + gx] = Blend(color, IDE_BACKGROUND, left && right ? 2 : 1);
+                }
+            }
+        }
+    }
+
+    // Draws pseudo-glyphs from a virtual document starting at pixel row
+    // scrollY; at most maxGlyphs glyphs are drawn. The caret position after
+    // the last glyph (relative to ox,oy) is stored if requested.
+    void drawText(uint32_t* px, int ox, int oy, int tw, int th, int scrollY, int maxGlyphs, int* caretX = nullptr, int* caretY = nullptr) {
+        int cols = tw / GLYPH_W;
+        int curLine = -1, lineLen = 0;
+        long long lineStart = 0, nextStart = 0;   // glyphs typed before the current line
+        for (int y=0; y<th && oy + y < m_h; ++y) {
+            int docY = y + scrollY;
+            int line = docY / GLYPH_H, gy = docY % GLYPH_H;
+            if (line != curLine) {
+                curLine = line;
+                lineStart = nextStart;
+                lineLen = (int)(SynthHash((uint32_t)line + 1) % (uint32_t)max(1, cols));
+                nextStart = lineStart + lineLen;
+            }
+            uint32_t* row = px + (size_t)(oy + y) * m_w + ox;
+            for (int c=0; c<lineLen; ++c) {
+                if (lineStart + c >= maxGlyphs) {
+                    if (caretX && caretY && *caretX < 0) { *caretX = c * GLYPH_W; *caretY = y; }
+                    break;
+                }
+                uint32_t glyph = SynthHash((uint32_t)(line * 131 + c) + 1);
+                if ((glyph & 7) == 0 || gy < 3 || gy > 13) continue;   // spaces and line gaps
+                for (int gx=1; gx<GLYPH_W - 1; ++gx) {
+                    if ((glyph >> ((gy * 3 + gx) & 31)) & 1) row[c * GLYPH_W + gx] = 0xFF101010;
+                }
+            }
+        }
+    }
+};
+
+// Replays a capture recorded with FrameRecorder: a "ISSR" header with width
+// and height followed by raw BGRA frames. Rewinds at end of file.
+const uint32_t REPLAY_MAGIC = 0x52535349;
+
+class ReplayFrameSource : public FrameSource {
+public:
+    ReplayFrameSource(const std::string& path) : m_path(path), m_w(0), m_h(0) {}
+
+    bool open(int& width, int& height) override {
+        m_in.open(m_path, std::ios::binary);
+        if (!m_in) { std::cerr << "Cannot open replay file " << m_path << "\n"; return false; }
+        uint32_t hdr[3] = {0, 0, 0};
+        m_in.read((char*)hdr, sizeof(hdr));
+        if (!m_in || hdr[0] != REPLAY_MAGIC || hdr[1] == 0 || hdr[2] == 0 || hdr[1] > 10000 || hdr[2] > 10000) {
+            std::cerr << "Bad replay file " << m_path << "\n";
+            return false;
+        }
+        m_w = (int)hdr[1]; m_h = (int)hdr[2];
+        width = m_w; height = m_h;
+        return true;
+    }
+
+    bool grab(BYTE* dst) override {
+        std::streamsize frameBytes = (std::streamsize)m_w * m_h * 4;
+        m_in.read((char*)dst, frameBytes);
+        if (m_in.gcount() == frameBytes) return true;
+        m_in.clear();
+        m_in.seekg(12, std::ios::beg);
+        m_in.read((char*)dst, frameBytes);
+        return m_in.gcount() == frameBytes;
+    }
+
+    void close() override { m_in.close(); }
+
+private:
+    std::string m_path;
+    std::ifstream m_in;
+    int m_w, m_h;
+};
+
+// Writes frames in the format ReplayFrameSource reads
+class FrameRecorder {
+public:
+    bool open(const std::string& path, int w, int h) {
+        m_out.open(path, std::ios::binary | std::ios::trunc);
+        if (!m_out) return false;
+        uint32_t hdr[3] = { REPLAY_MAGIC, (uint32_t)w, (uint32_t)h };
+        m_out.write((const char*)hdr, sizeof(hdr));
+        m_frameBytes = (size_t)w * h * 4;
+        return (bool)m_out;
+    }
+    bool write(const BYTE* frame) {
+        m_out.write((const char*)frame, (std::streamsize)m_frameBytes);
+        return (bool)m_out;
+    }
+private:
+    std::ofstream m_out;
+    size_t m_frameBytes = 0;
+};
+
+// Source spec: "gdi", "synthetic:<pattern>[:WxH]" or "replay:<file>"
+FrameSource* CreateFrameSource(const std::string& spec, HWND window) {
+#ifdef _WIN32
+    if (spec.empty() || spec == "gdi") return new GdiFrameSource(window);
+#else
+    if (spec.empty() || spec == "gdi") { std::cerr << "gdi capture is Windows only\n"; return nullptr; }
+#endif
+    if (spec.compare(0, 10, "synthetic:") == 0) {
+        std::string rest = spec.substr(10);
+        int w = 1920, h = 1080;
+        size_t colon = rest.find(':');
+        if (colon != std::string::npos) {
+            std::string dims = rest.substr(colon + 1);
+            rest = rest.substr(0, colon);
+            size_t x = dims.find('x');
+            if (x == std::string::npos) return nullptr;
+            w = atoi(dims.substr(0, x).c_str());
+            h = atoi(dims.substr(x + 1).c_str());
+        }
+        return new SyntheticFrameSource(rest, w, h);
+    }
+    if (spec.compare(0, 7, "replay:") == 0) return new ReplayFrameSource(spec.substr(7));
+    std::cerr << "Unknown frame source: " << spec << "\n";
+    return nullptr;
+}
+
+// ---------- tile hashing ----------
+// Tile change detection hashes every captured pixel each frame, so the hash
+// has SSE2 and AVX2 versions picked at runtime. All versions compute the
+// same value: four 64-bit lanes take 32-byte stripes with a per-stripe key
+// (xxh3-style multiply-accumulate), and the lanes are scrambled after each
+// row, so swapped or cancelling pixel changes still change the hash.
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define ISS_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ISS_TARGET_AVX2
+#else
+#include <cpuid.h>
+#define ISS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+struct CpuFeatures {
+    bool sse2 = false, avx2 = false;
+};
+
+const CpuFeatures& GetCpuFeatures() {
+    static CpuFeatures f = [] {
+        CpuFeatures c;
+#if defined(ISS_X86) && defined(_MSC_VER)
+        int r[4];
+        __cpuid(r, 0);
+        int maxLeaf = r[0];
+        __cpuid(r, 1);
+        c.sse2 = (r[3] & (1 << 26)) != 0;
+        bool osxsave = (r[2] & (1 << 27)) != 0, avx = (r[2] & (1 << 28)) != 0;
+        if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6) {
+            __cpuidex(r, 7, 0);
+            c.avx2 = (r[1] & (1 << 5)) != 0;
+        }
+#elif defined(ISS_X86)
+        __builtin_cpu_init();
+        c.sse2 = __builtin_cpu_supports("sse2");
+        c.avx2 = __builtin_cpu_supports("avx2");
+#endif
+        if (getenv("ISS_NO_AVX2")) c.avx2 = false;
+        return c;
+    }();
+    return f;
+}
+
+const int HASH_LANES = 4;
+const int HASH_STRIPE_BYTES = 32;
+const int HASH_BLOCK_STRIPES = 64;     // stripes between scrambles
+const uint64_t HASH_PRIME32 = 0x9E3779B1u;
+const uint64_t HASH_PRIME64 = 0x9E3779B185EBCA87ull;
+
+// Per-stripe lane keys plus the scramble key
+struct TileHashKeys {
+    uint64_t stripe[HASH_BLOCK_STRIPES][HASH_LANES];
+    uint64_t scramble[HASH_LANES];
+    TileHashKeys() {
+        uint64_t s = 0x4C55504445534B31ull;
+        auto next = [&s] {
+            uint64_t z = (s += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        };
+        for (auto& st : stripe) for (auto& k : st) k = next();
+        for (auto& k : scramble) k = next();
+    }
+};
+const TileHashKeys& GetTileHashKeys() {
+    static const TileHashKeys keys;
+    return keys;
+}
+
+inline uint64_t HashAvalanche(uint64_t h) {
+    h ^= h >> 33; h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33; h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+inline uint64_t HashFinish(const uint64_t acc[HASH_LANES], int w, int h) {
+    uint64_t r = ((uint64_t)(uint32_t)w << 32 | (uint32_t)h) * HASH_PRIME64;
+    for (int i=0; i<HASH_LANES; ++i) r = (r ^ HashAvalanche(acc[i] + i)) * HASH_PRIME64;
+    return HashAvalanche(r);
+}
+
+inline void HashInitAcc(uint64_t acc[HASH_LANES]) {
+    acc[0] = 0x165667B19E3779F9ull; acc[1] = 0x9E3779B185EBCA87ull;
+    acc[2] = 0xC2B2AE3D27D4EB4Full; acc[3] = 0x85EBCA77C2B2AE63ull;
+}
+
+uint64_t HashTileScalar(const BYTE* pixels, int stride, int w, int h) {
+    const TileHashKeys& K = GetTileHashKeys();
+    uint64_t acc[HASH_LANES];
+    HashInitAcc(acc);
+    int rowBytes = w * 4;
+    for (int y=0; y<h; ++y) {
+        const BYTE* row = pixels + (size_t)y * stride;
+        int s = 0;
+        for (int off=0; off<rowBytes; off+=HASH_STRIPE_BYTES) {
+            uint64_t d[HASH_LANES] = {0, 0, 0, 0};
+            memcpy(d, row + off, min(HASH_STRIPE_BYTES, rowBytes - off));
+            for (int i=0; i<HASH_LANES; ++i) {
+                uint64_t dk = d[i] ^ K.stripe[s][i];
+                acc[i] += d[i ^ 1] + (dk & 0xFFFFFFFFu) * (dk >> 32);
+            }
+            if (++s == HASH_BLOCK_STRIPES || off + HASH_STRIPE_BYTES >= rowBytes) {
+                for (int i=0; i<HASH_LANES; ++i) {
+                    acc[i] ^= acc[i] >> 47;
+                    acc[i] ^= K.scramble[i];
+                    acc[i] *= HASH_PRIME32;
+                }
+                s = 0;
+            }
+        }
+    }
+    return HashFinish(acc, w, h);
+}
+
+#ifdef ISS_X86
+uint64_t HashTileSSE2(const BYTE* pixels, int stride, int w, int h) {
+    const TileHashKeys& K = GetTileHashKeys();
+    alignas(16) uint64_t acc[HASH_LANES];
+    HashInitAcc(acc);
+    __m128i a0 = _mm_load_si128((const __m128i*)acc), a1 = _mm_load_si128((const __m128i*)(acc + 2));
+    const __m128i lo32 = _mm_set1_epi64x(0xFFFFFFFFll);
+    const __m128i prime = _mm_set1_epi64x((long long)HASH_PRIME32);
+    const __m128i sk0 = _mm_loadu_si128((const __m128i*)K.scramble), sk1 = _mm_loadu_si128((const __m128i*)(K.scramble + 2));
+    int rowBytes = w * 4;
+    alignas(16) BYTE tail[HASH_STRIPE_BYTES];
+
+    auto accumulate = [&](__m128i& a, __m128i d, __m128i k) {
+        __m128i dk = _mm_xor_si128(d, k);
+        __m128i prod = _mm_mul_epu32(_mm_and_si128(dk, lo32), _mm_srli_epi64(dk, 32));
+        a = _mm_add_epi64(a, _mm_add_epi64(_mm_shuffle_epi32(d, _MM_SHUFFLE(1,0,3,2)), prod));
+    };
+    auto scramble = [&](__m128i& a, __m128i k) {
+        a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+        a = _mm_xor_si128(a, k);
+        __m128i lo = _mm_mul_epu32(a, prime);
+        __m128i hi = _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), prime), 32);
+        a = _mm_add_epi64(lo, hi);
+    };
+
+    for (int y=0; y<h; ++y) {
+        const BYTE* row = pixels + (size_t)y * stride;
+        int s = 0;
+        for (int off=0; off<rowBytes; off+=HASH_STRIPE_BYTES) {
+            const BYTE* src = row + off;
+            if (rowBytes - off < HASH_STRIPE_BYTES) {
+                memset(tail, 0, sizeof(tail));
+                memcpy(tail, src, rowBytes - off);
+                src = tail;
+            }
+            accumulate(a0, _mm_loadu_si128((const __m128i*)src), _mm_loadu_si128((const __m128i*)K.stripe[s]));
+            accumulate(a1, _mm_loadu_si128((const __m128i*)(src + 16)), _mm_loadu_si128((const __m128i*)(K.stripe[s] + 2)));
+            if (++s == HASH_BLOCK_STRIPES || off + HASH_STRIPE_BYTES >= rowBytes) {
+                scramble(a0, sk0);
+                scramble(a1, sk1);
+                s = 0;
+            }
+        }
+    }
+    _mm_store_si128((__m128i*)acc, a0);
+    _mm_store_si128((__m128i*)(acc + 2), a1);
+    return HashFinish(acc, w, h);
+}
+
+ISS_TARGET_AVX2 uint64_t HashTileAVX2(const BYTE* pixels, int stride, int w, int h) {
+    const TileHashKeys& K = GetTileHashKeys();
+    alignas(32) uint64_t acc[HASH_LANES];
+    HashInitAcc(acc);
+    __m256i a = _mm256_load_si256((const __m256i*)acc);
+    const __m256i lo32 = _mm256_set1_epi64x(0xFFFFFFFFll);
+    const __m256i prime = _mm256_set1_epi64x((long long)HASH_PRIME32);
+    const __m256i sk = _mm256_loadu_si256((const __m256i*)K.scramble);
+    int rowBytes = w * 4;
+    alignas(32) BYTE tail[HASH_STRIPE_BYTES];
+
+    for (int y=0; y<h; ++y) {
+        const BYTE* row = pixels + (size_t)y * stride;
+        int s = 0;
+        for (int off=0; off<rowBytes; off+=HASH_STRIPE_BYTES) {
+            const BYTE* src = row + off;
+            if (rowBytes - off < HASH_STRIPE_BYTES) {
+                memset(tail, 0, sizeof(tail));
+                memcpy(tail, src, rowBytes - off);
+                src = tail;
+            }
+            __m256i d = _mm256_loadu_si256((const __m256i*)src);
+            __m256i dk = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i*)K.stripe[s]));
+            __m256i prod = _mm256_mul_epu32(_mm256_and_si256(dk, lo32), _mm256_srli_epi64(dk, 32));
+            a = _mm256_add_epi64(a, _mm256_add_epi64(_mm256_shuffle_epi32(d, _MM_SHUFFLE(1,0,3,2)), prod));
+            if (++s == HASH_BLOCK_STRIPES || off + HASH_STRIPE_BYTES >= rowBytes) {
+                a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+                a = _mm256_xor_si256(a, sk);
+                __m256i lo = _mm256_mul_epu32(a, prime);
+                __m256i hi = _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime), 32);
+                a = _mm256_add_epi64(lo, hi);
+                s = 0;
+            }
+        }
+    }
+    _mm256_store_si256((__m256i*)acc, a);
+    return HashFinish(acc, w, h);
+}
+#endif
+
+typedef uint64_t (*TileHashFn)(const BYTE* pixels, int stride, int w, int h);
+
+TileHashFn SelectTileHash() {
+#ifdef ISS_X86
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.avx2) return HashTileAVX2;
+    if (cpu.sse2) return HashTileSSE2;
+#endif
+    return HashTileScalar;
+}
+
+// 64-bit content hash of a w x h region of a 32bpp buffer
+inline uint64_t HashTile(const BYTE* pixels, int stride, int w, int h) {
+    static const TileHashFn fn = SelectTileHash();
+    return fn(pixels, stride, w, h);
+}
+
+// ---------- frame comparison ----------
+// Exact change detection against the previous frame: rows are compared
+// whole (xor/or reduction, no early-out inside a row) and the scan stops at
+// the first differing row, so unchanged tiles read both buffers once and
+// changed tiles usually stop after a few rows.
+
+bool RowEqualScalar(const BYTE* a, const BYTE* b, int bytes) {
+    return memcmp(a, b, bytes) == 0;
+}
+
+#ifdef ISS_X86
+bool RowEqualSSE2(const BYTE* a, const BYTE* b, int bytes) {
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 64 <= bytes; i += 64) {
+        __m128i x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i + 16)), _mm_loadu_si128((const __m128i*)(b + i + 16)));
+        __m128i x2 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i + 32)), _mm_loadu_si128((const __m128i*)(b + i + 32)));
+        __m128i x3 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i + 48)), _mm_loadu_si128((const __m128i*)(b + i + 48)));
+        acc = _mm_or_si128(acc, _mm_or_si128(_mm_or_si128(x0, x1), _mm_or_si128(x2, x3)));
+    }
+    for (; i + 16 <= bytes; i += 16)
+        acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF) return false;
+    return i == bytes || memcmp(a + i, b + i, bytes - i) == 0;
+}
+
+ISS_TARGET_AVX2 bool RowEqualAVX2(const BYTE* a, const BYTE* b, int bytes) {
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 128 <= bytes; i += 128) {
+        __m256i x0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i)));
+        __m256i x1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i + 32)), _mm256_loadu_si256((const __m256i*)(b + i + 32)));
+        __m256i x2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i + 64)), _mm256_loadu_si256((const __m256i*)(b + i + 64)));
+        __m256i x3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i + 96)), _mm256_loadu_si256((const __m256i*)(b + i + 96)));
+        acc = _mm256_or_si256(acc, _mm256_or_si256(_mm256_or_si256(x0, x1), _mm256_or_si256(x2, x3)));
+    }
+    for (; i + 32 <= bytes; i += 32)
+        acc = _mm256_or_si256(acc, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i)), _mm256_loadu_si256((const __m256i*)(b + i))));
+    if (!_mm256_testz_si256(acc, acc)) return false;
+    return i == bytes || memcmp(a + i, b + i, bytes - i) == 0;
+}
+#endif
+
+typedef bool (*RowEqualFn)(const BYTE* a, const BYTE* b, int bytes);
+
+RowEqualFn SelectRowEqual() {
+#ifdef ISS_X86
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.avx2) return RowEqualAVX2;
+    if (cpu.sse2) return RowEqualSSE2;
+#endif
+    return RowEqualScalar;
+}
+
+inline bool RowEqual(const BYTE* a, const BYTE* b, int bytes) {
+    static const RowEqualFn fn = SelectRowEqual();
+    return fn(a, b, bytes);
+}
+
+// Index of the first row of a w x h region that differs between cur and
+// prev (same stride), or -1 if the region is unchanged.
+inline int FirstDifferingRow(const BYTE* cur, const BYTE* prev, int stride, int w, int h) {
+    for (int y=0; y<h; ++y) {
+        size_t off = (size_t)y * stride;
+        if (!RowEqual(cur + off, prev + off, w * 4)) return y;
+    }
+    return -1;
+}
+
+// Copies rows [y0, h) of a w x h region between buffers of the same stride
+inline void CopyRegionRows(BYTE* dst, const BYTE* src, int stride, int w, int y0, int h) {
+    for (int y=y0; y<h; ++y) memcpy(dst + (size_t)y * stride, src + (size_t)y * stride, w * 4);
+}
+
+// A changed region in frame coordinates
+struct DirtyRect { int x, y, w, h; };
+
+// Splits a changed w x h tile at (tx,ty) into the rectangles that really
+// changed. Each block x block sub-block is tested against prev; changed
+// sub-blocks are merged into horizontal runs, runs with the same columns
+// are merged down, and every result is shrunk to the changed pixels
+// (8-pixel aligned inside the tile, to keep JPEG blocks whole).
+void RefineDirtyRects(const BYTE* cur, const BYTE* prev, int stride, int tx, int ty, int w, int h, int block, std::vector<DirtyRect>& out) {
+    size_t first = out.size();
+    for (int by=0; by<h; by+=block) {
+        int bh = min(block, h - by);
+        for (int bx=0; bx<w; ) {
+            size_t off = (size_t)(ty + by) * stride + (size_t)(tx + bx) * 4;
+            if (FirstDifferingRow(cur + off, prev + off, stride, min(block, w - bx), bh) < 0) { bx += block; continue; }
+            int runStart = bx;
+            bx += block;
+            while (bx < w) {
+                off = (size_t)(ty + by) * stride + (size_t)(tx + bx) * 4;
+                if (FirstDifferingRow(cur + off, prev + off, stride, min(block, w - bx), bh) < 0) break;
+                bx += block;
+            }
+            int runW = min(bx, w) - runStart;
+            // extend a rect from the previous block row with the same columns
+            bool merged = false;
+            for (size_t i=first; i<out.size(); ++i) {
+                DirtyRect& r = out[i];
+                if (r.x == tx + runStart && r.w == runW && r.y + r.h == ty + by) { r.h += bh; merged = true; break; }
+            }
+            if (!merged) out.push_back({tx + runStart, ty + by, runW, bh});
+        }
+    }
+
+    for (size_t i=first; i<out.size(); ++i) {
+        DirtyRect& r = out[i];
+        const BYTE* c = cur + (size_t)r.y * stride + (size_t)r.x * 4;
+        const BYTE* p = prev + (size_t)r.y * stride + (size_t)r.x * 4;
+        int top = max(0, FirstDifferingRow(c, p, stride, r.w, r.h));
+        int bottom = top;
+        int left = r.w, right = 0;
+        for (int y=top; y<r.h; ++y) {
+            const uint32_t* cr = (const uint32_t*)(c + (size_t)y * stride);
+            const uint32_t* pr = (const uint32_t*)(p + (size_t)y * stride);
+            int x = 0;
+            while (x < r.w && cr[x] == pr[x]) ++x;
+            if (x == r.w) continue;
+            int xr = r.w - 1;
+            while (cr[xr] == pr[xr]) --xr;
+            left = min(left, x); right = max(right, xr + 1); bottom = y + 1;
+        }
+        if (left >= right) continue;
+        // align to 8 pixels relative to the tile origin
+        int x0 = r.x + left, x1 = r.x + right, y0 = r.y + top, y1 = r.y + bottom;
+        x0 = tx + ((x0 - tx) & ~7); y0 = ty + ((y0 - ty) & ~7);
+        x1 = min(tx + w, tx + ((x1 - tx + 7) & ~7)); y1 = min(ty + h, ty + ((y1 - ty + 7) & ~7));
+        r = {x0, y0, x1 - x0, y1 - y0};
+    }
+}
+
+// ---------- motion detection ----------
+// Scrolling shifts part of the screen by some rows or columns. The detector
+// hashes the rows of each changed 64-pixel column band in the new and the
+// previous frame, votes on the offset between rows with equal hashes, and
+// turns the longest exactly matching run into a copy command; only the
+// newly exposed strip then needs encoding. Horizontal moves are found the
+// same way on column hashes of 64-row bands.
+
+// A w x h block that moved from (sx,sy) to (dx,dy)
+struct CopyRect { int sx, sy, dx, dy, w, h; };
+
+const int MOTION_BAND = 64;
+const int MOTION_MIN_RUN = 32;
+
+// Moves a w x h rectangle within one buffer; source and destination may overlap
+void CopyRectInBuffer(BYTE* buf, int stride, int sx, int sy, int dx, int dy, int w, int h) {
+    if (dy > sy) {
+        for (int y=h-1; y>=0; --y) memmove(buf + (size_t)(dy + y) * stride + dx * 4, buf + (size_t)(sy + y) * stride + sx * 4, w * 4);
+    } else {
+        for (int y=0; y<h; ++y) memmove(buf + (size_t)(dy + y) * stride + dx * 4, buf + (size_t)(sy + y) * stride + sx * 4, w * 4);
+    }
+}
+
+// Most common shift (cur index - prev index) between changed entries of cur
+// and entries of prev with the same hash. Hashes that repeat within prev
+// (blank lines) are ignored. Returns 0 if fewer than minVotes agree.
+int VoteShift(const std::vector<uint64_t>& prevH, const std::vector<uint64_t>& curH, int minVotes) {
+    std::unordered_map<uint64_t, int> pos;
+    pos.reserve(prevH.size() * 2);
+    for (int i=0; i<(int)prevH.size(); ++i) {
+        auto it = pos.find(prevH[i]);
+        if (it == pos.end()) pos[prevH[i]] = i;
+        else it->second = -1;
+    }
+    std::unordered_map<int, int> votes;
+    for (int i=0; i<(int)curH.size(); ++i) {
+        if (curH[i] == prevH[i]) continue;
+        auto it = pos.find(curH[i]);
+        if (it != pos.end() && it->second >= 0) ++votes[i - it->second];
+    }
+    int best = 0, bestVotes = minVotes - 1;
+    for (const auto& v : votes) {
+        if (v.second > bestVotes) { best = v.first; bestVotes = v.second; }
+    }
+    return best;
+}
+
+// Longest run of indices i with match(i) true that contains at least
+// MOTION_MIN_RUN changed entries; returns its length and sets start.
+template <class Match> int LongestShiftRun(const std::vector<uint64_t>& prevH, const std::vector<uint64_t>& curH, int shift, Match match, int& start) {
+    int n = (int)curH.size();
+    int lo = max(0, shift), hi = min(n, n + shift);
+    int runStart = -1, changedInRun = 0, bestLen = 0;
+    for (int i=lo; i<=hi; ++i) {
+        bool ok = i < hi && curH[i] == prevH[i - shift] && match(i);
+        if (ok) {
+            if (runStart < 0) { runStart = i; changedInRun = 0; }
+            if (curH[i] != prevH[i]) ++changedInRun;
+        } else if (runStart >= 0) {
+            int len = i - runStart;
+            if (len >= MOTION_MIN_RUN && changedInRun >= MOTION_MIN_RUN && len > bestLen) { bestLen = len; start = runStart; }
+            runStart = -1;
+        }
+    }
+    return bestLen;
+}
+
+// Per-column hashes of a w x h region, built row by row
+void ColumnHashes(const BYTE* pixels, int stride, int w, int h, std::vector<uint64_t>& out) {
+    out.assign(w, HASH_PRIME64);
+    for (int y=0; y<h; ++y) {
+        const uint32_t* row = (const uint32_t*)(pixels + (size_t)y * stride);
+        for (int x=0; x<w; ++x) out[x] = (out[x] ^ row[x]) * HASH_PRIME64;
+    }
+    for (auto& v : out) v = HashAvalanche(v);
+}
+
+void DetectVerticalMoves(const BYTE* cur, const BYTE* prev, int W, int H, std::vector<CopyRect>& out) {
+    int stride = W * 4;
+    std::vector<uint64_t> curH(H), prevH(H);
+    size_t first = out.size();
+    for (int bx=0; bx<W; bx+=MOTION_BAND) {
+        int bw = min(MOTION_BAND, W - bx);
+        const BYTE* c = cur + bx * 4;
+        const BYTE* p = prev + bx * 4;
+        if (FirstDifferingRow(c, p, stride, bw, H) < 0) continue;
+        for (int y=0; y<H; ++y) {
+            curH[y] = HashTile(c + (size_t)y * stride, stride, bw, 1);
+            prevH[y] = HashTile(p + (size_t)y * stride, stride, bw, 1);
+        }
+        int d = VoteShift(prevH, curH, MOTION_MIN_RUN);
+        if (d == 0) continue;
+        int start = 0;
+        int len = LongestShiftRun(prevH, curH, d, [&](int y) {
+            return RowEqual(c + (size_t)y * stride, p + (size_t)(y - d) * stride, bw * 4);
+        }, start);
+        if (len == 0) continue;
+
+        // bands moving together become one wider copy
+        CopyRect r = {bx, start - d, bx, start, bw, len};
+        if (out.size() > first) {
+            CopyRect& last = out.back();
+            if (last.dx + last.w == r.dx && last.sy == r.sy && last.dy == r.dy && last.h == r.h) { last.w += r.w; continue; }
+        }
+        out.push_back(r);
+    }
+}
+
+void DetectHorizontalMoves(const BYTE* cur, const BYTE* prev, int W, int H, std::vector<CopyRect>& out) {
+    int stride = W * 4;
+    std::vector<uint64_t> curH, prevH;
+    size_t first = out.size();
+    for (int by=0; by<H; by+=MOTION_BAND) {
+        int bh = min(MOTION_BAND, H - by);
+        const BYTE* c = cur + (size_t)by * stride;
+        const BYTE* p = prev + (size_t)by * stride;
+        if (FirstDifferingRow(c, p, stride, W, bh) < 0) continue;
+        ColumnHashes(c, stride, W, bh, curH);
+        ColumnHashes(p, stride, W, bh, prevH);
+        int d = VoteShift(prevH, curH, MOTION_MIN_RUN);
+        if (d == 0) continue;
+        int start = 0;
+        int len = LongestShiftRun(prevH, curH, d, [&](int x) {
+            for (int y=0; y<bh; ++y) {
+                if (((const uint32_t*)(c + (size_t)y * stride))[x] != ((const uint32_t*)(p + (size_t)y * stride))[x - d]) return false;
+            }
+            return true;
+        }, start);
+        if (len == 0) continue;
+
+        CopyRect r = {start - d, by, start, by, len, bh};
+        if (out.size() > first) {
+            CopyRect& last = out.back();
+            if (last.dy + last.h == r.dy && last.sx == r.sx && last.dx == r.dx && last.w == r.w) { last.h += r.h; continue; }
+        }
+        out.push_back(r);
+    }
+}
+
+// Finds moved blocks between prev and cur. Vertical moves come from
+// disjoint column bands and horizontal ones from disjoint row bands (only
+// tried when nothing moved vertically), so the copies never overlap each
+// other and can be applied in any order.
+void DetectMoves(const BYTE* cur, const BYTE* prev, int W, int H, std::vector<CopyRect>& out) {
+    out.clear();
+    DetectVerticalMoves(cur, prev, W, H, out);
+    if (out.empty()) DetectHorizontalMoves(cur, prev, W, H, out);
+}
+
+// ---------- tile cache ----------
+// The server remembers which tile contents the client still holds, keyed
+// by content hash. Slot ids are chosen here and sent with each stored tile,
+// so the client cache is just an array indexed by slot and both sides stay
+// in step without agreeing on an eviction policy.
+class TileCache {
+public:
+    TileCache(size_t capacity = 0) : m_capacity(capacity) {}
+
+    void reset(size_t capacity) {
+        m_capacity = capacity;
+        m_index.clear();
+        m_lru.clear();
+        m_slotKeys.clear();
+        m_slotFrames.clear();
+        m_frame = 0;
+        hits = misses = 0;
+    }
+    bool enabled() const { return m_capacity > 0; }
+
+    // Slots a frame looks up or fills are kept until the next frame, so a
+    // store never overwrites a slot that a record of the same frame names
+    void newFrame() { m_frame++; }
+
+    // Slot holding this content, or -1; a hit makes the slot most recent
+    int lookup(uint64_t key) {
+        auto it = m_index.find(key);
+        if (it == m_index.end()) { ++misses; return -1; }
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        m_slotFrames[*it->second] = m_frame;
+        ++hits;
+        return (int)*it->second;
+    }
+
+    // Slot the client should store this content in, evicting the least
+    // recently used entry when full; -1 if every slot is in use this frame
+    int insert(uint64_t key) {
+        auto it = m_index.find(key);
+        if (it != m_index.end()) {
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            m_slotFrames[*it->second] = m_frame;
+            return (int)*it->second;
+        }
+        uint32_t slot;
+        if (m_slotKeys.size() < m_capacity) {
+            slot = (uint32_t)m_slotKeys.size();
+            m_slotKeys.push_back(key);
+            m_slotFrames.push_back(m_frame);
+        } else {
+            if (m_slotFrames[m_lru.back()] == m_frame) return -1;
+            slot = m_lru.back();
+            m_lru.pop_back();
+            auto old = m_index.find(m_slotKeys[slot]);
+            if (old != m_index.end() && *old->second == slot) m_index.erase(old);
+            m_slotKeys[slot] = key;
+            m_slotFrames[slot] = m_frame;
+        }
+        m_lru.push_front(slot);
+        m_index[key] = m_lru.begin();
+        return (int)slot;
+    }
+
+    // Drops content whose store never reached the client; its slot is the
+    // next to be reused
+    void forget(uint64_t key) {
+        auto it = m_index.find(key);
+        if (it == m_index.end()) return;
+        m_lru.splice(m_lru.end(), m_lru, it->second);
+        m_index.erase(it);
+    }
+    void forgetSlot(uint32_t slot) {
+        if (slot >= m_slotKeys.size()) return;
+        auto it = m_index.find(m_slotKeys[slot]);
+        if (it != m_index.end() && *it->second == slot) forget(m_slotKeys[slot]);
+    }
+
+    uint64_t hits = 0, misses = 0;
+
+private:
+    size_t m_capacity;
+    std::list<uint32_t> m_lru;                                        // slots, most recent first
+    std::unordered_map<uint64_t, std::list<uint32_t>::iterator> m_index;
+    std::vector<uint64_t> m_slotKeys;
+    std::vector<uint64_t> m_slotFrames;                               // frame that last used each slot
+    uint64_t m_frame = 0;
+};
+
+// Encoder output for recently seen rect contents, so a caret or spinner
+// flipping between a few states is not re-encoded on every flip. Entries
+// are keyed by content hash, quality and scale, and hold the unstored
+// record type (REC_JPEG, REC_JPEG_HALF or REC_LOSSLESS) with its payload.
+// The least recently used entries go once the payloads pass the byte limit.
+class EncodedTileCache {
+public:
+    struct Entry {
+        uint32_t type;
+        std::vector<BYTE> data;
+    };
+
+    void reset(size_t capacityBytes) {
+        m_capacity = capacityBytes;
+        m_bytes = 0;
+        m_index.clear();
+        m_lru.clear();
+        hits = misses = 0;
+    }
+    bool enabled() const { return m_capacity > 0; }
+
+    static uint64_t Key(uint64_t contentHash, int quality, int scale) {
+        return HashAvalanche(contentHash ^ ((uint64_t)quality << 8 | (uint64_t)scale) * HASH_PRIME64);
+    }
+
+    // Cached output or null; valid until the next insert
+    const Entry* lookup(uint64_t key) {
+        auto it = m_index.find(key);
+        if (it == m_index.end()) { ++misses; return nullptr; }
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        ++hits;
+        return &it->second->second;
+    }
+
+    void insert(uint64_t key, uint32_t type, const BYTE* data, size_t size) {
+        if (size > m_capacity / 4) return;
+        auto it = m_index.find(key);
+        if (it != m_index.end()) {
+            m_bytes -= it->second->second.data.size();
+            m_lru.erase(it->second);
+            m_index.erase(it);
+        }
+        m_lru.emplace_front(key, Entry{ type, std::vector<BYTE>(data, data + size) });
+        m_index[key] = m_lru.begin();
+        m_bytes += size;
+        while (m_bytes > m_capacity) {
+            m_bytes -= m_lru.back().second.data.size();
+            m_index.erase(m_lru.back().first);
+            m_lru.pop_back();
+        }
+    }
+
+    size_t bytes() const { return m_bytes; }
+    uint64_t hits = 0, misses = 0;
+
+private:
+    size_t m_capacity = 0, m_bytes = 0;
+    std::list<std::pair<uint64_t, Entry>> m_lru;                      // most recent first
+    std::unordered_map<uint64_t, std::list<std::pair<uint64_t, Entry>>::iterator> m_index;
+};
+
+// ---------- low-color tiles ----------
+// Flat and few-color regions (backgrounds, UI chrome, plain text) are sent
+// losslessly: a single fill color, or a small palette with run-length coded
+// indices. Both decode straight into the client frame.
+
+const int MAX_PALETTE_COLORS = 16;
+
+// Collects up to MAX_PALETTE_COLORS distinct colors (alpha ignored);
+// returns the count, or 0 if the region has more.
+int CollectPalette(const BYTE* pixels, int stride, int w, int h, uint32_t palette[MAX_PALETTE_COLORS]) {
+    int n = 0;
+    uint32_t last = 0;
+    bool haveLast = false;
+    for (int y=0; y<h; ++y) {
+        const uint32_t* row = (const uint32_t*)(pixels + (size_t)y * stride);
+        for (int x=0; x<w; ++x) {
+            uint32_t c = row[x] & 0x00FFFFFF;
+            if (haveLast && c == last) continue;
+            int i = 0;
+            while (i < n && palette[i] != c) ++i;
+            if (i == n) {
+                if (n == MAX_PALETTE_COLORS) return 0;
+                palette[n++] = c;
+            }
+            last = c; haveLast = true;
+        }
+    }
+    return n;
+}
+
+// Palette record payload: color count, colors (BGRX), then (index, run-1
+// varint) pairs in raster order. Returns false if it would exceed maxBytes.
+bool EncodePaletteRLE(const BYTE* pixels, int stride, int w, int h, const uint32_t* palette, int colors, size_t maxBytes, std::vector<BYTE>& out) {
+    out.clear();
+    out.resize(1 + (size_t)colors * 4);
+    out[0] = (BYTE)colors;
+    for (int i=0; i<colors; ++i) PutLE32(out.data() + 1 + i * 4, palette[i]);
+    int runIndex = -1;
+    uint32_t runColor = 0, run = 0;
+    auto flush = [&] {
+        out.push_back((BYTE)runIndex);
+        PutVarint(out, run - 1);
+    };
+    for (int y=0; y<h; ++y) {
+        const uint32_t* row = (const uint32_t*)(pixels + (size_t)y * stride);
+        for (int x=0; x<w; ++x) {
+            uint32_t c = row[x] & 0x00FFFFFF;
+            if (runIndex >= 0 && c == runColor) { ++run; continue; }
+            if (runIndex >= 0) {
+                flush();
+                if (out.size() > maxBytes) return false;
+            }
+            runIndex = 0;
+            while (palette[runIndex] != c) ++runIndex;
+            runColor = c; run = 1;
+        }
+    }
+    if (runIndex >= 0) flush();
+    return out.size() <= maxBytes;
+}
+
+// Decodes a palette record into a w x h block of dst
+bool DecodePaletteRLE(const BYTE* data, size_t len, int w, int h, BYTE* dst, int dstStride) {
+    if (len < 1) return false;
+    const BYTE* p = data;
+    const BYTE* end = data + len;
+    int colors = *p++;
+    if (colors < 1 || colors > MAX_PALETTE_COLORS || end - p < colors * 4) return false;
+    uint32_t palette[MAX_PALETTE_COLORS];
+    for (int i=0; i<colors; ++i, p += 4) palette[i] = GetLE32(p);
+
+    size_t total = (size_t)w * h, pos = 0;
+    while (pos < total) {
+        uint32_t run;
+        if (p >= end) return false;
+        int index = *p++;
+        if (index >= colors || !GetVarint(p, end, run)) return false;
+        size_t n = (size_t)run + 1;
+        if (n > total - pos) return false;
+        uint32_t c = palette[index];
+        while (n > 0) {
+            int x = (int)(pos % w), y = (int)(pos / w);
+            int span = (int)min(n, (size_t)(w - x));
+            uint32_t* row = (uint32_t*)(dst + (size_t)y * dstStride) + x;
+            for (int i=0; i<span; ++i) row[i] = c;
+            pos += span; n -= span;
+        }
+    }
+    return true;
+}
+
+// ---------- color conversion ----------
+// BGRX -> YCbCr (BT.601 full range, as JPEG uses it) for the lossy
+// encoders. The coefficients are Q15 so that the SSE2, AVX2 and NEON
+// versions can use 16-bit multiply-adds, and every version gives the same
+// bytes as the scalar one. 4:2:0 chroma is the rounded 2x2 average. Rows
+// and columns past the view repeat its last row and column, so encoders
+// convert straight into planes padded to their block size.
+
+#if defined(_M_ARM64) || defined(__aarch64__)
+#define ISS_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Window into a 32bpp BGRX frame
+struct PixelView {
+    const BYTE* pixels;     // top-left pixel
+    int stride;             // bytes per row
+    int w, h;
+};
+
+// Destination of a conversion; u and v share uvStride
+struct YuvPlanes {
+    BYTE* y;
+    BYTE* u;
+    BYTE* v;
+    int yStride, uvStride;
+};
+
+const int YUV_Y_B = 3736, YUV_Y_G = 19234, YUV_Y_R = 9798;       // sum 1 << 15
+const int YUV_U_B = 16384, YUV_U_G = -10855, YUV_U_R = -5529;    // sum 0
+const int YUV_V_B = -2664, YUV_V_G = -13720, YUV_V_R = 16384;    // sum 0
+
+inline BYTE YuvLuma(const BYTE* p) {
+    return (BYTE)((YUV_Y_B * p[0] + YUV_Y_G * p[1] + YUV_Y_R * p[2] + (1 << 14)) >> 15);
+}
+
+// Cb or Cr from channel sums over 1 << shift pixels; the sum can only
+// overshoot, to 256
+inline BYTE YuvChroma(int b, int g, int r, int kb, int kg, int kr, int shift) {
+    int v = (kb * b + kg * g + kr * r + (128 << (15 + shift)) + (1 << (14 + shift))) >> (15 + shift);
+    return (BYTE)min(v, 255);
+}
+
+// Scalar 4:2:0 conversion of one row pair from column x0 on; the SIMD
+// versions finish their rows with it
+void Yuv420PairScalar(const PixelView& img, const YuvPlanes& dst, int w, int y, int x0) {
+    const BYTE* s0 = img.pixels + (size_t)min(y, img.h - 1) * img.stride;
+    const BYTE* s1 = img.pixels + (size_t)min(y + 1, img.h - 1) * img.stride;
+    BYTE* y0 = dst.y + (size_t)y * dst.yStride;
+    BYTE* y1 = y0 + dst.yStride;
+    BYTE* u = dst.u + (size_t)(y / 2) * dst.uvStride;
+    BYTE* v = dst.v + (size_t)(y / 2) * dst.uvStride;
+    for (int x=x0; x<w; x+=2) {
+        const BYTE* a0 = s0 + min(x, img.w - 1) * 4;
+        const BYTE* a1 = s0 + min(x + 1, img.w - 1) * 4;
+        const BYTE* b0 = s1 + min(x, img.w - 1) * 4;
+        const BYTE* b1 = s1 + min(x + 1, img.w - 1) * 4;
+        y0[x] = YuvLuma(a0); y0[x + 1] = YuvLuma(a1);
+        y1[x] = YuvLuma(b0); y1[x + 1] = YuvLuma(b1);
+        int b = a0[0] + a1[0] + b0[0] + b1[0], g = a0[1] + a1[1] + b0[1] + b1[1], r = a0[2] + a1[2] + b0[2] + b1[2];
+        u[x / 2] = YuvChroma(b, g, r, YUV_U_B, YUV_U_G, YUV_U_R, 2);
+        v[x / 2] = YuvChroma(b, g, r, YUV_V_B, YUV_V_G, YUV_V_R, 2);
+    }
+}
+
+void Yuv444RowScalar(const PixelView& img, const YuvPlanes& dst, int w, int y, int x0) {
+    const BYTE* s = img.pixels + (size_t)min(y, img.h - 1) * img.stride;
+    BYTE* yr = dst.y + (size_t)y * dst.yStride;
+    BYTE* u = dst.u + (size_t)y * dst.uvStride;
+    BYTE* v = dst.v + (size_t)y * dst.uvStride;
+    for (int x=x0; x<w; ++x) {
+        const BYTE* p = s + min(x, img.w - 1) * 4;
+        yr[x] = YuvLuma(p);
+        u[x] = YuvChroma(p[0], p[1], p[2], YUV_U_B, YUV_U_G, YUV_U_R, 0);
+        v[x] = YuvChroma(p[0], p[1], p[2], YUV_V_B, YUV_V_G, YUV_V_R, 0);
+    }
+}
+
+// Converts rows [row0, row1) of a w-wide destination (even bounds and
+// width for 4:2:0)
+void Yuv420RowsScalar(const PixelView& img, const YuvPlanes& dst, int w, int row0, int row1) {
+    for (int y=row0; y<row1; y+=2) Yuv420PairScalar(img, dst, w, y, 0);
+}
+
+void Yuv444RowsScalar(const PixelView& img, const YuvPlanes& dst, int w, int row0, int row1) {
+    for (int y=row0; y<row1; ++y) Yuv444RowScalar(img, dst, w, y, 0);
+}
+
+// Two int16 multipliers for madd over (B, R) or (G, A) pixel halves
+inline int YuvCoefPair(int lo, int hi) {
+    return (int)((uint32_t)(uint16_t)hi << 16 | (uint16_t)lo);
+}
+
+#ifdef ISS_X86
+// The SIMD loops split each pixel into (B, R) and (G, A) 16-bit halves,
+// so one madd per half gives a channel's three products for a pixel
+
+void Yuv420RowsSSE2(const PixelView& img, const YuvPlanes& dst, int w, int row0, int row1) {
+    const __m128i lo8 = _mm_set1_epi32(0x00FF00FF);
+    const __m128i yBR = _mm_set1_epi32(YuvCoefPair(YUV_Y_B, YUV_Y_R)), yGA = _mm_set1_epi32(YuvCoefPair(YUV_Y_G, 0));
+    const __m128i uBR = _mm_set1_epi32(YuvCoefPair(YUV_U_B, YUV_U_R)), uGA = _mm_set1_epi32(YuvCoefPair(YUV_U_G, 0));
+    const __m128i vBR = _mm_set1_epi32(YuvCoefPair(YUV_V_B, YUV_V_R)), vGA = _mm_set1_epi32(YuvCoefPair(YUV_V_G, 0));
+    const __m128i yRound = _mm_set1_epi32(1 << 14), cBias = _mm_set1_epi32((128 << 17) + (1 << 16));
+    int simdW = min(w, img.w) & ~15;
+    for (int y=row0; y<row1; y+=2) {
+        const BYTE* src[2] = { img.pixels + (size_t)min(y, img.h - 1) * img.stride, img.pixels + (size_t)min(y + 1, img.h - 1) * img.stride };
+        BYTE* u = dst.u + (size_t)(y / 2) * dst.uvStride;
+        BYTE* v = dst.v + (size_t)(y / 2) * dst.uvStride;
+        for (int x=0; x<simdW; x+=16) {
+            __m128i br[4], ga[4];
+            for (int r=0; r<2; ++r) {
+                __m128i lum[4];
+                for (int k=0; k<4; ++k) {
+                    __m128i p = _mm_loadu_si128((const __m128i*)(src[r] + (x + k * 4) * 4));
+                    __m128i pbr = _mm_and_si128(p, lo8), pga = _mm_and_si128(_mm_srli_epi32(p, 8), lo8);
+                    lum[k] = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(pbr, yBR), _mm_madd_epi16(pga, yGA)), yRound), 15);
+                    br[k] = r ? _mm_add_epi16(br[k], pbr) : pbr;
+                    ga[k] = r ? _mm_add_epi16(ga[k], pga) : pga;
+                }
+                __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(lum[0], lum[1]), _mm_packs_epi32(lum[2], lum[3]));
+                _mm_storeu_si128((__m128i*)(dst.y + (size_t)(y + r) * dst.yStride + x), bytes);
+            }
+            // horizontal pair sums land in the even pixels; keep those
+            for (int k=0; k<4; ++k) {
+                br[k] = _mm_add_epi16(br[k], _mm_srli_epi64(br[k], 32));
+                ga[k] = _mm_add_epi16(ga[k], _mm_srli_epi64(ga[k], 32));
+            }
+            __m128i br01 = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(br[0]), _mm_castsi128_ps(br[1]), _MM_SHUFFLE(2, 0, 2, 0)));
+            __m128i br23 = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(br[2]), _mm_castsi128_ps(br[3]), _MM_SHUFFLE(2, 0, 2, 0)));
+            __m128i ga01 = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(ga[0]), _mm_castsi128_ps(ga[1]), _MM_SHUFFLE(2, 0, 2, 0)));
+            __m128i ga23 = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(ga[2]), _mm_castsi128_ps(ga[3]), _MM_SHUFFLE(2, 0, 2, 0)));
+            auto chroma = [&](__m128i kBR, __m128i kGA) {
+                __m128i c0 = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(br01, kBR), _mm_madd_epi16(ga01, kGA)), cBias);
+                __m128i c1 = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(br23, kBR), _mm_madd_epi16(ga23, kGA)), cBias);
+                return _mm_packus_epi16(_mm_packs_epi32(_mm_srai_epi32(c0, 17), _mm_srai_epi32(c1, 17)), _mm_setzero_si128());
+            };
+            _mm_storel_epi64((__m128i*)(u + x / 2), chroma(uBR, uGA));
+            _mm_storel_epi64((__m128i*)(v + x / 2), chroma(vBR, vGA));
+        }
+        Yuv420PairScalar(img, dst, w, y, simdW);
+    }
+}
+
+void Yuv444RowsSSE2(const PixelView& img, const YuvPlanes& dst, int w, int row0, int row1) {
+    const __m128i lo8 = _mm_set1_epi32(0x00FF00FF);
+    const __m128i yBR = _mm_set1_epi32(YuvCoefPair(YUV_Y_B, YUV_Y_R)), yGA = _mm_set1_epi32(YuvCoefPair(YUV_Y_G, 0));
+    const __m128i uBR = _mm_set1_epi32(YuvCoefPair(YUV_U_B, YUV_U_R)), uGA = _mm_set1_epi32(YuvCoefPair(YUV_U_G, 0));
+    const __m128i vBR = _mm_set1_epi32(YuvCoefPair(YUV_V_B, YUV_V_R)), vGA = _mm_set1_epi32(YuvCoefPair(YUV_V_G, 0));
+    const __m128i yRound = _mm_set1_epi32(1 << 14), cBias = _mm_set1_epi32((128 << 15) + (1 << 14));
+    int simdW = min(w, img.w) & ~15;
+    for (int y=row0; y<row1; ++y) {
+        const BYTE* src = img.pixels + (size_t)min(y, img.h - 1) * img.stride;
+        BYTE* planes[3] = { dst.y + (size_t)y * dst.yStride, dst.u + (size_t)y * dst.uvStride, dst.v + (size_t)y * dst.uvStride };
+        for (int x=0; x<simdW; x+=16) {
+            __m128i br[4], ga[4];
+            for (int k=0; k<4; ++k) {
+                __m128i p = _mm_loadu_si128((const __m128i*)(src + (x + k * 4) * 4));
+                br[k] = _mm_and_si128(p, lo8);
+                ga[k] = _mm_and_si128(_mm_srli_epi32(p, 8), lo8);
+            }
+            auto channel = [&](__m128i kBR, __m128i kGA, __m128i bias) {
+                __m128i c[4];
+                for (int k=0; k<4; ++k) c[k] = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(br[k], kBR), _mm_madd_epi16(ga[k], kGA)), bias), 15);
+                return _mm_packus_epi16(_mm_packs_epi32(c[0], c[1]), _mm_packs_epi32(c[2], c[3]));
+            };
+            _mm_storeu_si128((__m128i*)(planes[0] + x), channel(yBR, yGA, yRound));
+            _mm_storeu_si128((__m128i*)(planes[1] + x), channel(uBR, uGA, cBias));
+            _mm_storeu_si128((__m128i*)(planes[2] + x), channel(vBR, vGA, cBias));
+        }
+        Yuv444RowScalar(img, dst, w, y, simdW);
+    }
+}
+
+// The 256-bit packs work per 128-bit lane; the permutes put the results
+// back in pixel order. Lambdas would not inherit the AVX2 target, hence
+// the helpers.
+
+// Sixteen 4:2:0 chroma samples from the compacted (B, R) and (G, A) 2x2
+// sums of 32 pixels, which come in [0 1 4 5 | 2 3 6 7] order
+ISS_TARGET_AVX2 inline __m128i Yuv420ChromaAVX2(__m256i br01, __m256i ga01, __m256i br23, __m256i ga23, __m256i kBR, __m256i kGA) {
+    const __m256i bias = _mm256_set1_epi32((128 << 17) + (1 << 16));
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7), pairOrder = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+    __m256i c0 = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(br01, kBR), _mm256_madd_epi16(ga01, kGA)), bias);
+    __m256i c1 = _mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(br23, kBR), _mm256_madd_epi16(ga23, kGA)), bias);
+    c0 = _mm256_permutevar8x32_epi32(_mm256_srai_epi32(c0, 17), pairOrder);
+    c1 = _mm256_permutevar8x32_epi32(_mm256_srai_epi32(c1, 17), pairOrder);
+    __m256i packed = _mm256_packs_epi32(c0, c1);
+    return _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(_mm256_packus_epi16(packed, packed), order));
+}
+
+// One channel of 32 pixels given as four (B, R) / (G, A) vectors
+ISS_TARGET_AVX2 inline __m256i Yuv444ChannelAVX2(const __m256i* br, const __m256i* ga, __m256i kBR, __m256i kGA, __m256i bias) {
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i c[4];
+    for (int k=0; k<4; ++k) c[k] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(br[k], kBR), _mm256_madd_epi16(ga[k], kGA)), bias), 15);
+    return _mm256_permutevar8x32_epi32(_mm256_packus_epi16(_mm256_packs_epi32(c[0], c[1]), _mm256_packs_epi32(c[2], c[3])), order);
+}
+
+ISS_TARGET_AVX2 void Yuv420RowsAVX2(const PixelView& img, const YuvPlanes& dst, int w, int row0, int row1) {
+    const __m256i lo8 = _mm256_set1_epi32(0x00FF00FF);
+    const __m256i yBR = _mm256_set1_epi32(YuvCoefPair(YUV_Y_B, YUV_Y_R)), yGA = _mm256_set1_epi32(YuvCoefPair(YUV_Y_G, 0));
+    const __m256i uBR = _mm256_set1_epi32(YuvCoefPair(YUV_U_B, YUV_U_R)), uGA = _mm256_set1_epi32(YuvCoefPair(YUV_U_G, 0));
+    const __m256i vBR = _mm256_set1_epi32(YuvCoefPair(YUV_V_B, YUV_V_R)), vGA = _mm256_set1_epi32(YuvCoefPair(YUV_V_G, 0));
+    const __m256i yRound = _mm256_set1_epi32(1 << 14);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int simdW = min(w, img.w) & ~31;
+    for (int y=row0; y<row1; y+=2) {
+        const BYTE* src[2] = { img.pixels + (size_t)min(y, img.h - 1) * img.stride, img.pixels + (size_t)min(y + 1, img.h - 1) * img.stride };
+        BYTE* u = dst.u + (size_t)(y / 2) * dst.uvStride;
+        BYTE* v = dst.v + (size_t)(y / 2) * dst.uvStride;
+        for (int x=0; x<simdW; x+=32) {
+            __m256i br[4], ga[4];
+            for (int r=0; r<2; ++r) {
+                __m256i lum[4];
+                for (int k=0; k<4; ++k) {
+                    __m256i p = _mm256_loadu_si256((const __m256i*)(src[r] + (x + k * 8) * 4));
+                    __m256i pbr = _mm256_and_si256(p, lo8), pga = _mm256_and_si256(_mm256_srli_epi32(p, 8), lo8);
+                    lum[k] = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(_mm256_madd_epi16(pbr, yBR), _mm256_madd_epi16(pga, yGA)), yRound), 15);
+                    br[k] = r ? _mm256_add_epi16(br[k], pbr) : pbr;
+                    ga[k] = r ? _mm256_add_epi16(ga[k], pga) : pga;
+                }
+                __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(lum[0], lum[1]), _mm256_packs_epi32(lum[2], lum[3]));
+                _mm256_storeu_si256((__m256i*)(dst.y + (size_t)(y + r) * dst.yStride + x), _mm256_permutevar8x32_epi32(bytes, order));
+            }
+            for (int k=0; k<4; ++k) {
+                br[k] = _mm256_add_epi16(br[k], _mm256_srli_epi64(br[k], 32));
+                ga[k] = _mm256_add_epi16(ga[k], _mm256_srli_epi64(ga[k], 32));
+            }
+            __m256i br01 = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(br[0]), _mm256_castsi256_ps(br[1]), _MM_SHUFFLE(2, 0, 2, 0)));
+            __m256i br23 = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(br[2]), _mm256_castsi256_ps(br[3]), _MM_SHUFFLE(2, 0, 2, 0)));
+            __m256i ga01 = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(ga[0]), _mm256_castsi256_ps(ga[1]), _MM_SHUFFLE(2, 0, 2, 0)));
+            __m256i ga23 = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(ga[2]), _mm256_castsi256_ps(ga[3]), _MM_SHUFFLE(2, 0, 2, 0)));
+            _mm_storeu_si128((__m128i*)(u + x / 2), Yuv420ChromaAVX2(br01, ga01, br23, ga23, uBR, uGA));
+            _mm_storeu_si128((__m128i*)(v + x / 2), Yuv420ChromaAVX2(br01, ga01, br23, ga23, vBR, vGA));
+        }
+        Yuv420PairScalar(img, dst, w, y, simdW);
+    }
+}
+
+ISS_TARGET_AVX2 void Yuv444RowsAVX2(const PixelView& img, const YuvPlanes& dst, int w, int row0, int row1) {
+    const __m256i lo8 = _mm256_set1_epi32(0x00FF00FF);
+    const __m256i yBR = _mm256_set1_epi32(YuvCoefPair(YUV_Y_B, YUV_Y_R)), yGA = _mm256_set1_epi32(YuvCoefPair(YUV_Y_G, 0));
+    const __m256i uBR = _mm256_set1_epi32(YuvCoefPair(YUV_U_B, YUV_U_R)), uGA = _mm256_set1_epi32(YuvCoefPair(YUV_U_G, 0));
+    const __m256i vBR = _mm256_set1_epi32(YuvCoefPair(YUV_V_B, YUV_V_R)), vGA = _mm256_set1_epi32(YuvCoefPair(YUV_V_G, 0));
+    const __m256i yRound = _mm256_set1_epi32(1 << 14), cBias = _mm256_set1_epi32((128 << 15) + (1 << 14));
+    int simdW = min(w, img.w) & ~31;
+    for (int y=row0; y<row1; ++y) {
+        const BYTE* src = img.pixels + (size_t)min(y, img.h - 1) * img.stride;
+        BYTE* planes[3] = { dst.y + (size_t)y * dst.yStride, dst.u + (size_t)y * dst.uvStride, dst.v + (size_t)y * dst.uvStride };
+        for (int x=0; x<simdW; x+=32) {
+            __m256i br[4], ga[4];
+            for (int k=0; k<4; ++k) {
+                __m256i p = _mm256_loadu_si256((const __m256i*)(src + (x + k * 8) * 4));
+                br[k] = _mm256_and_si256(p, lo8);
+                ga[k] = _mm256_and_si256(_mm256_srli_epi32(p, 8), lo8);
+            }
+            _mm256_storeu_si256((__m256i*)(planes[0] + x), Yuv444ChannelAVX2(br, ga, yBR, yGA, yRound));
+            _mm256_storeu_si256((__m256i*)(planes[1] + x), Yuv444ChannelAVX2(br, ga, uBR, uGA, cBias));
+            _mm256_storeu_si256((__m256i*)(planes[2] + x), Yuv444ChannelAVX2(br, ga, vBR, vGA, cBias));
+        }
+        Yuv444RowScalar(img, dst, w, y, simdW);
+    }
+}
+#endif
+
+#ifdef ISS_NEON
+// vld4 splits 16 pixels into B, G, R, A registers; products are widened to
+// 32 bits the same way the scalar code computes them
+
+inline uint8x8_t NeonLuma8(uint8x8_t b, uint8x8_t g, uint8x8_t r) {
+    uint16x8_t b16 = vmovl_u8(b), g16 = vmovl_u8(g), r16 = vmovl_u8(r);
+    uint32x4_t lo = vmull_n_u16(vget_low_u16(b16), YUV_Y_B);
+    uint32x4_t hi = vmull_n_u16(vget_high_u16(b16), YUV_Y_B);
+    lo = vmlal_n_u16(lo, vget_low_u16(g16), YUV_Y_G);
+    hi = vmlal_n_u16(hi, vget_high_u16(g16), YUV_Y_G);
+    lo = vmlal_n_u16(lo, vget_low_u16(r16), YUV_Y_R);
+    hi = vmlal_n_u16(hi, vget_high_u16(r16), YUV_Y_R);
+    return vmovn_u16(vcombine_u16(vrshrn_n_u32(lo, 15), vrshrn_n_u32(hi, 15)));
+}
+
+// Cb or Cr of eight pixels from channel sums over 1 << shift pixels
+template <int shift>
+inline uint8x8_t NeonChroma8(uint16x8_t b, uint16x8_t g, uint16x8_t r, int16_t kb, int16_t kg, int16_t kr) {
+    const int32x4_t bias = vdupq_n_s32((128 << (15 + shift)) + (1 << (14 + shift)));
+    int16x8_t sb = vreinterpretq_s16_u16(b), sg = vreinterpretq_s16_u16(g), sr = vreinterpretq_s16_u16(r);
+    int32x4_t lo = vmlal_n_s16(bias, vget_low_s16(sb), kb);
+    int32x4_t hi = vmlal_n_s16(bias, vget_high_s16(sb), kb);
+    lo = vmlal_n_s16(lo, vget_low_s16(sg), kg);
+    hi = vmlal_n_s16(hi, vget_high_s16(sg), kg);
+    lo = vmlal_n_s16(lo, vget_low_s16(sr), kr);
+    hi = vmlal_n_s16(hi, vget_high_s16(sr), kr);
+    uint16x8_t c = vcombine_u16(vqmovun_s32(vshrq_n_s32(lo, 15 + shift)), vqmovun_s32(vshrq_n_s32(hi, 15 + shift)));
+    return vqmovn_u16(c);
+}
+
+void Yuv420RowsNeon(const PixelView& img, const YuvPlanes& dst, int w, int row0, int row1) {
+    int simdW = min(w, img.w) & ~15;
+    for (int y=row0; y<row1; y+=2) {
+        const BYTE* s0 = img.pixels + (size_t)min(y, img.h - 1) * img.stride;
+        const BYTE* s1 = img.pixels + (size_t)min(y + 1, img.h - 1) * img.stride;
+        BYTE* y0 = dst.y + (size_t)y * dst.yStride;
+        BYTE* y1 = y0 + dst.yStride;
+        BYTE* u = dst.u + (size_t)(y / 2) * dst.uvStride;
+        BYTE* v = dst.v + (size_t)(y / 2) * dst.uvStride;
+        for (int x=0; x<simdW; x+=16) {
+            uint8x16x4_t a = vld4q_u8(s0 + x * 4), b = vld4q_u8(s1 + x * 4);
+            vst1q_u8(y0 + x, vcombine_u8(NeonLuma8(vget_low_u8(a.val[0]), vget_low_u8(a.val[1]), vget_low_u8(a.val[2])),
+                                         NeonLuma8(vget_high_u8(a.val[0]), vget_high_u8(a.val[1]), vget_high_u8(a.val[2]))));
+            vst1q_u8(y1 + x, vcombine_u8(NeonLuma8(vget_low_u8(b.val[0]), vget_low_u8(b.val[1]), vget_low_u8(b.val[2])),
+                                         NeonLuma8(vget_high_u8(b.val[0]), vget_high_u8(b.val[1]), vget_high_u8(b.val[2]))));
+            // pairwise adds give the 2x2 sums
+            uint16x8_t sb = vpadalq_u8(vpaddlq_u8(a.val[0]), b.val[0]);
+            uint16x8_t sg = vpadalq_u8(vpaddlq_u8(a.val[1]), b.val[1]);
+            uint16x8_t sr = vpadalq_u8(vpaddlq_u8(a.val[2]), b.val[2]);
+            vst1_u8(u + x / 2, NeonChroma8<2>(sb, sg, sr, YUV_U_B, YUV_U_G, YUV_U_R));
+            vst1_u8(v + x / 2, NeonChroma8<2>(sb, sg, sr, YUV_V_B, YUV_V_G, YUV_V_R));
+        }
+        Yuv420PairScalar(img, dst, w, y, simdW);
+    }
+}
+
+void Yuv444RowsNeon(const PixelView& img, const YuvPlanes& dst, int w, int row0, int row1) {
+    int simdW = min(w, img.w) & ~15;
+    for (int y=row0; y<row1; ++y) {
+        const BYTE* src = img.pixels + (size_t)min(y, img.h - 1) * img.stride;
+        BYTE* yr = dst.y + (size_t)y * dst.yStride;
+        BYTE* u = dst.u + (size_t)y * dst.uvStride;
+        BYTE* v = dst.v + (size_t)y * dst.uvStride;
+        for (int x=0; x<simdW; x+=16) {
+            uint8x16x4_t p = vld4q_u8(src + x * 4);
+            vst1q_u8(yr + x, vcombine_u8(NeonLuma8(vget_low_u8(p.val[0]), vget_low_u8(p.val[1]), vget_low_u8(p.val[2])),
+                                         NeonLuma8(vget_high_u8(p.val[0]), vget_high_u8(p.val[1]), vget_high_u8(p.val[2]))));
+            uint16x8_t bl = vmovl_u8(vget_low_u8(p.val[0])), gl = vmovl_u8(vget_low_u8(p.val[1])), rl = vmovl_u8(vget_low_u8(p.val[2]));
+            uint16x8_t bh = vmovl_u8(vget_high_u8(p.val[0])), gh = vmovl_u8(vget_high_u8(p.val[1])), rh = vmovl_u8(vget_high_u8(p.val[2]));
+            vst1q_u8(u + x, vcombine_u8(NeonChroma8<0>(bl, gl, rl, YUV_U_B, YUV_U_G, YUV_U_R), NeonChroma8<0>(bh, gh, rh, YUV_U_B, YUV_U_G, YUV_U_R)));
+            vst1q_u8(v + x, vcombine_u8(NeonChroma8<0>(bl, gl, rl, YUV_V_B, YUV_V_G, YUV_V_R), NeonChroma8<0>(bh, gh, rh, YUV_V_B, YUV_V_G, YUV_V_R)));
+        }
+        Yuv444RowScalar(img, dst, w, y, simdW);
+    }
+}
+#endif
+
+typedef void (*YuvRowsFn)(const PixelView& img, const YuvPlanes& dst, int w, int row0, int row1);
+
+// NEON is part of every ARM64 target, so only x86 checks the CPU
+YuvRowsFn SelectYuv420Rows() {
+#ifdef ISS_X86
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.avx2) return Yuv420RowsAVX2;
+    if (cpu.sse2) return Yuv420RowsSSE2;
+#elif defined(ISS_NEON)
+    return Yuv420RowsNeon;
+#endif
+    return Yuv420RowsScalar;
+}
+
+YuvRowsFn SelectYuv444Rows() {
+#ifdef ISS_X86
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.avx2) return Yuv444RowsAVX2;
+    if (cpu.sse2) return Yuv444RowsSSE2;
+#elif defined(ISS_NEON)
+    return Yuv444RowsNeon;
+#endif
+    return Yuv444RowsScalar;
+}
+
+// Rows [row0, row1) of a w-wide 4:2:0 destination; row bounds and w even
+inline void BgraToYuv420(const PixelView& img, const YuvPlanes& dst, int w, int row0, int row1) {
+    static const YuvRowsFn fn = SelectYuv420Rows();
+    fn(img, dst, w, row0, row1);
+}
+
+// Rows [row0, row1) of a w-wide 4:4:4 destination
+inline void BgraToYuv444(const PixelView& img, const YuvPlanes& dst, int w, int row0, int row1) {
+    static const YuvRowsFn fn = SelectYuv444Rows();
+    fn(img, dst, w, row0, row1);
+}
+
+// ---------- jpeg encoder ----------
+// Baseline JPEG (YCbCr 4:2:0, the Annex K Huffman tables) written straight
+// from a 32bpp BGRX buffer. Quantisation tables, Huffman codes, the YCbCr
+// planes and the MCU scratch live in the encoder and are reused from call
+// to call, and output goes into a caller-owned vector whose capacity
+// carries over. In steady state a tile encode uses no GDI objects and
+// makes no heap allocations. Use one encoder per thread.
+
+static const BYTE JPEG_ZIGZAG[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static const BYTE JPEG_LUMA_QUANT[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61,   12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56,   14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68,109,103, 77,   24, 35, 55, 64, 81,104,113, 92,
+    49, 64, 78, 87,103,121,120,101,   72, 92, 95, 98,112,100,103, 99
+};
+
+static const BYTE JPEG_CHROMA_QUANT[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,   18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,   47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,   99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,   99, 99, 99, 99, 99, 99, 99, 99
+};
+
+// Huffman table specs as stored in DHT: code counts per length 1..16, then symbols
+static const BYTE JPEG_DC_LUMA_BITS[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const BYTE JPEG_DC_CHROMA_BITS[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const BYTE JPEG_DC_VALS[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const BYTE JPEG_AC_LUMA_BITS[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const BYTE JPEG_AC_LUMA_VALS[162] = {
+    0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,
+    0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,
+    0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,
+    0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,
+    0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,
+    0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+    0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,
+    0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,
+    0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,
+    0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
+    0xf9,0xfa
+};
+static const BYTE JPEG_AC_CHROMA_BITS[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const BYTE JPEG_AC_CHROMA_VALS[162] = {
+    0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,
+    0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,
+    0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,
+    0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,
+    0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,
+    0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+    0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,
+    0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,
+    0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,
+    0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
+    0xf9,0xfa
+};
+
+// Forward 8x8 DCT in place (AAN float algorithm); outputs are scaled by
+// 8 * aan[u] * aan[v], which the quantiser divisors undo
+inline void ForwardDCT8x8(float* d) {
+    for (int pass=0; pass<2; ++pass) {
+        int step = pass == 0 ? 1 : 8, next = pass == 0 ? 8 : 1;
+        for (int i=0; i<8; ++i) {
+            float* p = d + i * next;
+            float tmp0 = p[0] + p[7 * step], tmp7 = p[0] - p[7 * step];
+            float tmp1 = p[step] + p[6 * step], tmp6 = p[step] - p[6 * step];
+            float tmp2 = p[2 * step] + p[5 * step], tmp5 = p[2 * step] - p[5 * step];
+            float tmp3 = p[3 * step] + p[4 * step], tmp4 = p[3 * step] - p[4 * step];
+
+            float tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+            float tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+            p[0] = tmp10 + tmp11;
+            p[4 * step] = tmp10 - tmp11;
+            float z1 = (tmp12 + tmp13) * 0.707106781f;
+            p[2 * step] = tmp13 + z1;
+            p[6 * step] = tmp13 - z1;
+
+            tmp10 = tmp4 + tmp5; tmp11 = tmp5 + tmp6; tmp12 = tmp6 + tmp7;
+            float z5 = (tmp10 - tmp12) * 0.382683433f;
+            float z2 = 0.541196100f * tmp10 + z5;
+            float z4 = 1.306562965f * tmp12 + z5;
+            float z3 = tmp11 * 0.707106781f;
+            float z11 = tmp7 + z3, z13 = tmp7 - z3;
+            p[5 * step] = z13 + z2;
+            p[3 * step] = z13 - z2;
+            p[step] = z11 + z4;
+            p[7 * step] = z11 - z4;
+        }
+    }
+}
+
+class JpegEncoder {
+public:
+    JpegEncoder() {
+        buildCodes(JPEG_DC_LUMA_BITS, JPEG_DC_VALS, m_dcLuma);
+        buildCodes(JPEG_DC_CHROMA_BITS, JPEG_DC_VALS, m_dcChroma);
+        buildCodes(JPEG_AC_LUMA_BITS, JPEG_AC_LUMA_VALS, m_acLuma);
+        buildCodes(JPEG_AC_CHROMA_BITS, JPEG_AC_CHROMA_VALS, m_acChroma);
+    }
+
+    // Appends a complete JFIF image of img at quality 1..100 to out, or
+    // with abbreviated set an image without the quantisation and Huffman
+    // tables, which only decodes after encodeTables() of the same quality
+    bool encode(const PixelView& img, int quality, std::vector<BYTE>& out, bool abbreviated = false) {
+        if (!img.pixels || img.w <= 0 || img.h <= 0 || img.w > 65535 || img.h > 65535) return false;
+        setQuality(quality);
+        m_out = &out;
+        putMarker(0xD8);
+        if (!abbreviated) {
+            static const BYTE jfif[] = { 0xFF, 0xE0, 0, 16, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+            m_out->insert(m_out->end(), jfif, jfif + sizeof(jfif));
+            writeTables();
+        }
+        writeFrameHeader(img.w, img.h);
+
+        // the whole image is converted up front, padded to whole MCUs
+        m_planeW = (img.w + 15) & ~15;
+        int planeH = (img.h + 15) & ~15;
+        m_planeY.resize((size_t)m_planeW * planeH);
+        m_planeCb.resize(m_planeY.size() / 4);
+        m_planeCr.resize(m_planeY.size() / 4);
+        YuvPlanes planes = { m_planeY.data(), m_planeCb.data(), m_planeCr.data(), m_planeW, m_planeW / 2 };
+        BgraToYuv420(img, planes, m_planeW, 0, planeH);
+
+        m_bitBuf = 0; m_bitCount = 0;
+        int dcY = 0, dcCb = 0, dcCr = 0;
+        for (int my=0; my<img.h; my+=16) {
+            for (int mx=0; mx<img.w; mx+=16) {
+                loadMCU(mx, my);
+                for (int b=0; b<4; ++b) encodeBlock(m_y[b], m_divLuma, dcY, m_dcLuma, m_acLuma);
+                encodeBlock(m_cb, m_divChroma, dcCb, m_dcChroma, m_acChroma);
+                encodeBlock(m_cr, m_divChroma, dcCr, m_dcChroma, m_acChroma);
+            }
+        }
+        putBits(0x7F, 7);   // pad the last byte with ones
+        putMarker(0xD9);
+        m_out = nullptr;
+        return true;
+    }
+
+    // Appends the tables-only stream (SOI, DQT, DHT, EOI) for quality
+    void encodeTables(int quality, std::vector<BYTE>& out) {
+        setQuality(quality);
+        m_out = &out;
+        putMarker(0xD8);
+        writeTables();
+        putMarker(0xD9);
+        m_out = nullptr;
+    }
+
+private:
+    struct HuffCode { uint16_t code; uint8_t len; };
+
+    static void buildCodes(const BYTE* bits, const BYTE* vals, HuffCode* table) {
+        uint16_t code = 0;
+        int k = 0;
+        for (int len=1; len<=16; ++len) {
+            for (int i=0; i<bits[len - 1]; ++i) table[vals[k++]] = { code++, (uint8_t)len };
+            code <<= 1;
+        }
+    }
+
+    // IJG quality scaling of the Annex K tables
+    void setQuality(int quality) {
+        quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+        if (quality == m_quality) return;
+        m_quality = quality;
+        int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+        static const float aan[8] = { 1.0f, 1.387039845f, 1.306562965f, 1.175875602f, 1.0f, 0.785694958f, 0.541196100f, 0.275899379f };
+        for (int i=0; i<64; ++i) {
+            int l = (JPEG_LUMA_QUANT[i] * scale + 50) / 100, c = (JPEG_CHROMA_QUANT[i] * scale + 50) / 100;
+            l = l < 1 ? 1 : l > 255 ? 255 : l;
+            c = c < 1 ? 1 : c > 255 ? 255 : c;
+            float s = aan[i / 8] * aan[i % 8] * 8.0f;
+            m_divLuma[i] = 1.0f / (l * s);
+            m_divChroma[i] = 1.0f / (c * s);
+            m_qtLuma[i] = (BYTE)l;
+            m_qtChroma[i] = (BYTE)c;
+        }
+    }
+
+    void putByte(BYTE b) { m_out->push_back(b); }
+    void putWord(int v) { putByte((BYTE)(v >> 8)); putByte((BYTE)v); }
+    void putMarker(BYTE m) { putByte(0xFF); putByte(m); }
+
+    void writeHuffmanTable(int tableClass, int id, const BYTE* bits, const BYTE* vals) {
+        int count = 0;
+        for (int i=0; i<16; ++i) count += bits[i];
+        putMarker(0xC4);
+        putWord(2 + 1 + 16 + count);
+        putByte((BYTE)((tableClass << 4) | id));
+        for (int i=0; i<16; ++i) putByte(bits[i]);
+        for (int i=0; i<count; ++i) putByte(vals[i]);
+    }
+
+    void writeTables() {
+        putMarker(0xDB);
+        putWord(2 + 2 * 65);
+        putByte(0);
+        for (int i=0; i<64; ++i) putByte(m_qtLuma[JPEG_ZIGZAG[i]]);
+        putByte(1);
+        for (int i=0; i<64; ++i) putByte(m_qtChroma[JPEG_ZIGZAG[i]]);
+
+        writeHuffmanTable(0, 0, JPEG_DC_LUMA_BITS, JPEG_DC_VALS);
+        writeHuffmanTable(1, 0, JPEG_AC_LUMA_BITS, JPEG_AC_LUMA_VALS);
+        writeHuffmanTable(0, 1, JPEG_DC_CHROMA_BITS, JPEG_DC_VALS);
+        writeHuffmanTable(1, 1, JPEG_AC_CHROMA_BITS, JPEG_AC_CHROMA_VALS);
+    }
+
+    // SOF0 and SOS of a w x h 4:2:0 image
+    void writeFrameHeader(int w, int h) {
+        putMarker(0xC0);
+        putWord(8 + 3 * 3);
+        putByte(8);
+        putWord(h); putWord(w);
+        putByte(3);
+        putByte(1); putByte(0x22); putByte(0);
+        putByte(2); putByte(0x11); putByte(1);
+        putByte(3); putByte(0x11); putByte(1);
+
+        putMarker(0xDA);
+        putWord(6 + 2 * 3);
+        putByte(3);
+        putByte(1); putByte(0x00);
+        putByte(2); putByte(0x11);
+        putByte(3); putByte(0x11);
+        putByte(0); putByte(63); putByte(0);
+    }
+
+    // Level-shifted Y, Cb and Cr blocks of the 16x16 MCU at mx,my
+    void loadMCU(int mx, int my) {
+        for (int y=0; y<16; ++y) {
+            const BYTE* row = m_planeY.data() + (size_t)(my + y) * m_planeW + mx;
+            float* yBlock = m_y[(y / 8) * 2] + (y % 8) * 8;
+            for (int x=0; x<8; ++x) {
+                yBlock[x] = row[x] - 128.0f;
+                yBlock[64 + x] = row[8 + x] - 128.0f;
+            }
+        }
+        int cw = m_planeW / 2;
+        for (int y=0; y<8; ++y) {
+            const BYTE* cb = m_planeCb.data() + (size_t)(my / 2 + y) * cw + mx / 2;
+            const BYTE* cr = m_planeCr.data() + (size_t)(my / 2 + y) * cw + mx / 2;
+            for (int x=0; x<8; ++x) {
+                m_cb[y * 8 + x] = cb[x] - 128.0f;
+                m_cr[y * 8 + x] = cr[x] - 128.0f;
+            }
+        }
+    }
+
+    void putBits(uint32_t bits, int len) {
+        m_bitBuf = (m_bitBuf << len) | (bits & ((1u << len) - 1));
+        m_bitCount += len;
+        while (m_bitCount >= 8) {
+            BYTE b = (BYTE)(m_bitBuf >> (m_bitCount - 8));
+            putByte(b);
+            if (b == 0xFF) putByte(0);  // byte stuffing
+            m_bitCount -= 8;
+        }
+    }
+
+    // Magnitude category and the value bits that follow the Huffman code
+    static int Category(int v) {
+        int a = v < 0 ? -v : v, n = 0;
+        while (a) { ++n; a >>= 1; }
+        return n;
+    }
+    void putValue(int v, int n) {
+        if (n) putBits((uint32_t)(v < 0 ? v - 1 : v), n);
+    }
+
+    void encodeBlock(float* block, const float* div, int& prevDC, const HuffCode* dcTable, const HuffCode* acTable) {
+        ForwardDCT8x8(block);
+        int q[64];
+        for (int i=0; i<64; ++i) {
+            float v = block[i] * div[i];
+            q[i] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+        }
+
+        int diff = q[0] - prevDC;
+        prevDC = q[0];
+        int n = Category(diff);
+        putBits(dcTable[n].code, dcTable[n].len);
+        putValue(diff, n);
+
+        int run = 0;
+        for (int k=1; k<64; ++k) {
+            int v = q[JPEG_ZIGZAG[k]];
+            if (v == 0) { ++run; continue; }
+            while (run > 15) {
+                putBits(acTable[0xF0].code, acTable[0xF0].len);
+                run -= 16;
+            }
+            n = Category(v);
+            const HuffCode& hc = acTable[(run << 4) | n];
+            putBits(hc.code, hc.len);
+            putValue(v, n);
+            run = 0;
+        }
+        if (run > 0) putBits(acTable[0x00].code, acTable[0x00].len);
+    }
+
+    std::vector<BYTE>* m_out = nullptr;
+    uint32_t m_bitBuf = 0;
+    int m_bitCount = 0;
+    int m_quality = -1;
+    BYTE m_qtLuma[64], m_qtChroma[64];          // natural order
+    float m_divLuma[64], m_divChroma[64];       // 1 / (quant * DCT scale)
+    HuffCode m_dcLuma[256], m_dcChroma[256], m_acLuma[256], m_acChroma[256];
+    float m_y[4][64], m_cb[64], m_cr[64];       // current MCU
+    std::vector<BYTE> m_planeY, m_planeCb, m_planeCr;
+    int m_planeW = 0;
+};
+
+// Box-filters a view to half size, rounding odd sizes up, into dst.
+// Reduced-resolution tiles (REC_JPEG_HALF) are encoded from this.
+PixelView Downscale2x(const PixelView& src, std::vector<BYTE>& dst) {
+    int dw = (src.w + 1) / 2, dh = (src.h + 1) / 2;
+    dst.resize((size_t)dw * dh * 4);
+    for (int y=0; y<dh; ++y) {
+        const BYTE* r0 = src.pixels + (size_t)(2 * y) * src.stride;
+        const BYTE* r1 = 2 * y + 1 < src.h ? r0 + src.stride : r0;
+        BYTE* out = dst.data() + (size_t)y * dw * 4;
+        for (int x=0; x<dw; ++x) {
+            int x0 = 2 * x * 4, x1 = (2 * x + 1 < src.w ? 2 * x + 1 : 2 * x) * 4;
+            for (int c=0; c<4; ++c) out[x * 4 + c] = (BYTE)((r0[x0 + c] + r0[x1 + c] + r1[x0 + c] + r1[x1 + c] + 2) >> 2);
+        }
+    }
+    PixelView half = { dst.data(), dw * 4, dw, dh };
+    return half;
+}
+
+// Bilinear inverse of Downscale2x: fills a dw x dh image from the
+// (dw+1)/2 x (dh+1)/2 source, sampling between source pixel centers
+void Upscale2x(const BYTE* src, int sw, int sh, BYTE* dst, int dw, int dh) {
+    for (int y=0; y<dh; ++y) {
+        // destination center y maps to source (2y - 1) / 4, in quarter pixels
+        int qy = 2 * y - 1 + 4, y0 = qy / 4 - 1, wy = qy % 4;
+        const BYTE* r0 = src + (size_t)max(y0, 0) * sw * 4;
+        const BYTE* r1 = src + (size_t)min(y0 + 1, sh - 1) * sw * 4;
+        BYTE* out = dst + (size_t)y * dw * 4;
+        for (int x=0; x<dw; ++x) {
+            int qx = 2 * x - 1 + 4, x0 = qx / 4 - 1, wx = qx % 4;
+            int a = max(x0, 0) * 4, b = min(x0 + 1, sw - 1) * 4;
+            for (int c=0; c<4; ++c) {
+                int top = r0[a + c] * (4 - wx) + r0[b + c] * wx;
+                int bottom = r1[a + c] * (4 - wx) + r1[b + c] * wx;
+                out[x * 4 + c] = (BYTE)((top * (4 - wy) + bottom * wy + 8) >> 4);
+            }
+        }
+    }
+}
+
+// ---------- lossless tiles ----------
+// Lossless coding for text and UI rectangles, where JPEG rings around glyph
+// edges. Content with up to LOSSLESS_MAX_COLORS colors is sent as palette
+// indices, using "same as left" and "same as above" symbols for the runs.
+// Other content is sent as MED-predicted residuals of G, R-G and B-G. Each
+// symbol plane is entropy coded with a static order-0 rANS coder, and its
+// frequency table travels with the tile.
+//
+// Payload: mode (0 = palette, 1 = predictive). Palette mode then has the
+// color count and BGR colors followed by one plane. Predictive mode has
+// three planes. A plane is: used symbol count, (symbol, varint frequency)
+// pairs, varint byte count, then the rANS bytes.
+
+const int RANS_PROB_BITS = 12;
+const uint32_t RANS_PROB_SCALE = 1u << RANS_PROB_BITS;
+const uint32_t RANS_L = 1u << 23;       // lower bound of the normalized state
+const int LOSSLESS_MAX_COLORS = 254;    // palette symbols 2..255
+
+// Scales symbol counts to frequencies summing to RANS_PROB_SCALE while
+// keeping every used symbol codable
+inline void NormalizeFreqs(const uint32_t counts[256], uint32_t total, uint32_t freqs[256]) {
+    uint32_t sum = 0;
+    for (int s=0; s<256; ++s) {
+        freqs[s] = counts[s] ? (uint32_t)((uint64_t)counts[s] * RANS_PROB_SCALE / total) : 0;
+        if (counts[s] && freqs[s] == 0) freqs[s] = 1;
+        sum += freqs[s];
+    }
+    // rounding leaves the total slightly off; the most frequent symbols absorb it
+    while (sum != RANS_PROB_SCALE) {
+        int largest = 0;
+        for (int s=1; s<256; ++s) if (freqs[s] > freqs[largest]) largest = s;
+        if (sum < RANS_PROB_SCALE) { freqs[largest] += RANS_PROB_SCALE - sum; sum = RANS_PROB_SCALE; }
+        else {
+            uint32_t take = min(sum - RANS_PROB_SCALE, freqs[largest] - 1);
+            freqs[largest] -= take; sum -= take;
+        }
+    }
+}
+
+// Appends one rANS-coded symbol plane to out; scratch is reused
+inline void RansEncodePlane(const BYTE* syms, size_t n, std::vector<BYTE>& scratch, std::vector<BYTE>& out) {
+    uint32_t counts[256] = {}, freqs[256], starts[256];
+    for (size_t i=0; i<n; ++i) counts[syms[i]]++;
+    NormalizeFreqs(counts, (uint32_t)n, freqs);
+
+    int used = 0;
+    for (int s=0; s<256; ++s) used += freqs[s] != 0;
+    out.push_back((BYTE)(used - 1));
+    uint32_t start = 0;
+    for (int s=0; s<256; ++s) {
+        starts[s] = start;
+        start += freqs[s];
+        if (!freqs[s]) continue;
+        out.push_back((BYTE)s);
+        PutVarint(out, freqs[s]);
+    }
+
+    // symbols are coded last to first so the decoder reads forwards; a
+    // symbol costs at most RANS_PROB_BITS bits
+    scratch.resize(n * 2 + 8);
+    BYTE* end = scratch.data() + scratch.size();
+    BYTE* p = end;
+    uint32_t x = RANS_L;
+    for (size_t i=n; i-- > 0; ) {
+        uint32_t f = freqs[syms[i]];
+        uint32_t xMax = ((RANS_L >> RANS_PROB_BITS) << 8) * f;
+        while (x >= xMax) { *--p = (BYTE)x; x >>= 8; }
+        x = ((x / f) << RANS_PROB_BITS) + (x % f) + starts[syms[i]];
+    }
+    p -= 4;
+    p[0] = (BYTE)x; p[1] = (BYTE)(x >> 8); p[2] = (BYTE)(x >> 16); p[3] = (BYTE)(x >> 24);
+
+    PutVarint(out, (uint32_t)(end - p));
+    out.insert(out.end(), p, end);
+}
+
+// Decodes one plane of n symbols; advances p
+inline bool RansDecodePlane(const BYTE*& p, const BYTE* end, size_t n, BYTE* syms) {
+    if (p >= end) return false;
+    int used = *p++ + 1;
+    uint32_t freqs[256] = {}, starts[256];
+    BYTE slotSym[RANS_PROB_SCALE];
+    uint32_t total = 0;
+    for (int i=0; i<used; ++i) {
+        uint32_t f;
+        if (p >= end) return false;
+        int s = *p++;
+        if (!GetVarint(p, end, f) || f == 0 || f > RANS_PROB_SCALE - total || freqs[s]) return false;
+        freqs[s] = f;
+        total += f;
+    }
+    if (total != RANS_PROB_SCALE) return false;
+    uint32_t start = 0;
+    for (int s=0; s<256; ++s) {
+        starts[s] = start;
+        memset(slotSym + start, s, freqs[s]);
+        start += freqs[s];
+    }
+
+    uint32_t len;
+    if (!GetVarint(p, end, len) || len < 4 || len > (size_t)(end - p)) return false;
+    const BYTE* q = p;
+    const BYTE* qEnd = p + len;
+    p += len;
+    uint32_t x = (uint32_t)q[0] | ((uint32_t)q[1] << 8) | ((uint32_t)q[2] << 16) | ((uint32_t)q[3] << 24);
+    q += 4;
+    const uint32_t mask = RANS_PROB_SCALE - 1;
+    for (size_t i=0; i<n; ++i) {
+        BYTE s = slotSym[x & mask];
+        syms[i] = s;
+        x = freqs[s] * (x >> RANS_PROB_BITS) + (x & mask) - starts[s];
+        while (x < RANS_L) {
+            if (q >= qEnd) return false;
+            x = (x << 8) | *q++;
+        }
+    }
+    return true;
+}
+
+// MED (LOCO-I) predictor from the left, above and upper-left neighbours
+inline int MedPredict(int a, int b, int c) {
+    int lo = a < b ? a : b, hi = a < b ? b : a;
+    if (c >= hi) return lo;
+    if (c <= lo) return hi;
+    return a + b - c;
+}
+
+// Neighbour prediction at x,y of a w-wide plane; edges fall back to the
+// single available neighbour
+inline int PlanePredict(const BYTE* plane, int w, int x, int y) {
+    const BYTE* cur = plane + (size_t)y * w;
+    if (y == 0) return x ? cur[x - 1] : 0;
+    if (x == 0) return cur[x - w];
+    return MedPredict(cur[x - 1], cur[x - w], cur[x - w - 1]);
+}
+
+// Text and UI statistics: mostly flat pixels with sharp edges, where
+// photos and video have neither. Every other row is sampled.
+inline bool LooksLikeText(const PixelView& img) {
+    uint64_t samples = 0, flat = 0, edges = 0;
+    for (int y=0; y<img.h; y+=2) {
+        const BYTE* row = img.pixels + (size_t)y * img.stride;
+        for (int x=1; x<img.w; ++x) {
+            const BYTE* a = row + (x - 1) * 4;
+            const BYTE* b = row + x * 4;
+            int d = abs(a[0] - b[0]) + abs(a[1] - b[1]) + abs(a[2] - b[2]);
+            ++samples;
+            if (d == 0) ++flat;
+            else if (d > 96) ++edges;
+        }
+    }
+    if (samples == 0) return true;
+    // text: a flat background broken by high-contrast glyph edges
+    return flat * 10 >= samples * 6 && edges * 50 >= samples;
+}
+
+class LosslessEncoder {
+public:
+    // Appends a lossless payload for img to out. Returns false with out
+    // unchanged when the content is better left to JPEG: too many colors
+    // without text-like statistics, or a result above maxBytes.
+    bool encode(const PixelView& img, size_t maxBytes, std::vector<BYTE>& out) {
+        size_t n = (size_t)img.w * img.h, base = out.size();
+        int colors = collectColors(img);
+        if (colors == 0 && !LooksLikeText(img)) return false;
+        if (colors > 0) {
+            out.push_back(0);
+            out.push_back((BYTE)colors);
+            for (int i=0; i<colors; ++i) {
+                uint32_t c = m_colors[i];
+                out.push_back((BYTE)c); out.push_back((BYTE)(c >> 8)); out.push_back((BYTE)(c >> 16));
+            }
+            m_planes.resize(n);
+            BYTE* sym = m_planes.data();
+            for (int y=0; y<img.h; ++y) {
+                const uint32_t* row = (const uint32_t*)(img.pixels + (size_t)y * img.stride);
+                const uint32_t* up = (const uint32_t*)(img.pixels + (size_t)(y - 1) * img.stride);
+                for (int x=0; x<img.w; ++x) {
+                    uint32_t c = row[x] & 0x00FFFFFF;
+                    if (x > 0 && c == (row[x - 1] & 0x00FFFFFF)) *sym++ = 0;
+                    else if (y > 0 && c == (up[x] & 0x00FFFFFF)) *sym++ = 1;
+                    else *sym++ = (BYTE)(2 + indexOf(c));
+                }
+            }
+            RansEncodePlane(m_planes.data(), n, m_scratch, out);
+        } else {
+            out.push_back(1);
+            // color decorrelation: G, R-G, B-G
+            m_planes.resize(n * 3);
+            BYTE* g = m_planes.data();
+            BYTE* rg = g + n;
+            BYTE* bg = rg + n;
+            for (int y=0; y<img.h; ++y) {
+                const BYTE* row = img.pixels + (size_t)y * img.stride;
+                for (int x=0; x<img.w; ++x) {
+                    const BYTE* px = row + x * 4;
+                    size_t i = (size_t)y * img.w + x;
+                    g[i] = px[1];
+                    rg[i] = (BYTE)(px[2] - px[1]);
+                    bg[i] = (BYTE)(px[0] - px[1]);
+                }
+            }
+            m_residuals.resize(n);
+            for (int p=0; p<3; ++p) {
+                const BYTE* plane = m_planes.data() + n * p;
+                for (int y=0; y<img.h; ++y)
+                    for (int x=0; x<img.w; ++x) {
+                        size_t i = (size_t)y * img.w + x;
+                        m_residuals[i] = (BYTE)(plane[i] - PlanePredict(plane, img.w, x, y));
+                    }
+                RansEncodePlane(m_residuals.data(), n, m_scratch, out);
+                if (out.size() - base > maxBytes) break;
+            }
+        }
+        if (out.size() - base > maxBytes) { out.resize(base); return false; }
+        return true;
+    }
+
+private:
+    // Fills m_colors with the distinct colors (alpha ignored); 0 if there
+    // are more than LOSSLESS_MAX_COLORS
+    int collectColors(const PixelView& img) {
+        memset(m_slots, 0xFF, sizeof(m_slots));
+        int n = 0;
+        uint32_t last = 0xFFFFFFFF;
+        for (int y=0; y<img.h; ++y) {
+            const uint32_t* row = (const uint32_t*)(img.pixels + (size_t)y * img.stride);
+            for (int x=0; x<img.w; ++x) {
+                uint32_t c = row[x] & 0x00FFFFFF;
+                if (c == last) continue;
+                last = c;
+                int s = slotOf(c);
+                if (m_slots[s] != 0xFFFF) continue;
+                if (n == LOSSLESS_MAX_COLORS) return 0;
+                m_slots[s] = (uint16_t)n;
+                m_colors[n++] = c;
+            }
+        }
+        return n;
+    }
+    // open addressing: the slot holding c, or the empty slot where it belongs
+    int slotOf(uint32_t c) const {
+        int s = (int)((c * 0x9E3779B1u) >> (32 - COLOR_HASH_BITS));
+        while (m_slots[s] != 0xFFFF && m_colors[m_slots[s]] != c) s = (s + 1) & (COLOR_HASH_SIZE - 1);
+        return s;
+    }
+    int indexOf(uint32_t c) const { return m_slots[slotOf(c)]; }
+
+    static const int COLOR_HASH_BITS = 9, COLOR_HASH_SIZE = 1 << COLOR_HASH_BITS;
+    uint16_t m_slots[COLOR_HASH_SIZE];
+    uint32_t m_colors[LOSSLESS_MAX_COLORS];
+    std::vector<BYTE> m_planes, m_residuals, m_scratch;
+};
+
+// Decodes a lossless payload into a w x h block of dst
+inline bool DecodeLossless(const BYTE* data, size_t len, int w, int h, BYTE* dst, int dstStride) {
+    const BYTE* p = data;
+    const BYTE* end = data + len;
+    size_t n = (size_t)w * h;
+    if (p >= end) return false;
+    int mode = *p++;
+    if (mode == 0) {
+        if (p >= end) return false;
+        int colors = *p++;
+        if (colors < 1 || colors > LOSSLESS_MAX_COLORS || end - p < colors * 3) return false;
+        uint32_t palette[LOSSLESS_MAX_COLORS];
+        for (int i=0; i<colors; ++i, p+=3) palette[i] = 0xFF000000 | p[0] | (p[1] << 8) | (p[2] << 16);
+        std::vector<BYTE> sym(n);
+        if (!RansDecodePlane(p, end, n, sym.data())) return false;
+        for (int y=0; y<h; ++y) {
+            uint32_t* row = (uint32_t*)(dst + (size_t)y * dstStride);
+            const uint32_t* up = (const uint32_t*)(dst + (size_t)(y - 1) * dstStride);
+            for (int x=0; x<w; ++x) {
+                int s = sym[(size_t)y * w + x];
+                if (s == 0) { if (x == 0) return false; row[x] = row[x - 1]; }
+                else if (s == 1) { if (y == 0) return false; row[x] = up[x]; }
+                else { if (s - 2 >= colors) return false; row[x] = palette[s - 2]; }
+            }
+        }
+        return true;
+    }
+    if (mode != 1) return false;
+    std::vector<BYTE> planes(n * 3);
+    for (int pl=0; pl<3; ++pl) {
+        BYTE* plane = planes.data() + n * pl;
+        if (!RansDecodePlane(p, end, n, plane)) return false;
+        // residuals become values in place; prediction only looks back
+        for (int y=0; y<h; ++y)
+            for (int x=0; x<w; ++x) {
+                size_t i = (size_t)y * w + x;
+                plane[i] = (BYTE)(plane[i] + PlanePredict(plane, w, x, y));
+            }
+    }
+    const BYTE* g = planes.data();
+    const BYTE* rg = g + n;
+    const BYTE* bg = rg + n;
+    for (int y=0; y<h; ++y) {
+        BYTE* row = dst + (size_t)y * dstStride;
+        for (int x=0; x<w; ++x) {
+            size_t i = (size_t)y * w + x;
+            row[x * 4 + 0] = (BYTE)(bg[i] + g[i]);
+            row[x * 4 + 1] = g[i];
+            row[x * 4 + 2] = (BYTE)(rg[i] + g[i]);
+            row[x * 4 + 3] = 0xFF;
+        }
+    }
+    return true;
+}
+
+// ---------- frame budget ----------
+// Splits a per-frame byte budget across the rectangles waiting for JPEG,
+// so a full-screen change costs a bounded number of bytes instead of
+// whatever the top quality produces. Size predictions come from
+// header + pixels * bpp50 * JpegSizeFactor(quality, bpp50). bpp50 is
+// bytes per pixel at quality 50. It is taken from the tile's earlier
+// encodes, or estimated from the luma gradient for content not seen
+// before.
+// Qualities are then lowered one step at a time. Each step goes where it
+// saves the most bytes per unit of added distortion (the squared
+// quantizer scale per pixel). So busy content, which costs the most and
+// hides artifacts best, gives way first.
+
+const int JPEG_HEADER_BYTES = 38;       // table id and abbreviated JpegEncoder output around the scan data
+// JpegEncoder scan size relative to quality 50 at qualities 10, 20, ..., 90,
+// measured on the synthetic workloads. Nearly flat content barely grows
+// with quality; anything with detail follows the steep curve.
+static const float JPEG_SIZE_FLAT[] = { 0.93f, 0.955f, 0.975f, 0.985f, 1.0f, 1.025f, 1.09f, 1.2f, 1.48f };
+static const float JPEG_SIZE_DETAIL[] = { 0.50f, 0.65f, 0.78f, 0.89f, 1.0f, 1.11f, 1.28f, 1.56f, 2.18f };
+
+inline float JpegSizeFactor(int quality, float bpp50) {
+    quality = min(max(quality, 10), 90);
+    int i = min(quality / 10 - 1, 7);
+    float t = (quality - (i + 1) * 10) / 10.0f;
+    float flat = JPEG_SIZE_FLAT[i] + (JPEG_SIZE_FLAT[i + 1] - JPEG_SIZE_FLAT[i]) * t;
+    float detail = JPEG_SIZE_DETAIL[i] + (JPEG_SIZE_DETAIL[i + 1] - JPEG_SIZE_DETAIL[i]) * t;
+    float d = min(max((bpp50 - 0.02f) / 0.02f, 0.0f), 1.0f);
+    return flat + (detail - flat) * d;
+}
+
+inline size_t PredictJpegBytes(size_t pixels, float bpp50, int quality) {
+    return JPEG_HEADER_BYTES + (size_t)(pixels * bpp50 * JpegSizeFactor(quality, bpp50));
+}
+
+// bpp50 of an encode of scanBytes at quality; the curve depends on the
+// answer, so one refinement pass follows the detailed-curve guess
+inline float MeasureJpegBpp50(size_t scanBytes, size_t pixels, int quality) {
+    float bytesPerPixel = (float)scanBytes / pixels;
+    float bpp = bytesPerPixel / JpegSizeFactor(quality, 1.0f);
+    return bytesPerPixel / JpegSizeFactor(quality, bpp);
+}
+
+// Squared IJG quantizer scale: per-pixel distortion of a quality
+inline float QuantDistortion(int quality) {
+    float s = (quality < 50 ? 5000.0f / quality : 200.0f - 2 * quality) / 100.0f;
+    return s * s;
+}
+
+// Bytes per pixel at quality 50 from the mean luma gradient, sampled on
+// every other row and column (fit on the synthetic workloads)
+float EstimateJpegBpp50(const PixelView& v) {
+    uint64_t sum = 0, n = 0;
+    for (int y=0; y+1<v.h; y+=2) {
+        const BYTE* row = v.pixels + (size_t)y * v.stride;
+        const BYTE* below = row + v.stride;
+        for (int x=0; x+1<v.w; x+=2) {
+            const BYTE* p = row + x * 4;
+            int l = p[0] + 2 * p[1] + p[2];
+            int r = p[4] + 2 * p[5] + p[6];
+            int d = below[x * 4] + 2 * below[x * 4 + 1] + below[x * 4 + 2];
+            sum += abs(l - r) + abs(l - d);
+            n++;
+        }
+    }
+    double gradient = n ? sum / (4.0 * n) : 0;
+    return (float)(0.00348 * gradient + 0.0238);
+}
+
+struct BudgetItem {
+    size_t pixels;      // pixels that get encoded
+    float bpp50;
+    int quality;        // in: highest allowed; out: allotted
+};
+
+// Lowers item qualities in steps of 10, never below 10, until the
+// predicted total fits the budget; returns the predicted total
+size_t AllocateFrameBudget(std::vector<BudgetItem>& items, size_t budget) {
+    size_t total = 0;
+    for (const BudgetItem& it : items) total += PredictJpegBytes(it.pixels, it.bpp50, it.quality);
+
+    auto nextQuality = [](int q) { return (q - 1) / 10 * 10; };    // 90 -> 80, 45 -> 40
+    // next step of each item, cheapest distortion per saved byte first
+    typedef std::pair<float, size_t> Step;
+    std::priority_queue<Step, std::vector<Step>, std::greater<Step>> steps;
+    auto pushStep = [&](size_t i) {
+        const BudgetItem& it = items[i];
+        int q = nextQuality(it.quality);
+        if (q < 10) return;
+        float saved = it.pixels * it.bpp50 * (JpegSizeFactor(it.quality, it.bpp50) - JpegSizeFactor(q, it.bpp50));
+        float added = it.pixels * (QuantDistortion(q) - QuantDistortion(it.quality));
+        steps.push({ added / max(saved, 1e-3f), i });
+    };
+    for (size_t i=0; i<items.size(); ++i) pushStep(i);
+
+    while (total > budget && !steps.empty()) {
+        BudgetItem& it = items[steps.top().second];
+        size_t i = steps.top().second;
+        steps.pop();
+        size_t before = PredictJpegBytes(it.pixels, it.bpp50, it.quality);
+        it.quality = nextQuality(it.quality);
+        total -= before - PredictJpegBytes(it.pixels, it.bpp50, it.quality);
+        pushStep(i);
+    }
+    return total;
+}
+
+// ---------- region merging ----------
+// Rects bound for the encoder are joined into larger ones when that saves
+// bytes: every record costs its header, while a joined rect also encodes
+// the unchanged pixels between its parts. Adjacent changed tiles, as in a
+// window drag or a video, become a few large records.
+
+const size_t MERGE_RECORD_BYTES = WIRE_RECORD_BYTES + JPEG_HEADER_BYTES;
+
+struct MergeItem {
+    DirtyRect rect;
+    size_t covered;         // changed pixels inside rect
+    int group;              // only items of one group merge; -1 never
+    float bytesPerPixel;    // predicted encoded size
+    int into;               // out: item this one was merged into, or -1
+};
+
+// Greedily joins pairs of items whose bounding box stays within maxArea
+// and whose extra pixels cost less than the header they save. Returns the
+// number of items merged away; their into points at a surviving item.
+size_t MergeRects(std::vector<MergeItem>& items, size_t maxArea) {
+    size_t merged = 0;
+    for (bool again = true; again; ) {
+        again = false;
+        for (size_t i=0; i<items.size(); ++i) {
+            MergeItem& a = items[i];
+            if (a.into >= 0 || a.group < 0) continue;
+            for (size_t j=i+1; j<items.size(); ++j) {
+                MergeItem& b = items[j];
+                if (b.into >= 0 || b.group != a.group) continue;
+                int x0 = min(a.rect.x, b.rect.x), y0 = min(a.rect.y, b.rect.y);
+                int x1 = max(a.rect.x + a.rect.w, b.rect.x + b.rect.w), y1 = max(a.rect.y + a.rect.h, b.rect.y + b.rect.h);
+                size_t area = (size_t)(x1 - x0) * (y1 - y0);
+                if (area > maxArea) continue;
+                size_t covered = a.covered + b.covered;
+                float bpp = (a.bytesPerPixel * a.covered + b.bytesPerPixel * b.covered) / max(covered, (size_t)1);
+                if (area > covered && (area - covered) * bpp > MERGE_RECORD_BYTES) continue;
+                a.rect = { x0, y0, x1 - x0, y1 - y0 };
+                a.covered = min(covered, area);
+                a.bytesPerPixel = bpp;
+                b.into = (int)i;
+                merged++;
+                again = true;
+            }
+        }
+    }
+    // later passes can merge a survivor away; point everything at the end
+    // of its chain
+    for (MergeItem& it : items) {
+        while (it.into >= 0 && items[it.into].into >= 0) it.into = items[it.into].into;
+    }
+    return merged;
+}
+
+// ---------- tile state ----------
+// Per-tile bookkeeping in a flat grid indexed by tile column and row. Each
+// entry fills one cache line, so workers handling different tiles never
+// write to a shared line and need no locking.
+const size_t CACHE_LINE = 64;
+
+// What the client holds for a tile, lowest of all its parts
+enum TileQuality : uint8_t {
+    QUALITY_NONE = 0,       // never sent completely
+    QUALITY_DRAFT = 1,      // some part is a low-quality first pass
+    QUALITY_FINAL = 2,      // lossless or JPEG at FINAL_JPEG_QUALITY
+};
+const int FINAL_JPEG_QUALITY = 90;
+
+struct alignas(64) TileState {
+    uint64_t hash;           // content hash at the last diff (hash mode)
+    bool hashValid;
+    bool refresh;            // delivery failed (UDP): resent whole at the next frame
+    uint8_t quality;         // TileQuality delivered to the client
+    uint8_t motionFrames;    // consecutive frames with changes, saturating
+    uint32_t lastSentFrame;  // frame number the tile last went out in
+    uint32_t changeCount;    // frames in which the tile changed
+    uint32_t staticFrames;   // frames since the last change
+    uint32_t encodeCount;    // rectangles JPEG-encoded from this tile
+    uint64_t encodedBytes;   // payload bytes sent for this tile
+    double encodeMs;
+    float jpegBpp50;         // JPEG bytes per pixel at quality 50 from the last encode, 0 = unknown
+};
+static_assert(sizeof(TileState) == CACHE_LINE, "TileState should fill one cache line");
+
+class TileGrid {
+public:
+    // Sizes the grid for a capture; a new geometry drops all state
+    void resize(int screenW, int screenH, int tileW, int tileH) {
+        int cols = (screenW + tileW - 1) / tileW, rows = (screenH + tileH - 1) / tileH;
+        if (cols == m_cols && rows == m_rows && tileW == m_tileW && tileH == m_tileH) return;
+        m_cols = cols; m_rows = rows; m_tileW = tileW; m_tileH = tileH;
+        // std::vector only guarantees alignof(max_align_t), so align by hand
+        m_storage.assign((size_t)cols * rows * sizeof(TileState) + CACHE_LINE, 0);
+        uintptr_t base = (uintptr_t)m_storage.data();
+        m_tiles = (TileState*)((base + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1));
+    }
+    void clear() {
+        if (m_tiles) memset(m_tiles, 0, (size_t)m_cols * m_rows * sizeof(TileState));
+    }
+
+    int cols() const { return m_cols; }
+    int rows() const { return m_rows; }
+    TileState& at(int col, int row) { return m_tiles[(size_t)row * m_cols + col]; }
+    // Tile containing pixel x,y
+    TileState& atPixel(int x, int y) { return at(x / m_tileW, y / m_tileH); }
+
+private:
+    int m_cols = 0, m_rows = 0, m_tileW = 0, m_tileH = 0;
+    std::vector<BYTE> m_storage;
+    TileState* m_tiles = nullptr;
+};
+
+// ---------- encode pool ----------
+// Work-stealing pool for per-frame batches of independent jobs (tile
+// encodes). Jobs are dealt round robin into one deque per thread; a thread
+// takes from the back of its own deque and steals from the front of the
+// others', so a few expensive tiles don't leave the other cores idle. The
+// submitting thread works as well, and parallelFor returns once the whole
+// batch is done.
+class WorkStealingPool {
+public:
+    // threads 0 = one per core, including the calling thread
+    explicit WorkStealingPool(int threads = 0) {
+        if (threads <= 0) threads = (int)std::thread::hardware_concurrency();
+        if (threads <= 0) threads = 1;
+        for (int i=0; i<threads; ++i) m_queues.emplace_back(new Queue);
+        for (int i=1; i<threads; ++i) m_workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (auto& t : m_workers) t.join();
+    }
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    int threads() const { return (int)m_queues.size(); }
+
+    // Calls fn(i, thread) for every i in [0, count), concurrently; thread
+    // is the index (0 .. threads()-1) of the thread running the job, for
+    // picking per-thread scratch state
+    void parallelFor(size_t count, const std::function<void(size_t, int)>& fn) {
+        if (count == 0) return;
+        if (threads() == 1 || count == 1) {
+            for (size_t i=0; i<count; ++i) fn(i, 0);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_fn = &fn;
+            m_pending = count;
+            for (size_t i=0; i<count; ++i) {
+                Queue& q = *m_queues[i % m_queues.size()];
+                std::lock_guard<std::mutex> qlock(q.mutex);
+                q.jobs.push_back(i);
+            }
+            ++m_batch;
+        }
+        m_wake.notify_all();
+        runJobs(0);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [&] { return m_pending == 0; });
+        m_fn = nullptr;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> jobs;
+    };
+
+    void workerLoop(int self) {
+        uint64_t seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [&] { return m_stop || m_batch != seen; });
+                if (m_stop) return;
+                seen = m_batch;
+            }
+            runJobs(self);
+        }
+    }
+
+    bool take(int self, size_t& job) {
+        int n = (int)m_queues.size();
+        for (int k=0; k<n; ++k) {
+            Queue& q = *m_queues[(self + k) % n];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.jobs.empty()) continue;
+            if (k == 0) { job = q.jobs.back(); q.jobs.pop_back(); }
+            else { job = q.jobs.front(); q.jobs.pop_front(); }
+            return true;
+        }
+        return false;
+    }
+
+    void runJobs(int self) {
+        size_t job;
+        while (take(self, job)) {
+            (*m_fn)(job, self);
+            if (m_pending.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_done.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wake, m_done;
+    const std::function<void(size_t, int)>* m_fn = nullptr;
+    std::atomic<size_t> m_pending{0};
+    uint64_t m_batch = 0;
+    bool m_stop = false;
+};
+
+// ---------- rate control ----------
+// Picks how much the video stream may cost from what the link has shown.
+// The client acknowledges the total video bytes it has processed (control
+// message 5). Each ack yields an RTT sample for the send that completed
+// and a delivery rate. Queueing delay is the smoothed RTT above the
+// recent minimum. The controller walks a ladder of operating points
+// (JPEG quality, frame interval, tile resolution). It steps down as soon
+// as queueing delay passes the latency target and steps back up after
+// the queue has stayed short for a while. Frames are skipped while more
+// is in flight than the link drains within the target, so sends never
+// pile up behind a blocked socket.
+
+struct RateLevel { int quality; int intervalMs; int scale; };
+static const RateLevel RATE_LEVELS[] = {
+    { 90,  40, 1 },
+    { 75,  40, 1 },
+    { 60,  66, 1 },
+    { 45, 100, 1 },
+    { 35, 150, 2 },
+    { 25, 250, 2 },
+};
+const int RATE_LEVEL_COUNT = sizeof(RATE_LEVELS) / sizeof(RATE_LEVELS[0]);
+
+// Controller state for /stats
+struct RateCounters {
+    bool active = false;            // acks seen; off for clients that never ack
+    int level = 0;
+    double bandwidthKbps = 0, rttMs = 0, minRttMs = 0, queueMs = 0;
+    uint64_t inflightBytes = 0, framesSkipped = 0, levelDowns = 0, levelUps = 0;
+};
+
+class RateController {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    void reset(int latencyTargetMs) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_targetMs = latencyTargetMs;
+        m_sent = m_acked = 0;
+        m_marks.clear();
+        m_rttSamples.clear();
+        m_rateSamples.clear();
+        m_srttMs = m_lastRttMs = 0;
+        m_counters = RateCounters();
+        m_lastChange = m_rateStart = m_lastAck = Clock::now();
+        m_rateStartBytes = 0;
+    }
+
+    // Video bytes handed to the socket for one frame, or one burst of a
+    // streamed frame
+    void onSent(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_sent += bytes;
+        m_marks.push_back({ m_sent, Clock::now() });
+    }
+
+    // The client has processed totalBytes of video
+    void onAck(uint64_t totalBytes) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (totalBytes > m_sent || totalBytes < m_acked) return;
+        Clock::time_point now = Clock::now();
+        m_acked = totalBytes;
+        m_lastAck = now;
+        m_counters.active = true;
+        m_ackCv.notify_all();
+
+        bool haveSample = false;
+        Clock::time_point sentAt;
+        while (!m_marks.empty() && m_marks.front().first <= totalBytes) {
+            sentAt = m_marks.front().second;
+            haveSample = true;
+            m_marks.pop_front();
+        }
+        if (haveSample) {
+            double rtt = std::chrono::duration<double, std::milli>(now - sentAt).count();
+            m_srttMs = m_srttMs == 0 ? rtt : m_srttMs * 0.875 + rtt * 0.125;
+            m_lastRttMs = rtt;
+            m_rttSamples.push_back({ now, rtt });
+        }
+        while (!m_rttSamples.empty() && now - m_rttSamples.front().first > std::chrono::seconds(10)) m_rttSamples.pop_front();
+
+        // delivery rate over spans of at least 200 ms; the estimate is the
+        // best recent span, so quiet (app-limited) periods don't lower it
+        double span = std::chrono::duration<double, std::milli>(now - m_rateStart).count();
+        if (span >= 200) {
+            m_rateSamples.push_back({ now, (totalBytes - m_rateStartBytes) * 8.0 / span });
+            m_rateStart = now;
+            m_rateStartBytes = totalBytes;
+        }
+        while (!m_rateSamples.empty() && now - m_rateSamples.front().first > std::chrono::seconds(3)) m_rateSamples.pop_front();
+    }
+
+    // Called before each frame: updates the operating point and returns
+    // false if the frame should be skipped to let the queue drain
+    bool beginFrame() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        RateCounters& c = m_counters;
+        Clock::time_point now = Clock::now();
+        if (!c.active) {
+            // bound the burst before the first ack; a client that never
+            // acks gets an uncontrolled stream after a few seconds
+            if (m_sent > 256 * 1024 && now - m_lastAck < std::chrono::seconds(5)) {
+                c.framesSkipped++;
+                return false;
+            }
+            return true;
+        }
+        if (m_sent > m_acked && now - m_lastAck > std::chrono::seconds(5)) {
+            // the client stopped acknowledging: run uncontrolled rather than stall
+            c.active = false;
+            c.level = 0;
+            return true;
+        }
+
+        c.minRttMs = 0;
+        for (const auto& s : m_rttSamples) if (c.minRttMs == 0 || s.second < c.minRttMs) c.minRttMs = s.second;
+        c.rttMs = m_srttMs;
+        c.bandwidthKbps = 0;
+        for (const auto& s : m_rateSamples) if (s.second > c.bandwidthKbps) c.bandwidthKbps = s.second;
+        c.inflightBytes = m_sent - m_acked;
+        // the newest sample reacts to a draining queue faster than the
+        // smoothed RTT; bytes still queued count as delay before their ack is late
+        double drainMs = c.bandwidthKbps > 0 ? c.inflightBytes * 8.0 / c.bandwidthKbps : 0;
+        c.queueMs = max(m_lastRttMs - c.minRttMs, drainMs - c.minRttMs);
+        if (c.queueMs < 0) c.queueMs = 0;
+
+        double sinceChange = std::chrono::duration<double, std::milli>(now - m_lastChange).count();
+        if (c.queueMs > m_targetMs && c.level < RATE_LEVEL_COUNT - 1 && sinceChange > max(200.0, c.rttMs)) {
+            c.level++;
+            c.levelDowns++;
+            m_lastChange = now;
+        } else if (c.queueMs < m_targetMs / 3.0 && c.level > 0 && sinceChange > 2000) {
+            c.level--;
+            c.levelUps++;
+            m_lastChange = now;
+        }
+
+        // allow what the link drains within one RTT plus the target, but
+        // never so little that a single frame cannot go out
+        double allowed = c.bandwidthKbps / 8.0 * (c.minRttMs + m_targetMs);
+        if (allowed < 64 * 1024) allowed = 64 * 1024;
+        if (c.inflightBytes > allowed) {
+            c.framesSkipped++;
+            return false;
+        }
+        return true;
+    }
+
+    // After beginFrame said no: sleeps until the next ack or timeoutMs
+    void waitForAck(int timeoutMs) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        uint64_t acked = m_acked;
+        m_ackCv.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&] { return m_acked != acked; });
+    }
+
+    RateLevel level() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return RATE_LEVELS[m_counters.level];
+    }
+    // Bytes the link drains in one frame interval while it is the
+    // bottleneck; 0 when the controller runs at full quality
+    size_t frameBudget(int intervalMs) const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_counters.active || m_counters.level == 0 || m_counters.bandwidthKbps <= 0) return 0;
+        return max((size_t)(m_counters.bandwidthKbps * intervalMs / 8), (size_t)32 * 1024);
+    }
+    // Queue nearly empty: room for background work such as tile upgrades
+    bool spareCapacity() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return !m_counters.active || (m_counters.level == 0 && m_counters.queueMs < m_targetMs / 4.0);
+    }
+    RateCounters counters() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_counters;
+    }
+
+private:
+    mutable std::mutex m_mutex;
+    std::condition_variable m_ackCv;
+    int m_targetMs = 150;
+    uint64_t m_sent = 0, m_acked = 0;
+    std::deque<std::pair<uint64_t, Clock::time_point>> m_marks;         // cumulative bytes at each onSent
+    std::deque<std::pair<Clock::time_point, double>> m_rttSamples;      // ms
+    std::deque<std::pair<Clock::time_point, double>> m_rateSamples;     // kbit/s
+    double m_srttMs = 0, m_lastRttMs = 0;
+    Clock::time_point m_rateStart, m_lastChange, m_lastAck;
+    uint64_t m_rateStartBytes = 0;
+    RateCounters m_counters;
+};
+
+// ---------- frame window ----------
+// The client acks at the end of every frame, so an ack also tells which
+// frames have arrived: those whose last byte it covers. At most the
+// window's count of frames go unacknowledged, with or without rate
+// control. A frame skipped for a full window costs nothing: the tile grid
+// still holds what was last sent, so changes made meanwhile go out
+// together in the next frame. The pipeline waits for an ack rather than a
+// frame interval, so the next frame starts one round trip after the
+// oldest was sent and the screen is never more than a window behind.
+class FrameWindow {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // frames: the window, 0 = no limit
+    void reset(int frames) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_frames = frames;
+        m_sent = m_acked = 0;
+        m_frameEnds.clear();
+        m_lastAck = Clock::now();
+        m_full = 0;
+    }
+
+    // Video bytes about to go to the socket; counted before sending, as
+    // the ack for them can come back before send() returns
+    void onSent(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_sent += bytes;
+    }
+    // The last onSent finished a frame
+    void onFrameEnd() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_sent > m_acked) m_frameEnds.push_back(m_sent);
+        // a client that stopped acking is not waited for; don't grow without bound
+        if (m_frameEnds.size() > 1024) m_frameEnds.pop_front();
+    }
+    // The client has processed totalBytes of video
+    void onAck(uint64_t totalBytes) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (totalBytes > m_sent || totalBytes < m_acked) return;
+        m_acked = totalBytes;
+        m_lastAck = Clock::now();
+        while (!m_frameEnds.empty() && m_frameEnds.front() <= totalBytes) m_frameEnds.pop_front();
+        m_ackCv.notify_all();
+    }
+
+    // Called before each frame: false while the window is full. A client
+    // that has not acked for a few seconds is not waited for.
+    bool beginFrame() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_frames == 0 || m_frameEnds.size() < (size_t)m_frames) return true;
+        if (Clock::now() - m_lastAck > std::chrono::seconds(5)) return true;
+        m_full++;
+        return false;
+    }
+    // After beginFrame said no: sleeps until the next ack or timeoutMs
+    void waitForAck(int timeoutMs) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        uint64_t acked = m_acked;
+        m_ackCv.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&] { return m_acked != acked; });
+    }
+
+    uint64_t framesInFlight() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_frameEnds.size();
+    }
+    uint64_t timesFull() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_full;
+    }
+
+private:
+    mutable std::mutex m_mutex;
+    std::condition_variable m_ackCv;
+    int m_frames = 0;
+    uint64_t m_sent = 0, m_acked = 0;
+    std::deque<uint64_t> m_frameEnds;      // cumulative bytes at the end of each unacked frame
+    Clock::time_point m_lastAck;
+    uint64_t m_full = 0;
+};
+
+// ---------- inter-frame video ----------
+// CPU-only inter-frame codec for regions where most tiles change every
+// frame (video playback, window drags). Frames are YUV 4:2:0 in 16x16
+// macroblocks. A macroblock is one of:
+// - skipped: copied from the previous frame
+// - inter: motion compensated from the previous frame, plus a residual
+// - intra: residual against flat grey
+// Residuals use the H.264 4x4 integer transform and quantizer, so the
+// encoder's reconstruction matches the decoder's bit for bit and
+// predictions never drift. Syntax is Exp-Golomb coded. Every macroblock
+// row predicts only from the previous frame, so rows are coded
+// independently, each into its own length-prefixed chunk. The encoder
+// runs them on the encode pool.
+//
+// Payload: flags (1 = keyframe), qp, uint16 macroblock columns, uint16
+// macroblock rows, then per row a varint byte count and the row's bits.
+
+const int VIDEO_MB = 16;
+const int VIDEO_MV_RANGE = 16;          // full-pel motion search range
+const int VIDEO_MIN_QP = 10, VIDEO_MAX_QP = 51;
+
+enum VideoMbMode { MB_SKIP = 0, MB_INTER = 1, MB_INTRA = 2 };
+
+// Quantizer for a JPEG-style quality, so the rate controller's levels
+// apply to video as well
+inline int VideoQpForQuality(int quality) {
+    return min(max((int)(22 + (90 - quality) * 0.28 + 0.5), VIDEO_MIN_QP), VIDEO_MAX_QP);
+}
+
+// I420 frame padded to whole macroblocks
+struct VideoFrame {
+    int w = 0, h = 0;
+    std::vector<BYTE> y, u, v;      // strides w and w / 2
+    void resize(int padW, int padH) {
+        w = padW; h = padH;
+        y.resize((size_t)w * h);
+        u.resize((size_t)w * h / 4);
+        v.resize((size_t)w * h / 4);
+    }
+};
+
+// BGRA -> I420 for luma rows [row0, row1) of a frame (even bounds)
+inline void BgraToI420(const PixelView& img, VideoFrame& f, int row0, int row1) {
+    YuvPlanes planes = { f.y.data(), f.u.data(), f.v.data(), f.w, f.w / 2 };
+    BgraToYuv420(img, planes, f.w, row0, row1);
+}
+
+// The visible w x h part of an I420 frame back to BGRA
+void I420ToBgra(const VideoFrame& f, int w, int h, BYTE* dst, int stride) {
+    for (int y=0; y<h; ++y) {
+        const BYTE* yr = f.y.data() + (size_t)y * f.w;
+        const BYTE* ur = f.u.data() + (size_t)(y / 2) * (f.w / 2);
+        const BYTE* vr = f.v.data() + (size_t)(y / 2) * (f.w / 2);
+        BYTE* out = dst + (size_t)y * stride;
+        for (int x=0; x<w; ++x) {
+            int lum = yr[x] << 16, cu = ur[x / 2] - 128, cv = vr[x / 2] - 128;
+            int r = (lum + 91881 * cv + 32768) >> 16;
+            int g = (lum - 22554 * cu - 46802 * cv + 32768) >> 16;
+            int b = (lum + 116130 * cu + 32768) >> 16;
+            out[x * 4 + 0] = (BYTE)min(max(b, 0), 255);
+            out[x * 4 + 1] = (BYTE)min(max(g, 0), 255);
+            out[x * 4 + 2] = (BYTE)min(max(r, 0), 255);
+            out[x * 4 + 3] = 0;
+        }
+    }
+}
+
+class VideoBitWriter {
+public:
+    explicit VideoBitWriter(std::vector<BYTE>& out) : m_out(out) {}
+    void put(uint32_t bits, int n) {
+        m_acc = (m_acc << n) | bits;
+        m_count += n;
+        while (m_count >= 8) {
+            m_count -= 8;
+            m_out.push_back((BYTE)(m_acc >> m_count));
+        }
+    }
+    // Exp-Golomb, unsigned and signed
+    void ue(uint32_t v) {
+        int len = 0;
+        while ((v + 1) >> (len + 1)) len++;
+        put(0, len);
+        put(v + 1, len + 1);
+    }
+    void se(int v) { ue(v > 0 ? 2 * v - 1 : -2 * v); }
+    void flush() { if (m_count > 0) put(0, 8 - m_count); }
+private:
+    std::vector<BYTE>& m_out;
+    uint64_t m_acc = 0;
+    int m_count = 0;
+};
+
+class VideoBitReader {
+public:
+    VideoBitReader(const BYTE* p, const BYTE* end) : m_p(p), m_end(end) {}
+    bool ok() const { return m_ok; }
+    uint32_t get(int n) {
+        while (m_count < n) {
+            if (m_p == m_end) { m_ok = false; return 0; }
+            m_acc = (m_acc << 8) | *m_p++;
+            m_count += 8;
+        }
+        m_count -= n;
+        return (uint32_t)(m_acc >> m_count) & ((1u << n) - 1);
+    }
+    uint32_t ue() {
+        int zeros = 0;
+        while (m_ok && get(1) == 0) {
+            if (++zeros > 20) { m_ok = false; return 0; }
+        }
+        return ((1u << zeros) - 1) + (zeros ? get(zeros) : 0);
+    }
+    int se() {
+        uint32_t v = ue();
+        return (v & 1) ? (int)((v + 1) / 2) : -(int)(v / 2);
+    }
+private:
+    const BYTE* m_p;
+    const BYTE* m_end;
+    uint64_t m_acc = 0;
+    int m_count = 0;
+    bool m_ok = true;
+};
+
+static const BYTE VIDEO_ZIGZAG4[16] = { 0, 1, 4, 8, 5, 2, 3, 6, 9, 12, 13, 10, 7, 11, 14, 15 };
+// H.264 quantizer multipliers and dequantizer scales per qp % 6, for
+// coefficient classes: both indices even, both odd, mixed
+static const int VIDEO_QUANT_MF[6][3] = {
+    { 13107, 5243, 8066 }, { 11916, 4660, 7490 }, { 10082, 4194, 6554 },
+    { 9362, 3647, 5825 }, { 8192, 3355, 5243 }, { 7282, 2893, 4559 } };
+static const int VIDEO_DEQUANT_V[6][3] = {
+    { 10, 16, 13 }, { 11, 18, 14 }, { 13, 20, 16 }, { 14, 23, 18 }, { 16, 25, 20 }, { 18, 29, 23 } };
+
+inline int VideoCoefClass(int i) {
+    int r = i >> 2, c = i & 3;
+    return (r & 1) == 0 && (c & 1) == 0 ? 0 : (r & 1) && (c & 1) ? 1 : 2;
+}
+
+// Forward core transform and quantization of a 4x4 residual into
+// zigzag-ordered levels; returns the number of nonzero levels
+int QuantizeBlock4x4(const int* res, int qp, bool intra, int* levels) {
+    int t[16], w[16];
+    for (int i=0; i<4; ++i) {
+        const int* r = res + i * 4;
+        int s0 = r[0] + r[3], s1 = r[1] + r[2], d0 = r[0] - r[3], d1 = r[1] - r[2];
+        t[i * 4 + 0] = s0 + s1;
+        t[i * 4 + 1] = 2 * d0 + d1;
+        t[i * 4 + 2] = s0 - s1;
+        t[i * 4 + 3] = d0 - 2 * d1;
+    }
+    for (int j=0; j<4; ++j) {
+        int s0 = t[j] + t[12 + j], s1 = t[4 + j] + t[8 + j], d0 = t[j] - t[12 + j], d1 = t[4 + j] - t[8 + j];
+        w[j] = s0 + s1;
+        w[4 + j] = 2 * d0 + d1;
+        w[8 + j] = s0 - s1;
+        w[12 + j] = d0 - 2 * d1;
+    }
+    int qbits = 15 + qp / 6, round = (1 << qbits) / (intra ? 3 : 6), nonzero = 0;
+    for (int k=0; k<16; ++k) {
+        int i = VIDEO_ZIGZAG4[k];
+        int level = (abs(w[i]) * VIDEO_QUANT_MF[qp % 6][VideoCoefClass(i)] + round) >> qbits;
+        levels[k] = w[i] < 0 ? -level : level;
+        if (level) nonzero++;
+    }
+    return nonzero;
+}
+
+// Dequantizes zigzag levels, inverse transforms and adds the residual
+// to the prediction in place (stride-spaced 4x4 block)
+void ReconstructBlock4x4(const int* levels, int qp, BYTE* pred, int stride) {
+    int w[16], t[16];
+    for (int k=0; k<16; ++k) {
+        int i = VIDEO_ZIGZAG4[k];
+        w[i] = levels[k] * VIDEO_DEQUANT_V[qp % 6][VideoCoefClass(i)] * (1 << (qp / 6));
+    }
+    for (int i=0; i<4; ++i) {
+        const int* r = w + i * 4;
+        int e0 = r[0] + r[2], e1 = r[0] - r[2], e2 = (r[1] >> 1) - r[3], e3 = r[1] + (r[3] >> 1);
+        t[i * 4 + 0] = e0 + e3;
+        t[i * 4 + 1] = e1 + e2;
+        t[i * 4 + 2] = e1 - e2;
+        t[i * 4 + 3] = e0 - e3;
+    }
+    for (int j=0; j<4; ++j) {
+        int e0 = t[j] + t[8 + j], e1 = t[j] - t[8 + j], e2 = (t[4 + j] >> 1) - t[12 + j], e3 = t[4 + j] + (t[12 + j] >> 1);
+        int col[4] = { e0 + e3, e1 + e2, e1 - e2, e0 - e3 };
+        for (int i=0; i<4; ++i) {
+            BYTE& p = pred[i * stride + j];
+            p = (BYTE)min(max(p + ((col[i] + 32) >> 6), 0), 255);
+        }
+    }
+}
+
+struct VideoMv { int x, y; };
+
+// Macroblock coding shared by encoder and decoder. Levels hold 16 luma
+// blocks (8x8 quadrants in raster order, 4x4 blocks raster within each),
+// then 4 U and 4 V blocks; cbp bit g flags quadrant g (4 = U, 5 = V).
+struct VideoMb {
+    int mode;
+    VideoMv mv;
+    int cbp;
+    int levels[24][16];
+};
+
+inline void VideoBlockOrigin(int b, int& bx, int& by, int& plane) {
+    if (b < 16) {
+        int q = b / 4, i = b % 4;
+        bx = (q % 2) * 8 + (i % 2) * 4;
+        by = (q / 2) * 8 + (i / 2) * 4;
+        plane = 0;
+    } else {
+        int k = (b - 16) % 4;
+        bx = (k % 2) * 4;
+        by = (k / 2) * 4;
+        plane = b < 20 ? 1 : 2;
+    }
+}
+
+// Writes the prediction of the macroblock at (mbx, mby) straight into out
+void PredictMb(const VideoFrame& ref, VideoFrame& out, int mbx, int mby, int mode, VideoMv mv) {
+    int cx = mbx / 2, cy = mby / 2, cw = out.w / 2;
+    if (mode == MB_INTRA) {
+        for (int y=0; y<16; ++y) memset(&out.y[(size_t)(mby + y) * out.w + mbx], 128, 16);
+        for (int y=0; y<8; ++y) {
+            memset(&out.u[(size_t)(cy + y) * cw + cx], 128, 8);
+            memset(&out.v[(size_t)(cy + y) * cw + cx], 128, 8);
+        }
+        return;
+    }
+    // chroma follows at half the luma vector, rounded down
+    int cmx = mv.x >> 1, cmy = mv.y >> 1;
+    for (int y=0; y<16; ++y) memcpy(&out.y[(size_t)(mby + y) * out.w + mbx], &ref.y[(size_t)(mby + mv.y + y) * ref.w + mbx + mv.x], 16);
+    for (int y=0; y<8; ++y) {
+        memcpy(&out.u[(size_t)(cy + y) * cw + cx], &ref.u[(size_t)(cy + cmy + y) * cw + cx + cmx], 8);
+        memcpy(&out.v[(size_t)(cy + y) * cw + cx], &ref.v[(size_t)(cy + cmy + y) * cw + cx + cmx], 8);
+    }
+}
+
+// Adds the coded residual blocks onto the prediction already in out
+void ReconstructMb(const VideoMb& mb, int qp, VideoFrame& out, int mbx, int mby) {
+    for (int b=0; b<24; ++b) {
+        int group = b < 16 ? b / 4 : (b < 20 ? 4 : 5);
+        if (!(mb.cbp & (1 << group))) continue;
+        int bx, by, plane;
+        VideoBlockOrigin(b, bx, by, plane);
+        if (plane == 0) {
+            ReconstructBlock4x4(mb.levels[b], qp, &out.y[(size_t)(mby + by) * out.w + mbx + bx], out.w);
+        } else {
+            std::vector<BYTE>& p = plane == 1 ? out.u : out.v;
+            ReconstructBlock4x4(mb.levels[b], qp, &p[(size_t)(mby / 2 + by) * (out.w / 2) + mbx / 2 + bx], out.w / 2);
+        }
+    }
+}
+
+inline bool VideoMvValid(const VideoFrame& f, int mbx, int mby, VideoMv mv) {
+    return abs(mv.x) <= VIDEO_MV_RANGE && abs(mv.y) <= VIDEO_MV_RANGE &&
+           mbx + mv.x >= 0 && mby + mv.y >= 0 && mbx + mv.x + 16 <= f.w && mby + mv.y + 16 <= f.h;
+}
 
-// Encode an HBITMAP (region) to JPEG bytes via GDI+
-bool EncodeHBITMAPToJPEGBytes(HBITMAP hBmp, RECT srcRect, std::vector<BYTE>& out, ULONG quality=80) {
-    if (!hBmp) return false;
-    bool ok = false;
-    Bitmap bmp(hBmp, NULL);
-    if (bmp.GetLastStatus() != Ok) return false;
+class VideoEncoder {
+public:
+    // Encodes img as the next frame and appends the payload to out. A
+    // keyframe is sent when asked for, first, and whenever the size changes.
+    void encode(const PixelView& img, int qp, bool keyframe, WorkStealingPool& pool, std::vector<BYTE>& out) {
+        int padW = (img.w + 15) & ~15, padH = (img.h + 15) & ~15;
+        if (padW != m_src.w || padH != m_src.h || !m_haveRef) {
+            keyframe = true;
+            m_src.resize(padW, padH);
+            m_ref.resize(padW, padH);
+            m_recon.resize(padW, padH);
+            m_mvs.assign((size_t)(padW / 16) * (padH / 16), VideoMv{ 0, 0 });
+        }
+        int mbCols = padW / 16, mbRows = padH / 16;
+        qp = min(max(qp, VIDEO_MIN_QP), VIDEO_MAX_QP);
+        m_rows.resize(mbRows);
+
+        pool.parallelFor(mbRows, [&](size_t row, int) {
+            BgraToI420(img, m_src, (int)row * 16, (int)row * 16 + 16);
+            m_rows[row].clear();
+            encodeRow((int)row, mbCols, qp, keyframe, m_rows[row]);
+        });
+
+        out.push_back(keyframe ? 1 : 0);
+        out.push_back((BYTE)qp);
+        out.resize(out.size() + 4);
+        PutLE16(out.data() + out.size() - 4, (uint16_t)mbCols);
+        PutLE16(out.data() + out.size() - 2, (uint16_t)mbRows);
+        for (const std::vector<BYTE>& bits : m_rows) {
+            PutVarint(out, (uint32_t)bits.size());
+            out.insert(out.end(), bits.begin(), bits.end());
+        }
+        std::swap(m_ref, m_recon);
+        m_haveRef = true;
+        lastKeyframe = keyframe;
+    }
 
-    // Crop by drawing region into new Bitmap
-    int w = srcRect.right - srcRect.left;
-    int h = srcRect.bottom - srcRect.top;
-    if (w <= 0 || h <= 0) return false;
+    void reset() { m_haveRef = false; }
 
-    Bitmap region(w, h, PixelFormat32bppARGB);
-    if (region.GetLastStatus() != Ok) return false;
+    // Macroblock modes of the last frame, for stats
+    bool lastKeyframe = false;
+    std::atomic<uint32_t> skipMbs{0}, interMbs{0}, intraMbs{0};
 
-    {
-        Graphics g(&region);
-        if (g.GetLastStatus() != Ok) return false;
-        g.DrawImage(&bmp, Rect(0,0,w,h), srcRect.left, srcRect.top, w, h, UnitPixel);
-        if (g.GetLastStatus() != Ok) return false;
+private:
+    VideoFrame m_src, m_ref, m_recon;
+    bool m_haveRef = false;
+    std::vector<VideoMv> m_mvs;             // per macroblock, from the last frame
+    std::vector<std::vector<BYTE>> m_rows;  // coded macroblock rows
+
+    int sad16(int mbx, int mby, VideoMv mv, int limit) const {
+        int sum = 0;
+        for (int y=0; y<16 && sum < limit; ++y) {
+            const BYTE* a = &m_src.y[(size_t)(mby + y) * m_src.w + mbx];
+            const BYTE* b = &m_ref.y[(size_t)(mby + mv.y + y) * m_ref.w + mbx + mv.x];
+            for (int x=0; x<16; ++x) sum += abs(a[x] - b[x]);
+        }
+        return sum;
     }
 
-    // find JPEG encoder
-    UINT nEnc = 0, sizeEnc = 0;
-    GetImageEncodersSize(&nEnc, &sizeEnc);
-    if (sizeEnc == 0 || nEnc == 0) return false;
-    ImageCodecInfo* pInfo = (ImageCodecInfo*)malloc(sizeEnc);
-    if (!pInfo) return false;
-    GetImageEncoders(nEnc, sizeEnc, pInfo);
-    CLSID clsidJpeg = {0};
-    for (UINT i=0;i<nEnc;++i) {
-        if (wcscmp(pInfo[i].MimeType, L"image/jpeg") == 0) { clsidJpeg = pInfo[i].Clsid; break;}
+    // Best full-pel vector from a few predictors refined by a shrinking
+    // diamond search
+    VideoMv searchMotion(int mbx, int mby, VideoMv left, VideoMv last, int& bestSad) const {
+        VideoMv best = { 0, 0 };
+        bestSad = sad16(mbx, mby, best, 0x7fffffff);
+        VideoMv cands[2] = { left, last };
+        for (VideoMv c : cands) {
+            if (!VideoMvValid(m_ref, mbx, mby, c)) continue;
+            int s = sad16(mbx, mby, c, bestSad);
+            if (s < bestSad) { bestSad = s; best = c; }
+        }
+        if (bestSad == 0) return best;
+        for (int step=4; step>=1; step/=2) {
+            bool moved = true;
+            while (moved) {
+                moved = false;
+                VideoMv around[4] = { { best.x + step, best.y }, { best.x - step, best.y }, { best.x, best.y + step }, { best.x, best.y - step } };
+                for (VideoMv c : around) {
+                    if (!VideoMvValid(m_ref, mbx, mby, c)) continue;
+                    int s = sad16(mbx, mby, c, bestSad);
+                    if (s < bestSad) { bestSad = s; best = c; moved = true; }
+                }
+            }
+        }
+        return best;
     }
-    free(pInfo);
-    if (clsidJpeg.Data1 == 0 && clsidJpeg.Data2 == 0) return false;
-
-    IStream* ist = nullptr;
-    if (CreateStreamOnHGlobal(NULL, TRUE, &ist) != S_OK) return false;
 
-    EncoderParameters ep;
-    ep.Count = 1;
-    EncoderParameter e;
-    e.Guid = EncoderQuality;
-    e.NumberOfValues = 1;
-    e.Type = EncoderParameterValueTypeLong;
-    e.Value = &quality;
-    ep.Parameter[0] = e;
+    void encodeRow(int row, int mbCols, int qp, bool keyframe, std::vector<BYTE>& bits) {
+        VideoBitWriter bw(bits);
+        VideoMv left = { 0, 0 };
+        VideoMb mb;
+        int res[16];
+        int mby = row * 16;
+        for (int col=0; col<mbCols; ++col) {
+            int mbx = col * 16;
+            VideoMv& lastMv = m_mvs[(size_t)row * mbCols + col];
+            mb.mode = MB_INTRA;
+            mb.mv = VideoMv{ 0, 0 };
+            if (!keyframe) {
+                int sad;
+                mb.mv = searchMotion(mbx, mby, left, lastMv, sad);
+                mb.mode = MB_INTER;
+                // flat-grey prediction only when the last frame has nothing
+                // close; a SAD check alone would pick it for smooth areas
+                // whose inter residual is just quantization noise
+                int mean = 0, variation = 0;
+                for (int y=0; y<16; ++y) for (int x=0; x<16; ++x) mean += m_src.y[(size_t)(mby + y) * m_src.w + mbx + x];
+                mean = (mean + 128) >> 8;
+                for (int y=0; y<16; ++y) for (int x=0; x<16; ++x) variation += abs(m_src.y[(size_t)(mby + y) * m_src.w + mbx + x] - mean);
+                if (variation < sad) {
+                    const BYTE* ref = &m_ref.y[(size_t)(mby + mb.mv.y) * m_ref.w + mbx + mb.mv.x];
+                    if (lumaBits(mbx, mby, nullptr, 0, qp, true) < lumaBits(mbx, mby, ref, m_ref.w, qp, false)) mb.mode = MB_INTRA;
+                }
+                if (mb.mode == MB_INTRA) mb.mv = VideoMv{ 0, 0 };
+            }
+            PredictMb(m_ref, m_recon, mbx, mby, mb.mode, mb.mv);
+
+            mb.cbp = 0;
+            for (int b=0; b<24; ++b) {
+                int bx, by, plane;
+                VideoBlockOrigin(b, bx, by, plane);
+                const BYTE* src;
+                const BYTE* pred;
+                int stride;
+                if (plane == 0) {
+                    stride = m_src.w;
+                    src = &m_src.y[(size_t)(mby + by) * stride + mbx + bx];
+                    pred = &m_recon.y[(size_t)(mby + by) * stride + mbx + bx];
+                } else {
+                    stride = m_src.w / 2;
+                    size_t off = (size_t)(mby / 2 + by) * stride + mbx / 2 + bx;
+                    src = (plane == 1 ? m_src.u : m_src.v).data() + off;
+                    pred = (plane == 1 ? m_recon.u : m_recon.v).data() + off;
+                }
+                for (int y=0; y<4; ++y) for (int x=0; x<4; ++x) res[y * 4 + x] = src[y * stride + x] - pred[y * stride + x];
+                if (QuantizeBlock4x4(res, qp, mb.mode == MB_INTRA, mb.levels[b])) mb.cbp |= 1 << (b < 16 ? b / 4 : (b < 20 ? 4 : 5));
+            }
+            if (mb.mode == MB_INTER && mb.mv.x == 0 && mb.mv.y == 0 && mb.cbp == 0) mb.mode = MB_SKIP;
 
-    if (region.Save(ist, &clsidJpeg, &ep) == Ok) {
-        HGLOBAL hg = NULL;
-        if (GetHGlobalFromStream(ist, &hg) == S_OK && hg) {
-            SIZE_T sz = GlobalSize(hg);
-            if (sz > 0) {
-                void* p = GlobalLock(hg);
-                if (p) {
-                    out.assign((BYTE*)p, (BYTE*)p + sz);
-                    GlobalUnlock(hg);
-                    ok = true;
+            bw.ue(mb.mode);
+            if (mb.mode == MB_INTER) {
+                bw.se(mb.mv.x - left.x);
+                bw.se(mb.mv.y - left.y);
+            }
+            if (mb.mode != MB_SKIP) {
+                bw.put(mb.cbp, 6);
+                for (int b=0; b<24; ++b) {
+                    if (mb.cbp & (1 << (b < 16 ? b / 4 : (b < 20 ? 4 : 5)))) writeBlock(bw, mb.levels[b]);
                 }
+                ReconstructMb(mb, qp, m_recon, mbx, mby);
             }
+            left = mb.mode == MB_INTER ? mb.mv : VideoMv{ 0, 0 };
+            lastMv = mb.mv;
+            (mb.mode == MB_SKIP ? skipMbs : mb.mode == MB_INTER ? interMbs : intraMbs)++;
         }
+        bw.flush();
     }
-    if (ist) ist->Release();
-    return ok;
-}
-
-// Decode JPEG bytes to HBITMAP
-HBITMAP DecodeJPEGBytesToHBITMAP(const BYTE* data, size_t len) {
-    if (!data || len == 0) return NULL;
-    HBITMAP hBmp = NULL;
-    HGLOBAL hGlobal = GlobalAlloc(GMEM_MOVEABLE, len);
-    if (!hGlobal) return NULL;
-    void* mem = GlobalLock(hGlobal);
-    if (!mem) { GlobalFree(hGlobal); return NULL; }
-    memcpy(mem, data, len);
-    GlobalUnlock(hGlobal);
-    IStream* ist = nullptr;
-    if (CreateStreamOnHGlobal(hGlobal, TRUE, &ist) != S_OK) { GlobalFree(hGlobal); return NULL; }
-    Bitmap* b = Bitmap::FromStream(ist, FALSE);
-    if (ist) ist->Release();
-    if (!b || b->GetLastStatus() != Ok) { delete b; GlobalFree(hGlobal); return NULL; }
-    b->GetHBITMAP(Color(0,0,0), &hBmp);
-    delete b;
-    GlobalFree(hGlobal);
-    return hBmp;
-}
-
-// Window selection dialog
-HWND g_selectedWindow = NULL;
-BOOL CALLBACK EnumWindowsProc(HWND hwnd, LPARAM lParam) {
-    if (!IsWindowVisible(hwnd)) return TRUE;
-
-    char title[256];
-    GetWindowTextA(hwnd, title, sizeof(title));
-    if (strlen(title) == 0) return TRUE;
 
-    std::vector<std::string>* windows = (std::vector<std::string>*)lParam;
-    std::stringstream ss;
-    ss << (void*)hwnd << "|" << title;
-    windows->push_back(ss.str());
-    return TRUE;
-}
-
-HWND SelectWindowToCapture() {
-    std::vector<std::string> windows;
-    EnumWindows(EnumWindowsProc, (LPARAM)&windows);
-
-    std::cout << "\nSelect what to capture:\n";
-    std::cout << "0. Full Screen (default)\n";
-    for (size_t i = 0; i < windows.size() && i < 20; ++i) {
-        size_t pos = windows[i].find('|');
-        std::string title = windows[i].substr(pos + 1);
-        std::cout << (i + 1) << ". " << title << "\n";
+    // Approximate bits for the luma residual against pred (flat grey if null)
+    int lumaBits(int mbx, int mby, const BYTE* pred, int predStride, int qp, bool intra) const {
+        int res[16], levels[16], bits = 0;
+        for (int b=0; b<16; ++b) {
+            int bx, by, plane;
+            VideoBlockOrigin(b, bx, by, plane);
+            const BYTE* src = &m_src.y[(size_t)(mby + by) * m_src.w + mbx + bx];
+            for (int y=0; y<4; ++y) for (int x=0; x<4; ++x) {
+                res[y * 4 + x] = src[y * m_src.w + x] - (pred ? pred[(by + y) * predStride + bx + x] : 128);
+            }
+            if (!QuantizeBlock4x4(res, qp, intra, levels)) continue;
+            bits += 4;
+            for (int k=0; k<16; ++k) {
+                int level = abs(levels[k]);
+                if (!level) continue;
+                int len = 0;
+                while (level >> len) len++;
+                bits += 2 * len + 2;
+            }
+        }
+        return bits;
     }
 
-    std::cout << "\nEnter choice (0-" << min(windows.size(), (size_t)20) << "): ";
-    std::string input;
-    std::getline(std::cin, input);
+    static void writeBlock(VideoBitWriter& bw, const int* levels) {
+        int nonzero = 0;
+        for (int k=0; k<16; ++k) if (levels[k]) nonzero++;
+        bw.ue(nonzero);
+        int run = 0;
+        for (int k=0; k<16 && nonzero > 0; ++k) {
+            if (!levels[k]) { run++; continue; }
+            bw.ue(run);
+            bw.ue(abs(levels[k]) - 1);
+            bw.put(levels[k] < 0 ? 1 : 0, 1);
+            run = 0;
+            nonzero--;
+        }
+    }
+};
 
-    int choice = 0;
-    if (!input.empty()) choice = atoi(input.c_str());
+class VideoDecoder {
+public:
+    // Decodes one payload for a w x h rectangle into BGRA; inter frames
+    // need the preceding frames of the same size
+    bool decode(const BYTE* data, size_t len, int w, int h, BYTE* dst, int stride) {
+        if (len < 6 || w <= 0 || h <= 0) return false;
+        bool keyframe = data[0] == 1;
+        int qp = data[1];
+        uint16_t cols16 = GetLE16(data + 2), rows16 = GetLE16(data + 4);
+        int padW = (w + 15) & ~15, padH = (h + 15) & ~15;
+        if (qp < VIDEO_MIN_QP || qp > VIDEO_MAX_QP || cols16 * 16 != padW || rows16 * 16 != padH) return false;
+        if (keyframe) {
+            m_ref.resize(padW, padH);
+            m_recon.resize(padW, padH);
+            m_valid = true;
+        } else if (!m_valid || m_ref.w != padW || m_ref.h != padH) {
+            return false;
+        }
 
-    if (choice == 0 || choice > (int)windows.size()) {
-        std::cout << "Capturing full screen\n";
-        return NULL;
+        const BYTE* p = data + 6;
+        const BYTE* end = data + len;
+        for (int row=0; row<rows16; ++row) {
+            uint32_t size;
+            if (!GetVarint(p, end, size) || size > (size_t)(end - p) || !decodeRow(p, p + size, row, cols16, qp, keyframe)) {
+                m_valid = false;
+                return false;
+            }
+            p += size;
+        }
+        std::swap(m_ref, m_recon);
+        I420ToBgra(m_ref, w, h, dst, stride);
+        return true;
     }
 
-    size_t pos = windows[choice - 1].find('|');
-    std::string hwndStr = windows[choice - 1].substr(0, pos);
-    HWND hwnd = (HWND)strtoull(hwndStr.c_str(), NULL, 16);
+private:
+    VideoFrame m_ref, m_recon;
+    bool m_valid = false;
+
+    bool decodeRow(const BYTE* p, const BYTE* end, int row, int mbCols, int qp, bool keyframe) {
+        VideoBitReader br(p, end);
+        VideoMv left = { 0, 0 };
+        VideoMb mb;
+        int mby = row * 16;
+        for (int col=0; col<mbCols; ++col) {
+            int mbx = col * 16;
+            mb.mode = (int)br.ue();
+            mb.mv = VideoMv{ 0, 0 };
+            if (mb.mode > MB_INTRA || (keyframe && mb.mode != MB_INTRA)) return false;
+            if (mb.mode == MB_INTER) {
+                mb.mv.x = left.x + br.se();
+                mb.mv.y = left.y + br.se();
+                if (!VideoMvValid(m_ref, mbx, mby, mb.mv)) return false;
+            }
+            PredictMb(m_ref, m_recon, mbx, mby, mb.mode, mb.mv);
+            if (mb.mode != MB_SKIP) {
+                mb.cbp = (int)br.get(6);
+                for (int b=0; b<24; ++b) {
+                    if (!(mb.cbp & (1 << (b < 16 ? b / 4 : (b < 20 ? 4 : 5))))) continue;
+                    if (!readBlock(br, mb.levels[b])) return false;
+                }
+                ReconstructMb(mb, qp, m_recon, mbx, mby);
+            }
+            if (!br.ok()) return false;
+            left = mb.mode == MB_INTER ? mb.mv : VideoMv{ 0, 0 };
+        }
+        return true;
+    }
 
-    std::cout << "Capturing window: " << windows[choice - 1].substr(pos + 1) << "\n";
-    return hwnd;
-}
+    static bool readBlock(VideoBitReader& br, int* levels) {
+        memset(levels, 0, 16 * sizeof(int));
+        uint32_t nonzero = br.ue();
+        if (nonzero > 16) return false;
+        int pos = 0;
+        for (uint32_t i=0; i<nonzero; ++i) {
+            pos += (int)br.ue();
+            uint32_t level = br.ue() + 1;
+            if (pos > 15 || level > 4096 || !br.ok()) return false;
+            levels[pos++] = br.get(1) ? -(int)level : (int)level;
+        }
+        return br.ok();
+    }
+};
 
 // ---------- Audio Capture ----------
+#ifdef _WIN32
 class AudioCapture {
 public:
     AudioCapture() : m_enumerator(nullptr), m_device(nullptr), m_client(nullptr), m_capture(nullptr), m_running(false) {}
@@ -205,7 +4595,7 @@ private:
     IAudioCaptureClient* m_capture;
     std::atomic<bool> m_running;
     std::thread m_thread;
-    SOCKET m_audioSocket;
+    MuxConnection* m_conn = nullptr;
 
     void captureLoop() {
         WAVEFORMATEX* pwfx = nullptr;
@@ -246,11 +4636,8 @@ private:
 
                 if (!(flags & AUDCLNT_BUFFERFLAGS_SILENT) && numFramesAvailable > 0) {
                     uint32_t size = numFramesAvailable * bytesPerFrame;
-                    if (sendAll(m_audioSocket, (char*)&size, 4) == SOCKET_ERROR) {
-                        m_capture->ReleaseBuffer(numFramesAvailable);
-                        break;
-                    }
-                    if (sendAll(m_audioSocket, (char*)pData, size) == SOCKET_ERROR) {
+                    WireSpan packet[2] = { { (const BYTE*)&size, 4 }, { pData, size } };
+                    if (!m_conn->send(MUX_AUDIO, packet, 2)) {
                         m_capture->ReleaseBuffer(numFramesAvailable);
                         break;
                     }
@@ -273,8 +4660,8 @@ private:
 
 public:
 
-    bool start(SOCKET audioSocket) {
-        m_audioSocket = audioSocket;
+    bool start(MuxConnection* conn) {
+        m_conn = conn;
         HRESULT hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), NULL, CLSCTX_ALL,
             __uuidof(IMMDeviceEnumerator), (void**)&m_enumerator);
         if (FAILED(hr)) return false;
@@ -315,39 +4702,193 @@ public:
         if (m_enumerator) { m_enumerator->Release(); m_enumerator = nullptr; }
     }
 };
+#else
+// WASAPI loopback only: elsewhere the server streams video alone
+class AudioCapture {
+public:
+    bool start(MuxConnection*) { return false; }
+    void stop() {}
+};
+#endif
 
 // ---------- server (stream + control) ----------
+struct ServerOptions {
+    std::string source = "gdi";     // see CreateFrameSource
+    std::string diff = "hash";      // hash | compare (previous-frame memcmp)
+    int refine = 32;                // sub-block size for dirty rect refinement, 0 = whole tiles
+    bool motion = true;             // scroll/move detection with copy records
+    bool mergeRects = true;         // join adjacent encode rects into larger records
+    int tileCache = 256;            // client tile cache slots, 0 = off
+    int encodeCache = 8;            // MB of encoded rects kept for reuse, 0 = off
+    int encodeThreads = 0;          // tile encode threads, 0 = one per core
+    int draftQuality = 40;          // JPEG quality of the first pass, 0 = send final quality at once
+    int upgradeTiles = 4;           // static draft tiles re-sent at final quality per frame
+    bool rateControl = true;        // adapt quality, frame rate and resolution to client acks
+    int latencyTarget = 150;        // ms of queueing delay the rate controller aims to stay under
+    int frameBudget = 0;            // KB per frame, 0 = set by the rate controller when the link is the limit
+    int frameWindow = 2;            // frames sent but not yet acknowledged, 0 = no limit; applies with or without rate control
+    std::string video = "off";      // inter-frame video: off | auto (high-motion regions) | full (whole capture)
+    std::string framing = "stream"; // stream (records sent as they are encoded) | batch (counted frame after all encodes)
+    std::string transport = "tcp";  // video channel: tcp (on the connection) | udp (datagrams with FEC and resends)
+};
+
+// Parses a "--name=value" server option; returns false if unknown
+bool ParseServerOption(const std::string& arg, ServerOptions& opt) {
+    size_t eq = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) return false;
+    std::string name = arg.substr(2, eq - 2), value = arg.substr(eq + 1);
+    if (name == "source") { opt.source = value; return true; }
+    if (name == "diff" && (value == "hash" || value == "compare")) { opt.diff = value; return true; }
+    if (name == "motion" && (value == "on" || value == "off")) { opt.motion = value == "on"; return true; }
+    if (name == "merge" && (value == "on" || value == "off")) { opt.mergeRects = value == "on"; return true; }
+    if (name == "tile-cache") {
+        int slots = atoi(value.c_str());
+        if (slots >= 0 && slots <= (int)MAX_CACHE_SLOTS && (slots > 0 || value == "0")) { opt.tileCache = slots; return true; }
+    }
+    if (name == "encode-cache") {
+        int mb = atoi(value.c_str());
+        if (mb >= 0 && mb <= 1024 && (mb > 0 || value == "0")) { opt.encodeCache = mb; return true; }
+    }
+    if (name == "refine") {
+        if (value == "off") { opt.refine = 0; return true; }
+        int block = atoi(value.c_str());
+        if (block == 32 || block == 64) { opt.refine = block; return true; }
+    }
+    if (name == "draft-quality") {
+        int q = atoi(value.c_str());
+        if (q >= 0 && q < FINAL_JPEG_QUALITY && (q > 0 || value == "0")) { opt.draftQuality = q; return true; }
+    }
+    if (name == "upgrade-tiles") {
+        int n = atoi(value.c_str());
+        if (n >= 0 && n <= 1024 && (n > 0 || value == "0")) { opt.upgradeTiles = n; return true; }
+    }
+    if (name == "video" && (value == "off" || value == "auto" || value == "full")) { opt.video = value; return true; }
+    if (name == "framing" && (value == "stream" || value == "batch")) { opt.framing = value; return true; }
+    if (name == "transport" && (value == "tcp" || value == "udp")) { opt.transport = value; return true; }
+    if (name == "rate-control" && (value == "on" || value == "off")) { opt.rateControl = value == "on"; return true; }
+    if (name == "latency-target") {
+        int ms = atoi(value.c_str());
+        if (ms >= 10 && ms <= 5000) { opt.latencyTarget = ms; return true; }
+    }
+    if (name == "frame-budget") {
+        int kb = atoi(value.c_str());
+        if (kb >= 0 && kb <= 1000000 && (kb > 0 || value == "0")) { opt.frameBudget = kb; return true; }
+    }
+    if (name == "frame-window") {
+        int n = atoi(value.c_str());
+        if (n >= 0 && n <= 64 && (n > 0 || value == "0")) { opt.frameWindow = n; return true; }
+    }
+    if (name == "encode-threads") {
+        int n = atoi(value.c_str());
+        if (n >= 0 && n <= 256 && (n > 0 || value == "0")) { opt.encodeThreads = n; return true; }
+    }
+    return false;
+}
+
+// Counters for one pipeline run
+struct PipelineStats {
+    uint64_t frames = 0, framesSent = 0, tilesSent = 0, copiesSent = 0, bytesSent = 0;
+    uint64_t cacheHits = 0, cacheMisses = 0;
+    uint64_t encodeCacheHits = 0, encodeCacheMisses = 0;
+    uint64_t fillsSent = 0, palettesSent = 0, losslessSent = 0, draftsSent = 0, upgradesSent = 0;
+    uint64_t sendCalls = 0, sendBuffers = 0;   // video channel WSASend calls and the buffers they gathered
+    uint64_t rectsMerged = 0;       // encode rects joined into another record
+    uint64_t framesBudgeted = 0, framesOverBudget = 0, budgetLoweredTiles = 0, maxFrameBytes = 0;
+    uint64_t videoFrames = 0, videoKeyframes = 0, videoBytes = 0;
+    double captureMs = 0, diffMs = 0, encodeMs = 0, sendMs = 0;
+    double firstRecordMs = 0, frameSentMs = 0;     // from capture start, summed over frames sent
+    uint64_t udpLost = 0, udpRefreshTiles = 0;      // messages the client gave up on, tiles resent for them
+    uint64_t framesInFlight = 0, windowFull = 0;    // unacked frames, frames skipped for a full window
+    UdpCounters udp;
+    RateCounters rate;
+};
+
+// "name value" lines for the /stats page
+std::string FormatStatsCounters(const PipelineStats& st) {
+    std::ostringstream os;
+    os << "frames " << st.frames << "\n";
+    os << "frames_sent " << st.framesSent << "\n";
+    os << "tiles_sent " << st.tilesSent << "\n";
+    os << "copies_sent " << st.copiesSent << "\n";
+    os << "bytes_sent " << st.bytesSent << "\n";
+    os << "send_calls " << st.sendCalls << "\n";
+    os << "send_buffers " << st.sendBuffers << "\n";
+    os << "fills_sent " << st.fillsSent << "\n";
+    os << "palettes_sent " << st.palettesSent << "\n";
+    os << "lossless_sent " << st.losslessSent << "\n";
+    os << "drafts_sent " << st.draftsSent << "\n";
+    os << "rects_merged " << st.rectsMerged << "\n";
+    os << "upgrades_sent " << st.upgradesSent << "\n";
+    os << "frames_budgeted " << st.framesBudgeted << "\n";
+    os << "frames_over_budget " << st.framesOverBudget << "\n";
+    os << "budget_lowered_tiles " << st.budgetLoweredTiles << "\n";
+    os << "max_frame_bytes " << st.maxFrameBytes << "\n";
+    os << "video_frames " << st.videoFrames << "\n";
+    os << "video_keyframes " << st.videoKeyframes << "\n";
+    os << "video_bytes " << st.videoBytes << "\n";
+    os << "tile_cache_hits " << st.cacheHits << "\n";
+    os << "tile_cache_misses " << st.cacheMisses << "\n";
+    uint64_t lookups = st.cacheHits + st.cacheMisses;
+    os << "tile_cache_hit_rate " << (lookups ? (double)st.cacheHits / lookups : 0.0) << "\n";
+    os << "encode_cache_hits " << st.encodeCacheHits << "\n";
+    os << "encode_cache_misses " << st.encodeCacheMisses << "\n";
+    uint64_t encodeLookups = st.encodeCacheHits + st.encodeCacheMisses;
+    os << "encode_cache_hit_rate " << (encodeLookups ? (double)st.encodeCacheHits / encodeLookups : 0.0) << "\n";
+    os << "capture_ms " << st.captureMs << "\n";
+    os << "diff_ms " << st.diffMs << "\n";
+    os << "encode_ms " << st.encodeMs << "\n";
+    os << "send_ms " << st.sendMs << "\n";
+    os << "first_record_ms " << st.firstRecordMs << "\n";
+    os << "frame_sent_ms " << st.frameSentMs << "\n";
+    os << "udp_datagrams " << st.udp.datagrams << "\n";
+    os << "udp_parity " << st.udp.parity << "\n";
+    os << "udp_resent " << st.udp.resent << "\n";
+    os << "udp_probes " << st.udp.probes << "\n";
+    os << "udp_lost_messages " << st.udpLost << "\n";
+    os << "udp_refresh_tiles " << st.udpRefreshTiles << "\n";
+    os << "frames_in_flight " << st.framesInFlight << "\n";
+    os << "frame_window_full " << st.windowFull << "\n";
+    const RateCounters& rc = st.rate;
+    const RateLevel& level = RATE_LEVELS[rc.level];
+    os << "rate_control_active " << (rc.active ? 1 : 0) << "\n";
+    os << "rate_level " << rc.level << "\n";
+    os << "rate_quality " << level.quality << "\n";
+    os << "rate_interval_ms " << level.intervalMs << "\n";
+    os << "rate_scale " << level.scale << "\n";
+    os << "rate_bandwidth_kbps " << rc.bandwidthKbps << "\n";
+    os << "rate_rtt_ms " << rc.rttMs << "\n";
+    os << "rate_min_rtt_ms " << rc.minRttMs << "\n";
+    os << "rate_queue_ms " << rc.queueMs << "\n";
+    os << "rate_inflight_bytes " << rc.inflightBytes << "\n";
+    os << "rate_frames_skipped " << rc.framesSkipped << "\n";
+    os << "rate_level_downs " << rc.levelDowns << "\n";
+    os << "rate_level_ups " << rc.levelUps << "\n";
+    return os.str();
+}
+
 class Server {
 public:
-    Server(int portVideo=9632, int portControl=9633, int portWeb=8080, int portAudio=9634) :
-        m_portVideo(portVideo), m_portControl(portControl), m_portWeb(portWeb), m_portAudio(portAudio),
-        m_listenVideo(INVALID_SOCKET), m_listenControl(INVALID_SOCKET), m_listenWeb(INVALID_SOCKET), m_listenAudio(INVALID_SOCKET),
-        m_clientVideo(INVALID_SOCKET), m_clientControl(INVALID_SOCKET), m_clientAudio(INVALID_SOCKET),
-        m_running(false), m_captureWindow(NULL) {}
+    Server(int port=9632, int portWeb=8080, const ServerOptions& options = ServerOptions()) :
+        m_port(port), m_portWeb(portWeb), m_listen(INVALID_SOCKET), m_listenWeb(INVALID_SOCKET),
+        m_running(false), m_captureWindow(NULL), m_options(options) {}
 
     bool start() {
+#ifdef _WIN32
         // Ask user what to capture
-        m_captureWindow = SelectWindowToCapture();
+        if (m_options.source == "gdi") m_captureWindow = SelectWindowToCapture();
+#endif
 
         WSADATA w;
         if (WSAStartup(MAKEWORD(2,2), &w) != 0) { std::cerr<<"WSAStartup failed\n"; return false; }
 
-        // video listen socket
-        m_listenVideo = socket(AF_INET, SOCK_STREAM, 0);
-        if (m_listenVideo == INVALID_SOCKET) return false;
+        // client listen socket; control, audio and video share the connection
+        m_listen = socket(AF_INET, SOCK_STREAM, 0);
+        if (m_listen == INVALID_SOCKET) return false;
         sockaddr_in srv{};
-        srv.sin_family = AF_INET; srv.sin_addr.s_addr = INADDR_ANY; srv.sin_port = htons(m_portVideo);
-        int opt = 1; setsockopt(m_listenVideo, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
-        if (bind(m_listenVideo, (sockaddr*)&srv, sizeof(srv)) == SOCKET_ERROR) { closesocket(m_listenVideo); return false; }
-        if (listen(m_listenVideo, 1) == SOCKET_ERROR) { closesocket(m_listenVideo); return false; }
-
-        // control listen
-        m_listenControl = socket(AF_INET, SOCK_STREAM, 0);
-        if (m_listenControl == INVALID_SOCKET) return false;
-        sockaddr_in srv2 = srv; srv2.sin_port = htons(m_portControl);
-        setsockopt(m_listenControl, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
-        if (bind(m_listenControl, (sockaddr*)&srv2, sizeof(srv2)) == SOCKET_ERROR) { closesocket(m_listenControl); return false; }
-        if (listen(m_listenControl, 1) == SOCKET_ERROR) { closesocket(m_listenControl); return false; }
+        srv.sin_family = AF_INET; srv.sin_addr.s_addr = INADDR_ANY; srv.sin_port = htons(m_port);
+        int opt = 1; setsockopt(m_listen, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+        if (bind(m_listen, (sockaddr*)&srv, sizeof(srv)) == SOCKET_ERROR) { closesocket(m_listen); return false; }
+        if (listen(m_listen, 1) == SOCKET_ERROR) { closesocket(m_listen); return false; }
 
         // web server listen
         m_listenWeb = socket(AF_INET, SOCK_STREAM, 0);
@@ -357,14 +4898,6 @@ public:
         if (bind(m_listenWeb, (sockaddr*)&srv3, sizeof(srv3)) == SOCKET_ERROR) { closesocket(m_listenWeb); return false; }
         if (listen(m_listenWeb, 5) == SOCKET_ERROR) { closesocket(m_listenWeb); return false; }
 
-        // audio listen
-        m_listenAudio = socket(AF_INET, SOCK_STREAM, 0);
-        if (m_listenAudio == INVALID_SOCKET) return false;
-        sockaddr_in srv4 = srv; srv4.sin_port = htons(m_portAudio);
-        setsockopt(m_listenAudio, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
-        if (bind(m_listenAudio, (sockaddr*)&srv4, sizeof(srv4)) == SOCKET_ERROR) { closesocket(m_listenAudio); return false; }
-        if (listen(m_listenAudio, 1) == SOCKET_ERROR) { closesocket(m_listenAudio); return false; }
-
         // Get local IP address
         char hostname[256];
         gethostname(hostname, sizeof(hostname));
@@ -372,161 +4905,402 @@ public:
         char* ip = inet_ntoa(*(in_addr*)host->h_addr_list[0]);
 
         std::cout << "Server IP: " << ip << "\n";
-        std::cout << "Server listening video:" << m_portVideo << " control:" << m_portControl << " audio:" << m_portAudio << " web:" << m_portWeb << "\n";
+        std::cout << "Server listening on port " << m_port << ", web:" << m_portWeb << "\n";
 
         // Start the web server thread immediately
         m_running = true;
         m_threadWeb = std::thread(&Server::webServerLoop, this);
 
-        // Now wait for video, control, and audio clients
-        std::cout << "Waiting for video, control, and audio clients...\n";
-        sockaddr_in cli; int len = sizeof(cli);
-        m_clientVideo = accept(m_listenVideo, (sockaddr*)&cli, &len);
-        if (m_clientVideo == INVALID_SOCKET) { std::cerr<<"accept video failed\n"; return false; }
-        std::cout<<"Video client connected\n";
-
-        len = sizeof(cli);
-        m_clientControl = accept(m_listenControl, (sockaddr*)&cli, &len);
-        if (m_clientControl == INVALID_SOCKET) { std::cerr<<"accept control failed\n"; return false; }
-        std::cout<<"Control client connected\n";
-
-        len = sizeof(cli);
-        m_clientAudio = accept(m_listenAudio, (sockaddr*)&cli, &len);
-        if (m_clientAudio == INVALID_SOCKET) { std::cerr<<"accept audio failed\n"; return false; }
-        std::cout<<"Audio client connected\n";
-
-        // non-blocking basic timeout
-        DWORD timeout = 5000;
-        setsockopt(m_clientVideo, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
-        setsockopt(m_clientControl, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
-        setsockopt(m_clientAudio, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+        std::cout << "Waiting for a client...\n";
+        sockaddr_in cli; socklen_t len = sizeof(cli);
+        SOCKET client = accept(m_listen, (sockaddr*)&cli, &len);
+        if (client == INVALID_SOCKET) { std::cerr<<"accept failed\n"; return false; }
+        std::cout<<"Client connected\n";
+
+        // a stalled client fails sends instead of blocking them forever
+        SetSendTimeout(client, 5000);
+        if (!m_conn.start(client)) { std::cerr<<"connection setup failed\n"; closesocket(client); return false; }
+
+        // UDP video: the client answers the setup message from its UDP socket
+        if (m_options.transport == "udp") {
+            SOCKET udp = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            if (udp == INVALID_SOCKET || bind(udp, (sockaddr*)&srv, sizeof(srv)) == SOCKET_ERROR) {
+                std::cerr << "cannot bind UDP port " << m_port << "\n";
+                if (udp != INVALID_SOCKET) closesocket(udp);
+                return false;
+            }
+            uint32_t token = (uint32_t)std::chrono::steady_clock::now().time_since_epoch().count() ^ (uint32_t)GetCurrentProcessId();
+            BYTE setup[WIRE_HEADER_BYTES + 4];
+            PutWireHeader(setup, MSG_UDP_SETUP, 0, 0, 4);
+            PutLE32(setup + WIRE_HEADER_BYTES, token);
+            if (!m_conn.send(MUX_VIDEO, setup, sizeof(setup)) || !m_udp.start(udp, token, 5000)) {
+                std::cerr << "no UDP from the client, is the port blocked?\n";
+                return false;
+            }
+            std::cout << "Video over UDP\n";
+        }
 
         m_threadCapture = std::thread(&Server::captureLoop, this);
         m_threadControl = std::thread(&Server::controlLoop, this);
 
         // Start audio capture
-        m_audioCapture.start(m_clientAudio);
+        m_audioCapture.start(&m_conn);
 
         return true;
     }
 
     void stop() {
         m_running = false;
+        m_conn.stop();
+        m_udp.stop();
         m_audioCapture.stop();
         if (m_threadCapture.joinable()) m_threadCapture.join();
         if (m_threadControl.joinable()) m_threadControl.join();
         if (m_threadWeb.joinable()) m_threadWeb.join();
-        if (m_clientVideo != INVALID_SOCKET) closesocket(m_clientVideo);
-        if (m_clientControl != INVALID_SOCKET) closesocket(m_clientControl);
-        if (m_clientAudio != INVALID_SOCKET) closesocket(m_clientAudio);
-        if (m_listenVideo != INVALID_SOCKET) closesocket(m_listenVideo);
-        if (m_listenControl != INVALID_SOCKET) closesocket(m_listenControl);
+        m_conn.close();
+        m_udp.close();
+        if (m_listen != INVALID_SOCKET) closesocket(m_listen);
         if (m_listenWeb != INVALID_SOCKET) closesocket(m_listenWeb);
-        if (m_listenAudio != INVALID_SOCKET) closesocket(m_listenAudio);
         WSACleanup();
     }
 
+    // Runs the capture/diff/encode pipeline on a source without any client
+    // or pacing and reports throughput. Used by "bench pipeline".
+    PipelineStats benchmark(FrameSource& source, int frames) {
+        m_headless = true;
+        m_running = true;
+        m_stats = PipelineStats();
+        runPipeline(source, frames);
+        m_running = false;
+        return m_stats;
+    }
+
 private:
-    int m_portVideo, m_portControl, m_portWeb, m_portAudio;
-    SOCKET m_listenVideo, m_listenControl, m_listenWeb, m_listenAudio, m_clientVideo, m_clientControl, m_clientAudio;
+    int m_port, m_portWeb;
+    SOCKET m_listen, m_listenWeb;
+    MuxConnection m_conn;
+    UdpVideoSender m_udp;           // --transport=udp
+    std::mutex m_lostMutex;
+    std::vector<uint32_t> m_lostVideo;  // CTRL_VIDEO_LOST reports for the pipeline
     std::atomic<bool> m_running;
     std::thread m_threadCapture, m_threadControl, m_threadWeb;
     std::mutex m_webMutex;
-    std::vector<BYTE> m_latestFrame;
+    // replaced, never modified, so the web thread sends it without the lock
+    std::shared_ptr<const std::vector<BYTE>> m_latestFrame;
     bool m_frameUpdated = false;
     HWND m_captureWindow;
     AudioCapture m_audioCapture;
+    ServerOptions m_options;
+    bool m_headless = false;
+    PipelineStats m_stats;
+    PipelineStats m_statsSnapshot;  // copy for the web thread, under m_webMutex
+    TileCache m_tileCache;
+    EncodedTileCache m_encodedCache;
 
     const int TILE_W = 256, TILE_H = 256;
-    std::unordered_map<uint64_t, uint32_t> prevChecksums;
+    TileGrid m_tileGrid;
+    std::unique_ptr<WorkStealingPool> m_encodePool;
+    std::vector<JpegEncoder> m_jpegEncoders;    // one per pool thread
+    std::vector<LosslessEncoder> m_losslessEncoders;
+    std::vector<std::vector<BYTE>> m_scaleScratch;   // per thread, half-resolution pixels
+    JpegEncoder m_webEncoder;
+    RateController m_rate;
+    FrameWindow m_frameWindow;
+    VideoEncoder m_videoEncoder;
+    FrameWriter m_frameWriter;      // used by one sending thread at a time
 
     void captureLoop() {
-        GdiplusStartupInput gdiIn; ULONG_PTR token = 0; 
-        if (GdiplusStartup(&token, &gdiIn, NULL) != Ok) {
-            std::cerr << "GdiplusStartup failed\n";
-            return;
-        }
+        std::unique_ptr<FrameSource> source(CreateFrameSource(m_options.source, m_captureWindow));
+        if (source) runPipeline(*source, 0);
+    }
 
-        HDC hScreen = NULL;
+    // Pulls frames from the source and pushes them through change detection,
+    // encoding and sending. frameLimit 0 runs until the server is stopped.
+    void runPipeline(FrameSource& source, int frameLimit) {
         int screenW = 0, screenH = 0;
-        int offsetX = 0, offsetY = 0;
-
-        if (m_captureWindow) {
-            hScreen = GetDC(m_captureWindow);
-            RECT rect;
-            GetClientRect(m_captureWindow, &rect);
-            screenW = rect.right - rect.left;
-            screenH = rect.bottom - rect.top;
-        } else {
-            hScreen = GetDC(NULL);
-            screenW = GetSystemMetrics(SM_CXSCREEN);
-            screenH = GetSystemMetrics(SM_CYSCREEN);
-        }
-
-        if (!hScreen || screenW <= 0 || screenH <= 0) {
-            std::cerr << "Failed to get capture context\n";
-            GdiplusShutdown(token);
-            return;
-        }
-
-        HDC hMem = CreateCompatibleDC(hScreen);
-        if (!hMem) {
-            std::cerr << "CreateCompatibleDC failed\n";
-            ReleaseDC(m_captureWindow ? m_captureWindow : NULL, hScreen);
-            GdiplusShutdown(token);
-            return;
-        }
-
-        HBITMAP hBmp = CreateCompatibleBitmap(hScreen, screenW, screenH);
-        if (!hBmp) {
-            std::cerr << "CreateCompatibleBitmap failed\n";
-            DeleteDC(hMem);
-            ReleaseDC(m_captureWindow ? m_captureWindow : NULL, hScreen);
-            GdiplusShutdown(token);
-            return;
-        }
-
-        HGDIOBJ old = SelectObject(hMem, hBmp);
-        if (old == HGDI_ERROR) {
-            std::cerr << "SelectObject failed\n";
-            DeleteObject(hBmp);
-            DeleteDC(hMem);
-            ReleaseDC(m_captureWindow ? m_captureWindow : NULL, hScreen);
-            GdiplusShutdown(token);
+        if (!source.open(screenW, screenH)) {
+            std::cerr << "Failed to open frame source\n";
             return;
         }
 
-        BITMAPINFO bi{}; bi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-        bi.bmiHeader.biWidth = screenW; bi.bmiHeader.biHeight = -screenH;
-        bi.bmiHeader.biPlanes = 1; bi.bmiHeader.biBitCount = 32; bi.bmiHeader.biCompression = BI_RGB;
         std::vector<BYTE> fullBuf(screenW * screenH * 4);
-
-        while (m_running) {
-            if (!BitBlt(hMem, 0,0, screenW, screenH, hScreen, offsetX, offsetY, SRCCOPY)) { 
-                std::cerr<<"BitBlt failed\n"; 
-                break; 
-            }
-
-            // overlay cursor only for full screen
-            if (!m_captureWindow) {
-                CURSORINFO ci{}; ci.cbSize = sizeof(ci);
-                if (GetCursorInfo(&ci) && (ci.flags & CURSOR_SHOWING)) {
-                    ICONINFO ii; 
-                    if (GetIconInfo(ci.hCursor, &ii)) {
-                        DrawIconEx(hMem, ci.ptScreenPos.x - ii.xHotspot, ci.ptScreenPos.y - ii.yHotspot, ci.hCursor, 0,0,0,NULL,DI_NORMAL);
-                        if (ii.hbmMask) DeleteObject(ii.hbmMask);
-                        if (ii.hbmColor) DeleteObject(ii.hbmColor);
+        int frameCounter = 0;
+
+        // Last frame whose tiles went out: the reference for compare mode
+        // and for sub-tile refinement
+        bool compareMode = m_options.diff == "compare";
+        std::vector<BYTE> prevBuf(fullBuf.size());
+        bool havePrev = false;
+        std::vector<DirtyRect> rects;
+        std::vector<CopyRect> moves;
+        m_tileCache.reset(m_options.tileCache);
+        m_encodedCache.reset((size_t)m_options.encodeCache << 20);
+        m_tileGrid.resize(screenW, screenH, TILE_W, TILE_H);
+        m_tileGrid.clear();
+        if (!m_encodePool || (m_options.encodeThreads > 0 && m_encodePool->threads() != m_options.encodeThreads)) {
+            m_encodePool.reset(new WorkStealingPool(m_options.encodeThreads));
+        }
+        m_jpegEncoders.resize(m_encodePool->threads());
+        m_losslessEncoders.resize(m_encodePool->threads());
+        m_scaleScratch.resize(m_encodePool->threads());
+        // headless runs have no client to acknowledge anything
+        bool rateControl = m_options.rateControl && !m_headless;
+        bool udp = m_options.transport == "udp" && !m_headless;
+        m_rate.reset(m_options.latencyTarget);
+        m_frameWindow.reset(m_headless ? 0 : m_options.frameWindow);
+        // video bytes as the rate controller and the frame window count them,
+        // before they are sent
+        auto countSent = [&](uint64_t bytes) {
+            if (rateControl) m_rate.onSent(bytes);
+            m_frameWindow.onSent(bytes);
+        };
+        RateLevel rate = RATE_LEVELS[0];
+
+        struct Tile {
+            uint32_t type; int x,y,w,h; std::vector<BYTE> data;
+            // streamed framing: held back while encoding and until record
+            // "after" has gone out
+            int after = -1;
+            bool encoding = false, streamed = false;
+        };
+        // Records of the current frame. Payload buffers go back to
+        // spareBuffers once the frame is sent, so their capacity is reused.
+        std::vector<Tile> changed;
+        std::vector<std::vector<BYTE>> spareBuffers;
+        auto addRecord = [&](uint32_t type, int x, int y, int w, int h) -> std::vector<BYTE>& {
+            changed.push_back({type, x, y, w, h, {}});
+            std::vector<BYTE>& data = changed.back().data;
+            if (!spareBuffers.empty()) {
+                data = std::move(spareBuffers.back());
+                spareBuffers.pop_back();
+                data.clear();
+            }
+            return data;
+        };
+        auto dropLastRecord = [&] {
+            spareBuffers.push_back(std::move(changed.back().data));
+            changed.pop_back();
+        };
+        std::vector<BYTE> webJpeg;
+        // a rect waiting for the encode pool
+        struct EncodeJob {
+            size_t record;          // index in the frame's records
+            const BYTE* pixels;
+            int w, h;
+            TileState* state;
+            uint32_t slot;          // tile cache slot for the _STORE records
+            uint64_t key;
+            int quality;            // JPEG quality if lossless doesn't suit
+            int scale;              // 2: JPEG at half resolution
+            size_t maxBytes;        // lossless is used up to this size
+            bool upgrade;           // final-quality resend of a static tile
+            double ms;
+            const EncodedTileCache::Entry* cached = nullptr;    // earlier output for the same content
+            bool merged = false;    // the rect grew to take in other jobs
+            bool absorbed = false;  // encoded as part of another job's rect
+        };
+        std::vector<EncodeJob> jobs;
+        // A rect with the same content as a REC_JPEG_STORE job earlier in
+        // the frame. It becomes a reference to the job's slot once the job is
+        // known to be stored, else a copy of the job's pixels on the client.
+        struct PendingRef {
+            size_t record, job;
+            int sx, sy;             // the job's rect before any merge
+            TileState* state;
+        };
+        std::vector<PendingRef> pendingRefs;
+        std::unordered_map<uint64_t, size_t> pendingStores;     // content key -> job
+        std::vector<int> upgradeCandidates;     // tile indices
+        std::vector<BudgetItem> budgetItems;    // parallel to jobs
+        std::vector<MergeItem> mergeItems;      // parallel to jobs
+        bool jpegTablesSent[101] = {};          // by quality, for this session
+        std::vector<int> newJpegTables;
+        int freshQuality = m_options.draftQuality > 0 ? m_options.draftQuality : FINAL_JPEG_QUALITY;
+
+        // Streamed framing: each burst of ready records goes out as one
+        // message, and a message with MSG_FLAG_END_OF_FRAME follows the last.
+        // The pipeline thread streams what is ready as it goes; during the
+        // encode each finished job streams itself, and a thread that finds
+        // another one sending leaves its record to that thread.
+        bool streaming = m_options.framing == "stream";
+        std::mutex streamMutex;
+        bool streamBusy = false, streamStarted = false, streamFailed = false;
+        size_t streamFrom = 0;          // records before this one have all gone out
+        uint64_t streamBytes = 0;
+        std::vector<size_t> streamBatch;
+        std::chrono::steady_clock::time_point firstSend;
+        auto streamRecords = [&] {
+            std::unique_lock<std::mutex> lock(streamMutex);
+            if (streamBusy) return;
+            streamBusy = true;
+            while (!streamFailed) {
+                streamBatch.clear();
+                while (streamFrom < changed.size() && changed[streamFrom].streamed) streamFrom++;
+                for (size_t i=streamFrom; i<changed.size(); ++i) {
+                    Tile& t = changed[i];
+                    if (t.streamed || t.encoding || (t.after >= 0 && !changed[t.after].streamed)) continue;
+                    t.streamed = true;
+                    if (!t.data.empty()) streamBatch.push_back(i);
+                }
+                if (streamBatch.empty()) break;
+                lock.unlock();
+                m_frameWriter.begin(screenW, screenH, TILE_W, TILE_H);
+                for (size_t i : streamBatch) {
+                    const Tile& t = changed[i];
+                    m_frameWriter.add(t.type, t.x, t.y, t.w, t.h, t.data.data(), t.data.size());
+                }
+                size_t bytes = m_frameWriter.size();
+                // counted before sending so time blocked in send shows up as delay
+                countSent(bytes);
+                if (!streamStarted) firstSend = std::chrono::steady_clock::now();
+                streamStarted = true;
+                bool ok = sendVideo(m_frameWriter.finish(false));
+                lock.lock();
+                streamBytes += bytes;
+                if (!ok) streamFailed = true;
+            }
+            streamBusy = false;
+        };
+        // Content the client holds or will hold by the end of the frame is
+        // only referenced; true if a reference record was added for rect
+        auto addCacheRef = [&](uint64_t key, int x, int y, int w, int h, TileState* state) -> bool {
+            int slot = m_tileCache.lookup(key);
+            if (slot >= 0) {
+                std::vector<BYTE>& ref = addRecord(REC_CACHE_REF, x, y, w, h);
+                ref.resize(4);
+                PutLE32(ref.data(), (uint32_t)slot);
+                return true;
+            }
+            auto pending = pendingStores.find(key);
+            if (pending == pendingStores.end()) return false;
+            const EncodeJob& filler = jobs[pending->second];
+            if (filler.w != w || filler.h != h) return false;
+            const Tile& fillerRec = changed[filler.record];
+            pendingRefs.push_back({ changed.size(), pending->second, fillerRec.x, fillerRec.y, state });
+            addRecord(REC_CACHE_REF, x, y, w, h);
+            changed.back().after = (int)filler.record;
+            return true;
+        };
+        // tiles whose draft has been static this long are upgraded
+        const uint32_t UPGRADE_AFTER_FRAMES = 3;
+
+        // Inter-frame video region, in whole tiles. Tiles that changed in
+        // VIDEO_AFTER_FRAMES consecutive frames start or grow it. Once
+        // nothing in it has changed for VIDEO_IDLE_FRAMES, its tiles go
+        // back to the tile path as drafts.
+        const int VIDEO_AFTER_FRAMES = 5, VIDEO_IDLE_FRAMES = 25;
+        bool videoActive = false, videoKeyframe = false;
+        DirtyRect videoRect = { 0, 0, 0, 0 };
+        int videoIdleFrames = 0, videoQpOffset = 0;
+        m_videoEncoder.reset();
+
+        while (m_running && (frameLimit == 0 || frameCounter < frameLimit)) {
+            auto t0 = std::chrono::steady_clock::now();
+            // an ack frees the window, so capture again as soon as one comes
+            if (!m_frameWindow.beginFrame()) {
+                {
+                    std::lock_guard<std::mutex> lock(m_webMutex);
+                    m_statsSnapshot.framesInFlight = m_frameWindow.framesInFlight();
+                    m_statsSnapshot.windowFull = m_frameWindow.timesFull();
+                }
+                m_frameWindow.waitForAck(rate.intervalMs);
+                continue;
+            }
+            if (rateControl) {
+                // let the link drain instead of queueing another frame
+                if (!m_rate.beginFrame()) {
+                    {
+                        std::lock_guard<std::mutex> lock(m_webMutex);
+                        m_statsSnapshot.rate = m_rate.counters();
                     }
+                    m_rate.waitForAck(m_rate.level().intervalMs);
+                    continue;
                 }
+                rate = m_rate.level();
             }
-
-            if (!GetDIBits(hMem, hBmp, 0, screenH, fullBuf.data(), &bi, DIB_RGB_COLORS)) { 
-                std::cerr<<"GetDIBits failed\n"; 
-                break; 
+            int jobQuality = min(freshQuality, rate.quality);
+            if (!source.grab(fullBuf.data())) break;
+            auto t1 = std::chrono::steady_clock::now();
+
+            for (Tile& t : changed) spareBuffers.push_back(std::move(t.data));
+            changed.clear();
+            jobs.clear();
+            pendingRefs.clear();
+            pendingStores.clear();
+            m_tileCache.newFrame();
+            upgradeCandidates.clear();
+            double encodeMs = 0;
+            size_t tableRecords = 0;
+            streamFrom = 0;
+            streamBytes = 0;
+            streamStarted = false;
+
+            if (udp) {
+                // a bit above the delivery rate, so datagrams don't arrive as one burst
+                m_udp.setPacing(rateControl ? m_rate.counters().bandwidthKbps * 2 : 0);
+                std::vector<uint32_t> lost;
+                {
+                    std::lock_guard<std::mutex> lock(m_lostMutex);
+                    lost.swap(m_lostVideo);
+                }
+                for (uint32_t seq : lost) repairLostMessage(seq, jpegTablesSent, videoKeyframe);
             }
 
-            struct Tile { int x,y,w,h; std::vector<BYTE> jpeg; };
-            std::vector<Tile> changed;
+            if (m_options.video != "off" && havePrev) {
+                DirtyRect hot = { 0, 0, 0, 0 };
+                if (m_options.video == "full") {
+                    hot = { 0, 0, screenW, screenH };
+                } else {
+                    for (int r=0; r<m_tileGrid.rows(); ++r) {
+                        for (int c=0; c<m_tileGrid.cols(); ++c) {
+                            if (m_tileGrid.at(c, r).motionFrames < VIDEO_AFTER_FRAMES) continue;
+                            int x0 = c * TILE_W, y0 = r * TILE_H, x1 = min(x0 + TILE_W, screenW), y1 = min(y0 + TILE_H, screenH);
+                            if (hot.w == 0) { hot = { x0, y0, x1 - x0, y1 - y0 }; continue; }
+                            int hx1 = max(hot.x + hot.w, x1), hy1 = max(hot.y + hot.h, y1);
+                            hot.x = min(hot.x, x0); hot.y = min(hot.y, y0);
+                            hot.w = hx1 - hot.x; hot.h = hy1 - hot.y;
+                        }
+                    }
+                }
+                if (hot.w > 0) {
+                    if (videoActive) {
+                        int x1 = max(hot.x + hot.w, videoRect.x + videoRect.w), y1 = max(hot.y + hot.h, videoRect.y + videoRect.h);
+                        hot.x = min(hot.x, videoRect.x); hot.y = min(hot.y, videoRect.y);
+                        hot.w = x1 - hot.x; hot.h = y1 - hot.y;
+                    }
+                    // a new or grown region restarts the stream
+                    if (!videoActive || hot.x != videoRect.x || hot.y != videoRect.y || hot.w != videoRect.w || hot.h != videoRect.h) {
+                        videoRect = hot;
+                        videoKeyframe = true;
+                    }
+                    videoActive = true;
+                }
+            }
+            bool videoChanged = false;
+
+            // scrolled content is moved on both sides before tiles are diffed;
+            // a full-screen video stream carries motion itself
+            if (m_options.motion && havePrev && m_options.video != "full") {
+                DetectMoves(fullBuf.data(), prevBuf.data(), screenW, screenH, moves);
+                for (const CopyRect& m : moves) {
+                    CopyRectInBuffer(prevBuf.data(), screenW * 4, m.sx, m.sy, m.dx, m.dy, m.w, m.h);
+                    std::vector<BYTE>& src = addRecord(REC_COPY, m.dx, m.dy, m.w, m.h);
+                    src.resize(8);
+                    PutLE32(src.data(), (uint32_t)m.sx); PutLE32(src.data() + 4, (uint32_t)m.sy);
+
+                    // moved pixels keep the quality they were delivered at
+                    uint8_t q = QUALITY_FINAL;
+                    for (int y=m.sy / TILE_H; y<=(m.sy + m.h - 1) / TILE_H; ++y)
+                        for (int x=m.sx / TILE_W; x<=(m.sx + m.w - 1) / TILE_W; ++x) q = min(q, m_tileGrid.at(x, y).quality);
+                    for (int y=m.dy / TILE_H; y<=(m.dy + m.h - 1) / TILE_H; ++y)
+                        for (int x=m.dx / TILE_W; x<=(m.dx + m.w - 1) / TILE_W; ++x) {
+                            TileState& dst = m_tileGrid.at(x, y);
+                            dst.quality = min(dst.quality, q);
+                        }
+                }
+                m_stats.copiesSent += moves.size();
+            }
+            if (streaming) streamRecords();
 
             for (int ty=0; ty<screenH && m_running; ty+=TILE_H) {
                 for (int tx=0; tx<screenW && m_running; tx+=TILE_W) {
@@ -534,136 +5308,586 @@ private:
                     int h = min(TILE_H, screenH - ty);
                     if (w <= 0 || h <= 0) continue;
 
-                    uint32_t csum = 0;
-                    for (int y=0; y<h; ++y) {
-                        const uint32_t* row = (const uint32_t*)(fullBuf.data() + (ty+y) * screenW * 4);
-                        for (int x=0; x<w; ++x) csum += row[tx + x];
+                    size_t tileOffset = ((size_t)ty * screenW + tx) * 4;
+                    const BYTE* tilePixels = fullBuf.data() + tileOffset;
+                    BYTE* prevPixels = prevBuf.data() + tileOffset;
+                    TileState& state = m_tileGrid.at(tx / TILE_W, ty / TILE_H);
+                    bool unchanged;
+                    int row = 0;
+                    if (compareMode) {
+                        if (havePrev) row = FirstDifferingRow(tilePixels, prevPixels, screenW * 4, w, h);
+                        unchanged = row < 0;
+                    } else {
+                        uint64_t csum = HashTile(tilePixels, screenW * 4, w, h);
+                        unchanged = state.hashValid && csum == state.hash;
+                        state.hash = csum;
+                        state.hashValid = true;
                     }
-
-                    uint64_t key = ((uint64_t)tx << 32) | (uint32_t)ty;
-                    uint32_t prev = prevChecksums[key];
-                    if (csum != prev) {
-                        prevChecksums[key] = csum;
-
-                        HBITMAP tileBmp = CreateCompatibleBitmap(hScreen, w, h);
-                        if (!tileBmp) continue;
-
-                        HDC tdc = CreateCompatibleDC(hScreen);
-                        if (!tdc) {
-                            DeleteObject(tileBmp);
+                    // what the client should hold never arrived
+                    bool refresh = state.refresh;
+                    if (refresh) {
+                        state.refresh = false;
+                        unchanged = false;
+                        row = 0;
+                    }
+                    bool inVideo = videoActive && tx >= videoRect.x && ty >= videoRect.y &&
+                                   tx + w <= videoRect.x + videoRect.w && ty + h <= videoRect.y + videoRect.h;
+                    if (unchanged) {
+                        state.staticFrames++;
+                        state.motionFrames = 0;
+                        if (!inVideo && state.quality < QUALITY_FINAL && state.staticFrames >= UPGRADE_AFTER_FRAMES) {
+                            upgradeCandidates.push_back((ty / TILE_H) * m_tileGrid.cols() + tx / TILE_W);
+                        }
+                        continue;
+                    }
+                    state.changeCount++;
+                    state.staticFrames = 0;
+                    if (state.motionFrames < 255) state.motionFrames++;
+                    if (inVideo) {
+                        // sent as part of the video frame below
+                        videoChanged = true;
+                        CopyRegionRows(prevPixels, tilePixels, screenW * 4, w, row, h);
+                        state.lastSentFrame = (uint32_t)frameCounter;
+                        continue;
+                    }
+                    size_t recordsBefore = changed.size();
+
+                    // only send the parts of the tile that really changed
+                    rects.clear();
+                    if (m_options.refine > 0 && havePrev && !refresh) {
+                        RefineDirtyRects(fullBuf.data(), prevBuf.data(), screenW * 4, tx, ty, w, h, m_options.refine, rects);
+                    } else {
+                        rects.push_back({tx, ty, w, h});
+                    }
+                    CopyRegionRows(prevPixels, tilePixels, screenW * 4, w, row, h);
+                    // a complete resend replaces whatever quality the tile had;
+                    // draft encodes lower it again below
+                    if (rects.size() == 1 && rects[0].w == w && rects[0].h == h) state.quality = QUALITY_FINAL;
+
+                    for (const DirtyRect& r : rects) {
+                        const BYTE* rectPixels = fullBuf.data() + ((size_t)r.y * screenW + r.x) * 4;
+
+                        // flat regions become a fill command
+                        uint32_t palette[MAX_PALETTE_COLORS];
+                        int colors = CollectPalette(rectPixels, screenW * 4, r.w, r.h, palette);
+                        if (colors == 1) {
+                            std::vector<BYTE>& fill = addRecord(REC_FILL, r.x, r.y, r.w, r.h);
+                            fill.resize(4);
+                            PutLE32(fill.data(), palette[0]);
+                            m_stats.fillsSent++;
                             continue;
                         }
 
-                        HGDIOBJ oldt = SelectObject(tdc, tileBmp);
-                        if (oldt == HGDI_ERROR) {
-                            DeleteDC(tdc);
-                            DeleteObject(tileBmp);
-                            continue;
+                        // content the client already holds is only referenced
+                        uint64_t contentKey = 0;
+                        if (m_tileCache.enabled()) {
+                            contentKey = HashTile(rectPixels, screenW * 4, r.w, r.h);
+                            if (addCacheRef(contentKey, r.x, r.y, r.w, r.h, &state)) continue;
+                        }
+
+                        // few colors: lossless palette + RLE when it beats
+                        // half a byte per pixel
+                        if (colors > 1) {
+                            std::vector<BYTE>& pal = addRecord(REC_PALETTE, r.x, r.y, r.w, r.h);
+                            if (EncodePaletteRLE(rectPixels, screenW * 4, r.w, r.h, palette, colors, (size_t)r.w * r.h / 2, pal)) {
+                                m_stats.palettesSent++;
+                                continue;
+                            }
+                            dropLastRecord();
                         }
 
-                        if (!BitBlt(tdc, 0,0, w,h, hMem, tx, ty, SRCCOPY)) {
-                            SelectObject(tdc, oldt);
-                            DeleteDC(tdc);
-                            DeleteObject(tileBmp);
+                        // the rest goes to the encode pool; the record keeps
+                        // its place, and later rects with the same content
+                        // refer to it
+                        EncodeJob job = { changed.size(), rectPixels, r.w, r.h, &state, 0, contentKey, jobQuality, rate.scale, (size_t)r.w * r.h / 2, false, 0 };
+                        if (m_tileCache.enabled()) pendingStores[contentKey] = jobs.size();
+                        addRecord(m_tileCache.enabled() ? REC_JPEG_STORE : REC_JPEG, r.x, r.y, r.w, r.h);
+                        changed.back().encoding = true;
+                        jobs.push_back(job);
+                    }
+                    if (changed.size() > recordsBefore) state.lastSentFrame = (uint32_t)frameCounter;
+                }
+                // fills, palettes and references of the row need no encode
+                if (streaming) streamRecords();
+            }
+            havePrev = true;
+            size_t budget = (size_t)m_options.frameBudget * 1024;
+            if (budget == 0 && rateControl) budget = m_rate.frameBudget(rate.intervalMs);
+
+            if (videoActive && (videoChanged || videoKeyframe)) {
+                PixelView view = { fullBuf.data() + ((size_t)videoRect.y * screenW + videoRect.x) * 4, screenW * 4, videoRect.w, videoRect.h };
+                std::vector<BYTE>& rec = addRecord(REC_VIDEO, videoRect.x, videoRect.y, videoRect.w, videoRect.h);
+                auto v0 = std::chrono::steady_clock::now();
+                m_videoEncoder.encode(view, VideoQpForQuality(rate.quality) + videoQpOffset, videoKeyframe, *m_encodePool, rec);
+                encodeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - v0).count();
+                m_stats.videoFrames++;
+                m_stats.videoBytes += rec.size();
+                if (m_videoEncoder.lastKeyframe) m_stats.videoKeyframes++;
+                videoKeyframe = false;
+                if (streaming) streamRecords();
+                // under a budget the stream gives way to the tiles around it
+                if (budget > 0 && rec.size() > budget / 2) videoQpOffset = min(videoQpOffset + 2, VIDEO_MAX_QP);
+                else if (videoQpOffset > 0 && rec.size() < budget / 8) videoQpOffset--;
+            }
+            if (videoActive && m_options.video == "auto") {
+                videoIdleFrames = videoChanged ? 0 : videoIdleFrames + 1;
+                if (videoIdleFrames >= VIDEO_IDLE_FRAMES) {
+                    // the client holds lossy video pixels; upgrades replace them
+                    for (int r=videoRect.y / TILE_H; r<(videoRect.y + videoRect.h + TILE_H - 1) / TILE_H; ++r)
+                        for (int c=videoRect.x / TILE_W; c<(videoRect.x + videoRect.w + TILE_W - 1) / TILE_W; ++c)
+                            m_tileGrid.at(c, r).quality = QUALITY_DRAFT;
+                    videoActive = false;
+                    videoIdleFrames = 0;
+                }
+            }
+
+            // Fit the frame into its byte budget: the records that are
+            // already final come off the top, the encode jobs share the rest
+            size_t budgetLeft = 0;
+            if (budget > 0) {
+                size_t fixedBytes = WIRE_HEADER_BYTES;
+                for (const Tile& t : changed) fixedBytes += WIRE_RECORD_BYTES + t.data.size();
+                budgetItems.clear();
+                for (const EncodeJob& job : jobs) {
+                    PixelView view = { job.pixels, screenW * 4, job.w, job.h };
+                    float bpp = job.state->jpegBpp50 > 0 ? job.state->jpegBpp50 : EstimateJpegBpp50(view);
+                    size_t pixels = (size_t)((job.w + job.scale - 1) / job.scale) * ((job.h + job.scale - 1) / job.scale);
+                    budgetItems.push_back({ pixels, bpp, job.quality });
+                }
+                // a tenth held back for prediction error
+                size_t jobBudget = budget > fixedBytes ? (budget - fixedBytes) / 10 * 9 : 0;
+                size_t predicted = AllocateFrameBudget(budgetItems, jobBudget);
+                for (size_t i=0; i<jobs.size(); ++i) {
+                    const BudgetItem& item = budgetItems[i];
+                    if (item.quality < jobs[i].quality) m_stats.budgetLoweredTiles++;
+                    jobs[i].quality = item.quality;
+                    // lossless only where it costs no more than the allotted JPEG
+                    jobs[i].maxBytes = min(jobs[i].maxBytes, PredictJpegBytes(item.pixels, item.bpp50, item.quality));
+                }
+                budgetLeft = jobBudget > predicted ? jobBudget - predicted : 0;
+                m_stats.framesBudgeted++;
+            }
+
+            // Static draft tiles are re-sent whole at final quality with
+            // whatever is left of the per-frame tile budget after fresh
+            // changes, and only while the link has room, so upgrades only
+            // use spare capacity
+            int upgrades = !rateControl || m_rate.spareCapacity() ? m_options.upgradeTiles - (int)jobs.size() : 0;
+            for (size_t i=0; i<upgradeCandidates.size() && upgrades > 0; ++i, --upgrades) {
+                int col = upgradeCandidates[i] % m_tileGrid.cols(), tileRow = upgradeCandidates[i] / m_tileGrid.cols();
+                int tx = col * TILE_W, ty = tileRow * TILE_H;
+                int w = min(TILE_W, screenW - tx), h = min(TILE_H, screenH - ty);
+                TileState& state = m_tileGrid.at(col, tileRow);
+                const BYTE* tilePixels = fullBuf.data() + ((size_t)ty * screenW + tx) * 4;
+                // under a budget, upgrades only take what fresh changes left over
+                size_t upgradeBytes = (size_t)w * h / 2;
+                if (budget > 0) {
+                    PixelView view = { tilePixels, screenW * 4, w, h };
+                    float bpp = state.jpegBpp50 > 0 ? state.jpegBpp50 : EstimateJpegBpp50(view);
+                    upgradeBytes = PredictJpegBytes((size_t)w * h, bpp, FINAL_JPEG_QUALITY);
+                    if (upgradeBytes + WIRE_RECORD_BYTES > budgetLeft) break;
+                    budgetLeft -= upgradeBytes + WIRE_RECORD_BYTES;
+                }
+                state.lastSentFrame = (uint32_t)frameCounter;
+                m_stats.upgradesSent++;
+
+                uint64_t key = 0;
+                if (m_tileCache.enabled()) {
+                    key = HashTile(tilePixels, screenW * 4, w, h);
+                    if (addCacheRef(key, tx, ty, w, h, &state)) {
+                        state.quality = QUALITY_FINAL;
+                        continue;
+                    }
+                }
+                EncodeJob job = { changed.size(), tilePixels, w, h, &state, 0, key, FINAL_JPEG_QUALITY, 1, upgradeBytes, true, 0 };
+                if (m_tileCache.enabled()) pendingStores[key] = jobs.size();
+                addRecord(m_tileCache.enabled() ? REC_JPEG_STORE : REC_JPEG, tx, ty, w, h);
+                changed.back().encoding = true;
+                jobs.push_back(job);
+            }
+
+            // Fresh rects with the same encode settings are joined where that
+            // saves bytes, up to four tiles or a thread's share of the frame.
+            // Joined rects skip the client cache; draft stores never reach
+            // it anyway.
+            if (m_options.mergeRects && jobs.size() > 1) {
+                mergeItems.clear();
+                size_t totalArea = 0;
+                for (const EncodeJob& job : jobs) {
+                    bool draft = job.quality < FINAL_JPEG_QUALITY || job.scale > 1;
+                    bool mergeable = !job.upgrade && (changed[job.record].type != REC_JPEG_STORE || draft);
+                    const Tile& rec = changed[job.record];
+                    float bpp = 0;
+                    if (mergeable) {
+                        PixelView view = { job.pixels, screenW * 4, job.w, job.h };
+                        float bpp50 = job.state->jpegBpp50 > 0 ? job.state->jpegBpp50 : EstimateJpegBpp50(view);
+                        bpp = (PredictJpegBytes(1 << 16, bpp50, job.quality) - JPEG_HEADER_BYTES) / (65536.0f * job.scale * job.scale);
+                    }
+                    mergeItems.push_back({ { rec.x, rec.y, rec.w, rec.h }, (size_t)job.w * job.h, mergeable ? job.quality * 4 + job.scale : -1, bpp, -1 });
+                    totalArea += (size_t)job.w * job.h;
+                }
+                size_t maxArea = max((size_t)TILE_W * TILE_H * 4, totalArea / m_encodePool->threads());
+                if (MergeRects(mergeItems, maxArea) > 0) {
+                    for (size_t i=0; i<jobs.size(); ++i) {
+                        EncodeJob& job = jobs[i];
+                        const MergeItem& item = mergeItems[i];
+                        Tile& rec = changed[job.record];
+                        bool grew = item.rect.x != rec.x || item.rect.y != rec.y || item.rect.w != rec.w || item.rect.h != rec.h;
+                        if (item.into < 0 && !grew) continue;
+                        // the content keys no longer match what gets sent
+                        rec.type = REC_JPEG;
+                        if (item.into >= 0) {
+                            job.absorbed = true;
+                            jobs[item.into].maxBytes += job.maxBytes;
+                            m_stats.rectsMerged++;
                             continue;
                         }
+                        job.merged = true;
+                        job.key = 0;
+                        job.pixels = fullBuf.data() + ((size_t)item.rect.y * screenW + item.rect.x) * 4;
+                        job.w = item.rect.w; job.h = item.rect.h;
+                        rec.x = item.rect.x; rec.y = item.rect.y; rec.w = item.rect.w; rec.h = item.rect.h;
+                    }
+                }
+            }
+
+            // Only final, full-resolution encodes fill client cache slots,
+            // now that budget and merging have settled each job's settings.
+            // A reference to a job that ends up unstored copies the job's
+            // pixels on the client instead. The job's record, or the one it
+            // was merged into, always comes earlier in the frame.
+            for (EncodeJob& job : jobs) {
+                Tile& rec = changed[job.record];
+                if (rec.type != REC_JPEG_STORE) continue;
+                bool draft = job.quality < FINAL_JPEG_QUALITY || job.scale > 1;
+                int slot = draft ? -1 : m_tileCache.insert(job.key);
+                if (slot < 0) rec.type = REC_JPEG;
+                else job.slot = (uint32_t)slot;
+            }
+            for (const PendingRef& ref : pendingRefs) {
+                const EncodeJob& filler = jobs[ref.job];
+                Tile& rec = changed[ref.record];
+                if (changed[filler.record].type == REC_JPEG_STORE) {
+                    rec.data.resize(4);
+                    PutLE32(rec.data.data(), filler.slot);
+                    continue;
+                }
+                rec.type = REC_COPY;
+                rec.data.resize(8);
+                PutLE32(rec.data.data(), (uint32_t)ref.sx); PutLE32(rec.data.data() + 4, (uint32_t)ref.sy);
+                if (filler.absorbed) rec.after = (int)jobs[mergeItems[ref.job].into].record;
+            }
+
+            // rect contents encoded recently at the same settings are reused
+            auto e0 = std::chrono::steady_clock::now();
+            if (m_encodedCache.enabled()) {
+                for (EncodeJob& job : jobs) {
+                    if (job.absorbed) continue;
+                    if (!job.key) job.key = HashTile(job.pixels, screenW * 4, job.w, job.h);
+                    job.cached = m_encodedCache.lookup(EncodedTileCache::Key(job.key, job.quality, job.scale));
+                    // lossless output is only valid within this frame's size limit
+                    if (job.cached && job.cached->type == REC_LOSSLESS && job.cached->data.size() > job.maxBytes) job.cached = nullptr;
+                }
+            }
 
-                        SelectObject(tdc, oldt);
-                        DeleteDC(tdc);
+            // streamed JPEGs can't wait for their tables: those go out now,
+            // for every quality the encodes may use
+            if (streaming) {
+                for (const EncodeJob& job : jobs) {
+                    if (job.absorbed || jpegTablesSent[job.quality] || (job.cached && job.cached->type == REC_LOSSLESS)) continue;
+                    jpegTablesSent[job.quality] = true;
+                    std::vector<BYTE>& tables = addRecord(REC_JPEG_TABLES, 0, 0, 0, 0);
+                    tables.push_back((BYTE)job.quality);
+                    m_jpegEncoders[0].encodeTables(job.quality, tables);
+                    tableRecords++;
+                }
+                streamRecords();
+            }
 
-                        RECT rc{0,0,w,h};
-                        std::vector<BYTE> jpg;
-                        if (!EncodeHBITMAPToJPEGBytes(tileBmp, rc, jpg, 90)) {
-                            EncodeHBITMAPToJPEGBytes(tileBmp, rc, jpg, 80);
-                        }
-                        DeleteObject(tileBmp);
-                        if (!jpg.empty()) changed.push_back({tx,ty,w,h, std::move(jpg)});
+            // encode the remaining rects of the frame concurrently: lossless
+            // for text and UI content up to 4 bits per pixel, else JPEG
+            m_encodePool->parallelFor(jobs.size(), [&](size_t i, int thread) {
+                EncodeJob& job = jobs[i];
+                if (job.absorbed) return;
+                auto j0 = std::chrono::steady_clock::now();
+                Tile& rec = changed[job.record];
+                bool store = rec.type == REC_JPEG_STORE;
+                if (store) {
+                    rec.data.resize(rec.data.size() + 4);
+                    PutLE32(rec.data.data() + rec.data.size() - 4, job.slot);
+                }
+                PixelView view = { job.pixels, screenW * 4, job.w, job.h };
+                bool lossless = job.cached ? job.cached->type == REC_LOSSLESS : m_losslessEncoders[thread].encode(view, job.maxBytes, rec.data);
+                if (lossless) {
+                    rec.type = store ? REC_LOSSLESS_STORE : REC_LOSSLESS;
+                    if (job.cached) rec.data.insert(rec.data.end(), job.cached->data.begin(), job.cached->data.end());
+                } else {
+                    if (job.scale > 1) {
+                        if (!job.cached) view = Downscale2x(view, m_scaleScratch[thread]);
+                        rec.type = REC_JPEG_HALF;
+                    }
+                    if (job.cached) {
+                        rec.data.insert(rec.data.end(), job.cached->data.begin(), job.cached->data.end());
+                    } else {
+                        rec.data.push_back((BYTE)job.quality);
+                        if (!m_jpegEncoders[thread].encode(view, job.quality, rec.data, true)) rec.data.clear();
+                    }
+                }
+                job.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - j0).count();
+                if (streaming) {
+                    {
+                        std::lock_guard<std::mutex> lock(streamMutex);
+                        rec.encoding = false;
+                    }
+                    streamRecords();
+                }
+            });
+            encodeMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - e0).count();
+            if (streaming) {
+                // merged-away rects never finish encoding
+                for (const EncodeJob& job : jobs) changed[job.record].encoding = false;
+                streamRecords();
+            }
+            bool emptyRecords = false;     // failed encodes and merged-away rects
+            for (const EncodeJob& job : jobs) {
+                if (job.absorbed) {
+                    emptyRecords = true;
+                    continue;
+                }
+                job.state->encodeMs += job.ms;
+                const Tile& rec = changed[job.record];
+                if (!job.cached) {
+                    job.state->encodeCount++;
+                    if (m_encodedCache.enabled() && !rec.data.empty()) {
+                        bool stored = rec.type == REC_JPEG_STORE || rec.type == REC_LOSSLESS_STORE;
+                        uint32_t type = rec.type == REC_LOSSLESS_STORE ? REC_LOSSLESS : rec.type == REC_JPEG_STORE ? REC_JPEG : rec.type;
+                        size_t skip = stored ? 4 : 0;
+                        m_encodedCache.insert(EncodedTileCache::Key(job.key, job.quality, job.scale), type, rec.data.data() + skip, rec.data.size() - skip);
+                    }
+                }
+                job.state->encodedBytes += rec.data.size();
+                if (rec.type == REC_LOSSLESS || rec.type == REC_LOSSLESS_STORE) m_stats.losslessSent++;
+                if (rec.data.empty()) {
+                    emptyRecords = true;
+                    if (rec.type == REC_JPEG_STORE) m_tileCache.forget(job.key);
+                    continue;
+                }
+                if (rec.type == REC_JPEG || rec.type == REC_JPEG_STORE || rec.type == REC_JPEG_HALF) {
+                    if (!jpegTablesSent[job.quality]) {
+                        jpegTablesSent[job.quality] = true;
+                        newJpegTables.push_back(job.quality);
+                    }
+                    // keep the tile's size model current for the next budget;
+                    // averaged, so one odd frame doesn't swing the allocation
+                    size_t bytes = rec.data.size() - (rec.type == REC_JPEG_STORE ? 4 : 0);
+                    size_t pixels = (size_t)((job.w + job.scale - 1) / job.scale) * ((job.h + job.scale - 1) / job.scale);
+                    if (bytes > (size_t)JPEG_HEADER_BYTES) {
+                        float bpp = MeasureJpegBpp50(bytes - JPEG_HEADER_BYTES, pixels, job.quality);
+                        float& model = job.state->jpegBpp50;
+                        model = model > 0 ? (model + bpp) / 2 : bpp;
+                    }
+                }
+                if (rec.type == REC_JPEG_HALF || (rec.type == REC_JPEG && job.quality < FINAL_JPEG_QUALITY)) {
+                    job.state->quality = min(job.state->quality, (uint8_t)QUALITY_DRAFT);
+                    m_stats.draftsSent++;
+                    // a joined rect redraws every tile it covers
+                    if (job.merged) {
+                        for (int r=rec.y / TILE_H; r<=(rec.y + rec.h - 1) / TILE_H; ++r)
+                            for (int c=rec.x / TILE_W; c<=(rec.x + rec.w - 1) / TILE_W; ++c)
+                                m_tileGrid.at(c, r).quality = min(m_tileGrid.at(c, r).quality, (uint8_t)QUALITY_DRAFT);
                     }
+                } else if (job.upgrade) {
+                    job.state->quality = QUALITY_FINAL;
                 }
             }
+            // a copy is as good as the encode it copies; if that failed there
+            // is nothing to reference or copy, so the tile goes again
+            for (const PendingRef& ref : pendingRefs) {
+                const EncodeJob& filler = jobs[ref.job];
+                const EncodeJob& carrier = filler.absorbed ? jobs[mergeItems[ref.job].into] : filler;
+                const Tile& carrierRec = changed[carrier.record];
+                Tile& rec = changed[ref.record];
+                if (carrierRec.data.empty()) {
+                    rec.data.clear();
+                    ref.state->refresh = true;
+                    emptyRecords = true;
+                } else if (rec.type == REC_COPY && (carrierRec.type == REC_JPEG_HALF || (carrierRec.type == REC_JPEG && carrier.quality < FINAL_JPEG_QUALITY))) {
+                    ref.state->quality = min(ref.state->quality, (uint8_t)QUALITY_DRAFT);
+                }
+            }
+            if (emptyRecords) {
+                changed.erase(std::remove_if(changed.begin(), changed.end(), [](const Tile& t) { return t.data.empty(); }), changed.end());
+            }
+            // tables go first, the client needs them before any image using them
+            tableRecords += newJpegTables.size();
+            for (int quality : newJpegTables) {
+                changed.insert(changed.begin(), Tile{ REC_JPEG_TABLES, 0, 0, 0, 0, {} });
+                changed.front().data.push_back((BYTE)quality);
+                m_jpegEncoders[0].encodeTables(quality, changed.front().data);
+            }
+            newJpegTables.clear();
+            auto t2 = std::chrono::steady_clock::now();
 
             // send if changed
-            if (!changed.empty() && m_clientVideo != INVALID_SOCKET && m_running) {
-                uint32_t magic = 0x49535332;
-                uint32_t w = (uint32_t)screenW, h = (uint32_t)screenH;
-                uint32_t tW = TILE_W, tH = TILE_H;
-                uint32_t cnt = (uint32_t)changed.size();
-
-                if (sendAll(m_clientVideo, (char*)&magic, 4) == SOCKET_ERROR) break;
-                if (sendAll(m_clientVideo, (char*)&w, 4) == SOCKET_ERROR) break;
-                if (sendAll(m_clientVideo, (char*)&h, 4) == SOCKET_ERROR) break;
-                if (sendAll(m_clientVideo, (char*)&tW, 4) == SOCKET_ERROR) break;
-                if (sendAll(m_clientVideo, (char*)&tH, 4) == SOCKET_ERROR) break;
-                if (sendAll(m_clientVideo, (char*)&cnt, 4) == SOCKET_ERROR) break;
-
-                for (const auto &t : changed) {
-                    uint32_t tx = t.x, ty = t.y, tw = t.w, th = t.h;
-                    uint32_t size = (uint32_t)t.jpeg.size();
-                    if (sendAll(m_clientVideo, (char*)&tx, 4) == SOCKET_ERROR) break;
-                    if (sendAll(m_clientVideo, (char*)&ty, 4) == SOCKET_ERROR) break;
-                    if (sendAll(m_clientVideo, (char*)&tw, 4) == SOCKET_ERROR) break;
-                    if (sendAll(m_clientVideo, (char*)&th, 4) == SOCKET_ERROR) break;
-                    if (sendAll(m_clientVideo, (char*)&size, 4) == SOCKET_ERROR) break;
-                    if (sendAll(m_clientVideo, (char*)t.jpeg.data(), size) == SOCKET_ERROR) break;
+            bool sendFailed = false;
+            uint64_t frameBytes = 0;
+            if (streaming) {
+                if (streamStarted && !streamFailed && m_running) {
+                    m_frameWriter.begin(screenW, screenH, TILE_W, TILE_H);
+                    countSent(m_frameWriter.size());
+                    streamFailed = !sendVideo(m_frameWriter.finish(true));
+                    streamBytes += m_frameWriter.size();
                 }
+                frameBytes = streamStarted ? streamBytes : 0;
+                sendFailed = streamFailed;
+            } else if (!changed.empty() && m_running) {
+                m_frameWriter.begin(screenW, screenH, TILE_W, TILE_H);
+                for (const auto& t : changed) m_frameWriter.add(t.type, t.x, t.y, t.w, t.h, t.data.data(), t.data.size());
+                frameBytes = m_frameWriter.size();
+                // counted before sending so time blocked in send shows up as delay
+                countSent(frameBytes);
+                firstSend = std::chrono::steady_clock::now();
+                sendFailed = !sendVideo(m_frameWriter.finish(true));
             }
+            if (frameBytes > 0) {
+                m_frameWindow.onFrameEnd();
+                m_stats.maxFrameBytes = max(m_stats.maxFrameBytes, frameBytes);
+                if (budget > 0 && frameBytes > budget) m_stats.framesOverBudget++;
+                m_stats.framesSent++;
+                m_stats.tilesSent += changed.size() - moves.size() - tableRecords;
+            }
+            auto t3 = std::chrono::steady_clock::now();
+            if (sendFailed) break;
 
             // Save full frame for web
-            static int frameCounter = 0;
             if (++frameCounter % 5 == 0) {
-                HBITMAP fullBmp = CreateCompatibleBitmap(hScreen, screenW, screenH);
-                if (fullBmp) {
-                    HDC fullDc = CreateCompatibleDC(hScreen);
-                    if (fullDc) {
-                        HGDIOBJ oldFull = SelectObject(fullDc, fullBmp);
-                        if (oldFull != HGDI_ERROR) {
-                            BitBlt(fullDc, 0, 0, screenW, screenH, hMem, 0, 0, SRCCOPY);
-
-                            RECT fullRc{0, 0, screenW, screenH};
-                            std::vector<BYTE> fullJpeg;
-                            if (EncodeHBITMAPToJPEGBytes(fullBmp, fullRc, fullJpeg, 85)) {
-                                std::lock_guard<std::mutex> lock(m_webMutex);
-                                m_latestFrame = std::move(fullJpeg);
-                                m_frameUpdated = true;
-                            }
-                        }
-                        SelectObject(fullDc, oldFull);
-                        DeleteDC(fullDc);
-                    }
-                    DeleteObject(fullBmp);
+                PixelView view = { fullBuf.data(), screenW * 4, screenW, screenH };
+                webJpeg.clear();
+                if (m_webEncoder.encode(view, 85, webJpeg)) {
+                    auto latest = std::make_shared<const std::vector<BYTE>>(std::move(webJpeg));
+                    std::lock_guard<std::mutex> lock(m_webMutex);
+                    m_latestFrame = latest;
+                    m_frameUpdated = true;
                 }
             }
 
+            m_stats.frames++;
+            m_stats.cacheHits = m_tileCache.hits;
+            m_stats.cacheMisses = m_tileCache.misses;
+            m_stats.encodeCacheHits = m_encodedCache.hits;
+            m_stats.encodeCacheMisses = m_encodedCache.misses;
+            m_stats.captureMs += std::chrono::duration<double, std::milli>(t1 - t0).count();
+            m_stats.diffMs += std::chrono::duration<double, std::milli>(t2 - t1).count() - encodeMs;
+            m_stats.encodeMs += encodeMs;
+            m_stats.sendMs += std::chrono::duration<double, std::milli>(t3 - t2).count();
+            if (frameBytes > 0) {
+                m_stats.firstRecordMs += std::chrono::duration<double, std::milli>(firstSend - t0).count();
+                m_stats.frameSentMs += std::chrono::duration<double, std::milli>(t3 - t0).count();
+            }
+            if (rateControl) m_stats.rate = m_rate.counters();
+            m_stats.framesInFlight = m_frameWindow.framesInFlight();
+            m_stats.windowFull = m_frameWindow.timesFull();
+            if (udp) m_stats.udp = m_udp.counters();
+            {
+                std::lock_guard<std::mutex> lock(m_webMutex);
+                m_statsSnapshot = m_stats;
+            }
+
             if (!m_running) break;
-            std::this_thread::sleep_for(std::chrono::milliseconds(40));
+            if (source.realtime()) std::this_thread::sleep_until(t0 + std::chrono::milliseconds(rate.intervalMs));
+        }
+
+        source.close();
+    }
+
+    // Video channel output, one message at a time; the connection cuts it
+    // into chunks. In headless runs bytes and calls are only counted.
+    bool sendVideo(const std::vector<WireSpan>& message) {
+        for (const WireSpan& span : message) m_stats.bytesSent += span.size;
+        m_stats.sendBuffers += message.size();
+        if (m_headless) {
+            m_stats.sendCalls++;
+            return true;
         }
+        if (!m_conn.connected()) return false;
+        int calls = 0;
+        bool ok = m_options.transport == "udp" ? m_udp.send(message, calls) : m_conn.send(MUX_VIDEO, message.data(), message.size(), &calls);
+        m_stats.sendCalls += calls;
+        return ok;
+    }
 
-        SelectObject(hMem, old);
-        DeleteObject(hBmp);
-        DeleteDC(hMem);
-        ReleaseDC(m_captureWindow ? m_captureWindow : NULL, hScreen);
-        if (token) GdiplusShutdown(token);
+    // The client gave up on UDP message seq. The tiles it carried are sent
+    // again whole, and so are copies and cache references sent after it,
+    // which may build on what was lost. Lost cache stores are forgotten,
+    // lost JPEG tables go out again and lost video restarts at a keyframe.
+    void repairLostMessage(uint32_t seq, bool* jpegTablesSent, bool& videoKeyframe) {
+        m_stats.udpLost++;
+        auto refreshRect = [&](uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
+            if (w == 0 || h == 0) return;
+            for (uint32_t r=y / TILE_H; r<=(y + h - 1) / TILE_H && (int)r < m_tileGrid.rows(); ++r) {
+                for (uint32_t c=x / TILE_W; c<=(x + w - 1) / TILE_W && (int)c < m_tileGrid.cols(); ++c) {
+                    TileState& state = m_tileGrid.at(c, r);
+                    if (!state.refresh) m_stats.udpRefreshTiles++;
+                    state.refresh = true;
+                }
+            }
+        };
+        bool tablesLost = false;
+        bool found = m_udp.replay(seq, [&](uint32_t sent, const std::vector<BYTE>& message) {
+            WireHeader header;
+            if (message.size() < WIRE_HEADER_BYTES || !ParseWireHeader(message.data(), header) || header.type != MSG_FRAME) return;
+            FrameReader reader(message.data() + WIRE_HEADER_BYTES, message.size() - WIRE_HEADER_BYTES);
+            uint32_t w, h, tileW, tileH;
+            if (!reader.geometry(w, h, tileW, tileH)) return;
+            WireRecord rec;
+            while (reader.next(rec)) {
+                if (sent == seq) {
+                    if (rec.type == REC_JPEG_TABLES && rec.size > 0 && rec.data[0] <= 100) {
+                        jpegTablesSent[rec.data[0]] = false;
+                        tablesLost = true;
+                    }
+                    if ((rec.type == REC_JPEG_STORE || rec.type == REC_LOSSLESS_STORE) && rec.size >= 4) m_tileCache.forgetSlot(GetLE32(rec.data));
+                    if (rec.type == REC_VIDEO) videoKeyframe = true;
+                } else {
+                    bool dependent = rec.type == REC_COPY || rec.type == REC_CACHE_REF ||
+                                     (tablesLost && (rec.type == REC_JPEG || rec.type == REC_JPEG_STORE || rec.type == REC_JPEG_HALF));
+                    if (!dependent) continue;
+                }
+                refreshRect(rec.x, rec.y, rec.w, rec.h);
+            }
+        });
+        if (!found) {
+            // too old to tell what it carried: everything goes again
+            refreshRect(0, 0, m_tileGrid.cols() * TILE_W, m_tileGrid.rows() * TILE_H);
+            for (int q=0; q<=100; ++q) jpegTablesSent[q] = false;
+            m_tileCache.reset(m_options.tileCache);
+            videoKeyframe = true;
+        }
     }
 
     void controlLoop() {
         while (m_running) {
             uint8_t type;
-            int r = recvAll(m_clientControl, (char*)&type, 1);
+            int r = m_conn.recv(MUX_CONTROL, &type, 1, 5000);
+            // an idle client only times out the wait for the next message
+            if (r == MUX_TIMEOUT) continue;
             if (r != 1) break;
 
             if (type == 1) {
                 int32_t x,y; 
-                if (recvAll(m_clientControl, (char*)&x,4) != 4) break;
-                if (recvAll(m_clientControl, (char*)&y,4) != 4) break;
+                if (m_conn.recv(MUX_CONTROL, &x, 4) != 4) break;
+                if (m_conn.recv(MUX_CONTROL, &y, 4) != 4) break;
+#ifdef _WIN32
                 SetCursorPos(x, y);
+#endif
             } else if (type == 2 || type == 3) {
                 uint8_t btn; int32_t x,y;
-                if (recvAll(m_clientControl, (char*)&btn,1) != 1) break;
-                if (recvAll(m_clientControl, (char*)&x,4) != 4) break;
-                if (recvAll(m_clientControl, (char*)&y,4) != 4) break;
+                if (m_conn.recv(MUX_CONTROL, &btn, 1) != 1) break;
+                if (m_conn.recv(MUX_CONTROL, &x, 4) != 4) break;
+                if (m_conn.recv(MUX_CONTROL, &y, 4) != 4) break;
 
                 if (btn != 1 && btn != 2) continue;
-
+#ifdef _WIN32
                 INPUT in[2]; ZeroMemory(in, sizeof(in));
                 in[0].type = INPUT_MOUSE;
                 in[0].mi.dx = x * (65535 / (GetSystemMetrics(SM_CXSCREEN)-1));
@@ -679,18 +5903,30 @@ private:
                     in[0].mi.dwFlags = (type==2 ? MOUSEEVENTF_RIGHTDOWN : MOUSEEVENTF_RIGHTUP);
                 }
                 SendInput(1, &in[0], sizeof(INPUT));
+#endif
             } else if (type == 4) {
                 uint8_t isDown; uint16_t vk;
-                if (recvAll(m_clientControl, (char*)&isDown,1) != 1) break;
-                if (recvAll(m_clientControl, (char*)&vk,2) != 2) break;
+                if (m_conn.recv(MUX_CONTROL, &isDown, 1) != 1) break;
+                if (m_conn.recv(MUX_CONTROL, &vk, 2) != 2) break;
 
                 if (isDown != 0 && isDown != 1) continue;
-
+#ifdef _WIN32
                 INPUT in; ZeroMemory(&in, sizeof(in));
                 in.type = INPUT_KEYBOARD;
                 in.ki.wVk = vk;
                 in.ki.dwFlags = isDown ? 0 : KEYEVENTF_KEYUP;
                 SendInput(1, &in, sizeof(INPUT));
+#endif
+            } else if (type == CTRL_FRAME_ACK) {
+                uint64_t received;
+                if (m_conn.recv(MUX_CONTROL, &received, 8) != 8) break;
+                m_rate.onAck(received);
+                m_frameWindow.onAck(received);
+            } else if (type == CTRL_VIDEO_LOST) {
+                uint32_t seq;
+                if (m_conn.recv(MUX_CONTROL, &seq, 4) != 4) break;
+                std::lock_guard<std::mutex> lock(m_lostMutex);
+                m_lostVideo.push_back(seq);
             }
         }
         std::cout<<"Control loop ended\n";
@@ -699,7 +5935,7 @@ private:
     void webServerLoop() {
         while (m_running) {
             sockaddr_in cli;
-            int len = sizeof(cli);
+            socklen_t len = sizeof(cli);
             SOCKET client = accept(m_listenWeb, (sockaddr*)&cli, &len);
             if (client == INVALID_SOCKET) {
                 Sleep(10);
@@ -742,6 +5978,20 @@ private:
 
                 send(client, response.c_str(), response.length(), 0);
             }
+            else if (strncmp(buffer, "GET /stats ", 11) == 0) {
+                std::string body;
+                {
+                    std::lock_guard<std::mutex> lock(m_webMutex);
+                    body = FormatStatsCounters(m_statsSnapshot);
+                }
+                std::string response = "HTTP/1.1 200 OK\r\n";
+                response += "Content-Type: text/plain\r\n";
+                response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+                response += "Connection: close\r\n";
+                response += "\r\n";
+                response += body;
+                send(client, response.c_str(), response.length(), 0);
+            }
             else if (strncmp(buffer, "GET /stream HTTP/1.1", 21) == 0) {
                 std::string header = "HTTP/1.1 200 OK\r\n";
                 header += "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n";
@@ -750,23 +6000,25 @@ private:
                 send(client, header.c_str(), header.length(), 0);
 
                 while (m_running) {
+                    std::shared_ptr<const std::vector<BYTE>> frame;
                     {
                         std::lock_guard<std::mutex> lock(m_webMutex);
-                        if (!m_latestFrame.empty()) {
-                            std::string frameHeader = "--frame\r\n";
-                            frameHeader += "Content-Type: image/jpeg\r\n";
-                            frameHeader += "Content-Length: " + std::to_string(m_latestFrame.size()) + "\r\n";
-                            frameHeader += "\r\n";
-
-                            int sent = send(client, frameHeader.c_str(), frameHeader.length(), 0);
-                            if (sent == SOCKET_ERROR) break;
-
-                            sent = send(client, (const char*)m_latestFrame.data(), m_latestFrame.size(), 0);
-                            if (sent == SOCKET_ERROR) break;
-
-                            sent = send(client, "\r\n", 2, 0);
-                            if (sent == SOCKET_ERROR) break;
-                        }
+                        frame = m_latestFrame;
+                    }
+                    if (frame && !frame->empty()) {
+                        std::string frameHeader = "--frame\r\n";
+                        frameHeader += "Content-Type: image/jpeg\r\n";
+                        frameHeader += "Content-Length: " + std::to_string(frame->size()) + "\r\n";
+                        frameHeader += "\r\n";
+
+                        // part header, JPEG and trailer in one send
+                        WSABUF parts[3] = {
+                            { (ULONG)frameHeader.length(), (char*)frameHeader.c_str() },
+                            { (ULONG)frame->size(), (char*)frame->data() },
+                            { 2, (char*)"\r\n" },
+                        };
+                        int calls = 0;
+                        if (sendGather(client, parts, 3, calls) == SOCKET_ERROR) break;
                     }
                     Sleep(100);
                 }
@@ -781,26 +6033,29 @@ private:
     }
 };
 
+#ifdef _WIN32
 // ---------- client (receive + send control) ----------
 class Client {
 public:
-    Client(const std::string& ip, int portVideo=9632, int portControl=9633, int portAudio=9634) :
-        m_ip(ip), m_portVideo(portVideo), m_portControl(portControl), m_portAudio(portAudio),
-        m_sockVideo(INVALID_SOCKET), m_sockControl(INVALID_SOCKET), m_sockAudio(INVALID_SOCKET), m_running(false) {}
+    Client(const std::string& ip, int port=9632) :
+        m_ip(ip), m_port(port), m_running(false) {}
 
     bool start();
     void stop();
     void sendMouseMove(int x, int y);
     void sendMouseButton(uint8_t downOrUp, uint8_t button, int x, int y);
     void sendKey(uint8_t isDown, uint16_t vk);
+    void sendFrameAck(uint64_t bytesReceived);
+    void sendVideoLost(uint32_t seq);
     bool waitForWindow(int timeoutMs = 10000);
     HWND getWindowHandle();
     int getServerWidth() const { return m_serverWidth; }
     int getServerHeight() const { return m_serverHeight; }
 
 private:
-    std::string m_ip; int m_portVideo, m_portControl, m_portAudio;
-    SOCKET m_sockVideo, m_sockControl, m_sockAudio;
+    std::string m_ip; int m_port;
+    MuxConnection m_conn;           // input (UI thread) and acks (receive thread) send on MUX_CONTROL
+    UdpVideoReceiver m_udp;         // video, once the server sends MSG_UDP_SETUP
     std::atomic<bool> m_running;
     std::thread m_threadRecv;
     class ClientWindow* renderWnd = nullptr;
@@ -817,8 +6072,8 @@ public:
     AudioPlayback() : m_enumerator(nullptr), m_device(nullptr), m_client(nullptr), m_render(nullptr), m_running(false) {}
     ~AudioPlayback() { stop(); }
 
-    bool start(SOCKET audioSocket) {
-        m_audioSocket = audioSocket;
+    bool start(MuxConnection* conn) {
+        m_conn = conn;
         HRESULT hr = CoCreateInstance(__uuidof(MMDeviceEnumerator), NULL, CLSCTX_ALL,
             __uuidof(IMMDeviceEnumerator), (void**)&m_enumerator);
         if (FAILED(hr)) {
@@ -887,9 +6142,15 @@ private:
     IAudioRenderClient* m_render;
     std::atomic<bool> m_running;
     std::thread m_thread;
-    SOCKET m_audioSocket;
+    MuxConnection* m_conn = nullptr;
 
     void playbackLoop() {
+        play();
+        // audio that nobody plays must not hold up video
+        m_conn->closeChannel(MUX_AUDIO);
+    }
+
+    void play() {
         WAVEFORMATEX* pwfx = nullptr;
         HRESULT hr = m_client->GetMixFormat(&pwfx);
         if (FAILED(hr)) {
@@ -901,7 +6162,7 @@ private:
 
         while (m_running) {
             uint32_t size;
-            int r = recvAll(m_audioSocket, (char*)&size, 4);
+            int r = m_conn->recv(MUX_AUDIO, &size, 4);
             if (r != 4) {
                 std::cerr << "Audio recv failed\n";
                 break;
@@ -912,7 +6173,7 @@ private:
             }
 
             std::vector<BYTE> audioData(size);
-            r = recvAll(m_audioSocket, (char*)audioData.data(), size);
+            r = m_conn->recv(MUX_AUDIO, audioData.data(), size);
             if (r != (int)size) {
                 std::cerr << "Audio data recv failed\n";
                 break;
@@ -956,6 +6217,54 @@ private:
 // Forward declare ClientWindow for Client class
 class ClientWindow;
 
+// ---------- client tile cache ----------
+// Decoded pixels of tiles the server asked us to keep, indexed by the slot
+// ids it assigns (see TileCache)
+class ClientTileCache {
+public:
+    struct Entry { int w = 0, h = 0; std::vector<BYTE> pixels; };
+
+    void store(uint32_t slot, int w, int h, const BYTE* pixels) {
+        if (slot >= MAX_CACHE_SLOTS) return;
+        if (slot >= m_entries.size()) m_entries.resize(slot + 1);
+        Entry& e = m_entries[slot];
+        e.w = w; e.h = h;
+        e.pixels.assign(pixels, pixels + (size_t)w * h * 4);
+    }
+    const Entry* get(uint32_t slot) const {
+        if (slot >= m_entries.size() || m_entries[slot].pixels.empty()) return nullptr;
+        return &m_entries[slot];
+    }
+
+private:
+    std::vector<Entry> m_entries;
+};
+
+// JPEG tables by id from REC_JPEG_TABLES. Tile JPEGs arrive abbreviated
+// and are expanded into complete images before decoding.
+class ClientJpegTables {
+public:
+    // payload: id, tables-only JPEG
+    bool add(const BYTE* data, size_t size) {
+        if (size < 5 || data[1] != 0xFF || data[2] != 0xD8 || data[size - 2] != 0xFF || data[size - 1] != 0xD9) return false;
+        m_tables[data[0]].assign(data + 1, data + size - 2);   // SOI and the tables
+        return true;
+    }
+
+    // payload: id, abbreviated JPEG; false if its tables never came
+    bool expand(const BYTE* data, size_t size, std::vector<BYTE>& jpeg) const {
+        if (size < 3 || data[1] != 0xFF || data[2] != 0xD8) return false;
+        const std::vector<BYTE>& tables = m_tables[data[0]];
+        if (tables.empty()) return false;
+        jpeg.assign(tables.begin(), tables.end());
+        jpeg.insert(jpeg.end(), data + 3, data + size);
+        return true;
+    }
+
+private:
+    std::vector<BYTE> m_tables[256];
+};
+
 // ---------- client window ----------
 class ClientWindow {
 public:
@@ -1018,41 +6327,92 @@ public:
     }
     HWND getHWND() const { return hwnd; }
     void updateTile(int x, int y, HBITMAP tile) {
-        if (!dib || !tile || !dibPixels) return;
+        std::vector<BYTE> buf;
+        int tw = 0, th = 0;
+        if (!dib || !dibPixels || !ReadBitmapPixels(tile, buf, tw, th)) return;
+        drawPixels(x, y, tw, th, buf.data());
+    }
+    // Copies a top-down 32bpp block into the frame
+    void drawPixels(int x, int y, int tw, int th, const BYTE* pixels) {
+        if (!dib || !dibPixels || !pixels) return;
+        // rectangles may be any size; clip to the DIB
+        if (x < 0 || y < 0) return;
+        int cw = min(tw, width - x), ch = min(th, height - y);
+        if (cw <= 0 || ch <= 0) return;
+        for (int row=0; row<ch; ++row) {
+            memcpy((BYTE*)dibPixels + ((y+row) * width + x) * 4, pixels + row * tw * 4, cw * 4);
+        }
+        invalidateServerRect(x, y, cw, ch);
+    }
+    // Paints a solid rectangle (REC_FILL)
+    void fillRect(int x, int y, int w, int h, uint32_t color) {
+        if (!dib || !dibPixels || x < 0 || y < 0) return;
+        int cw = min(w, width - x), ch = min(h, height - y);
+        if (cw <= 0 || ch <= 0) return;
+        for (int row=0; row<ch; ++row) {
+            uint32_t* dst = (uint32_t*)dibPixels + (size_t)(y+row) * width + x;
+            for (int i=0; i<cw; ++i) dst[i] = color;
+        }
+        invalidateServerRect(x, y, cw, ch);
+    }
+    // Decodes a palette/RLE rectangle (REC_PALETTE)
+    bool drawPaletteRLE(int x, int y, int w, int h, const BYTE* data, size_t len) {
+        if (!dib || !dibPixels) return false;
+        paletteScratch.resize((size_t)w * h * 4);
+        if (!DecodePaletteRLE(data, len, w, h, paletteScratch.data(), w * 4)) return false;
+        drawPixels(x, y, w, h, paletteScratch.data());
+        return true;
+    }
+    // Reads an HBITMAP as top-down 32bpp pixels
+    static bool ReadBitmapPixels(HBITMAP tile, std::vector<BYTE>& buf, int& tw, int& th) {
+        if (!tile) return false;
         BITMAP tb; 
-        if (!GetObject(tile, sizeof(tb), &tb)) return;
-        int tw = tb.bmWidth, th = tb.bmHeight;
+        if (!GetObject(tile, sizeof(tb), &tb)) return false;
+        tw = tb.bmWidth; th = tb.bmHeight;
 
         BITMAPINFO bi{}; bi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
         bi.bmiHeader.biWidth = tw; bi.bmiHeader.biHeight = -th; bi.bmiHeader.biPlanes = 1; bi.bmiHeader.biBitCount = 32; bi.bmiHeader.biCompression = BI_RGB;
-        std::vector<BYTE> buf(tw * th * 4);
+        buf.resize(tw * th * 4);
         HDC dc = GetDC(NULL);
-        if (!dc) return;
+        if (!dc) return false;
         HDC mdc = CreateCompatibleDC(dc);
         if (!mdc) {
             ReleaseDC(NULL, dc);
-            return;
+            return false;
         }
         HGDIOBJ old = SelectObject(mdc, tile);
         if (old == HGDI_ERROR) {
             DeleteDC(mdc);
             ReleaseDC(NULL, dc);
-            return;
+            return false;
         }
-        GetDIBits(mdc, tile, 0, th, buf.data(), &bi, DIB_RGB_COLORS);
+        int lines = GetDIBits(mdc, tile, 0, th, buf.data(), &bi, DIB_RGB_COLORS);
         SelectObject(mdc, old);
         DeleteDC(mdc); 
         ReleaseDC(NULL, dc);
-
-        for (int row=0; row<th && (y+row)<height; ++row) {
-            if (x + tw <= width) {
-                memcpy((BYTE*)dibPixels + ((y+row) * width + x) * 4, buf.data() + row * tw * 4, tw * 4);
-            }
-        }
-        InvalidateRect(hwnd, NULL, FALSE);
+        return lines != 0;
+    }
+    // Moves a block of the frame (scrolling); applied before new tiles
+    void copyRect(int sx, int sy, int dx, int dy, int w, int h) {
+        if (!dib || !dibPixels) return;
+        if (sx < 0 || sy < 0 || dx < 0 || dy < 0 || sx + w > width || sy + h > height || dx + w > width || dy + h > height) return;
+        CopyRectInBuffer((BYTE*)dibPixels, width * 4, sx, sy, dx, dy, w, h);
+        invalidateServerRect(dx, dy, w, h);
+    }
+    // Repaints only the window area showing a server-space rectangle
+    void invalidateServerRect(int x, int y, int w, int h) {
+        RECT rc;
+        if (!hwnd || !GetClientRect(hwnd, &rc) || width <= 0 || height <= 0) return;
+        RECT dirty;
+        dirty.left = x * rc.right / width;
+        dirty.top = y * rc.bottom / height;
+        dirty.right = ((x + w) * rc.right + width - 1) / width + 1;
+        dirty.bottom = ((y + h) * rc.bottom + height - 1) / height + 1;
+        InvalidateRect(hwnd, &dirty, FALSE);
     }
 private:
     HWND hwnd; HBITMAP dib; void* dibPixels; int width, height;
+    std::vector<BYTE> paletteScratch;
     void* clientPtr;
 
     static LRESULT CALLBACK WndProcStatic(HWND hWnd, UINT msg, WPARAM wp, LPARAM lp) {
@@ -1150,48 +6510,37 @@ private:
 bool Client::start() {
     WSADATA w; if (WSAStartup(MAKEWORD(2,2), &w) != 0) return false;
 
-    m_sockVideo = socket(AF_INET, SOCK_STREAM, 0);
-    if (m_sockVideo == INVALID_SOCKET) return false;
-    sockaddr_in srv{}; srv.sin_family = AF_INET; srv.sin_port = htons(m_portVideo);
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return false;
+    sockaddr_in srv{}; srv.sin_family = AF_INET; srv.sin_port = htons(m_port);
     InetPton(AF_INET, m_ip.c_str(), &srv.sin_addr);
-    if (connect(m_sockVideo, (sockaddr*)&srv, sizeof(srv)) == SOCKET_ERROR) { closesocket(m_sockVideo); return false; }
+    if (connect(sock, (sockaddr*)&srv, sizeof(srv)) == SOCKET_ERROR) { closesocket(sock); return false; }
 
-    m_sockControl = socket(AF_INET, SOCK_STREAM, 0);
-    if (m_sockControl == INVALID_SOCKET) { closesocket(m_sockVideo); return false; }
-    srv.sin_port = htons(m_portControl);
-    if (connect(m_sockControl, (sockaddr*)&srv, sizeof(srv)) == SOCKET_ERROR) { closesocket(m_sockVideo); closesocket(m_sockControl); return false; }
-
-    m_sockAudio = socket(AF_INET, SOCK_STREAM, 0);
-    if (m_sockAudio == INVALID_SOCKET) { closesocket(m_sockVideo); closesocket(m_sockControl); return false; }
-    srv.sin_port = htons(m_portAudio);
-    if (connect(m_sockAudio, (sockaddr*)&srv, sizeof(srv)) == SOCKET_ERROR) { closesocket(m_sockVideo); closesocket(m_sockControl); closesocket(m_sockAudio); return false; }
-
-    DWORD tout = 5000;
-    setsockopt(m_sockVideo, SOL_SOCKET, SO_RCVTIMEO, (char*)&tout, sizeof(tout));
-    setsockopt(m_sockControl, SOL_SOCKET, SO_SNDTIMEO, (char*)&tout, sizeof(tout));
-    setsockopt(m_sockAudio, SOL_SOCKET, SO_RCVTIMEO, (char*)&tout, sizeof(tout));
+    SetSendTimeout(sock, 5000);
+    if (!m_conn.start(sock)) { closesocket(sock); return false; }
 
     m_running = true;
     m_threadRecv = std::thread(&Client::recvLoop, this);
 
     // Start audio playback
     m_audioPlayback = new AudioPlayback();
-    m_audioPlayback->start(m_sockAudio);
+    if (!m_audioPlayback->start(&m_conn)) m_conn.closeChannel(MUX_AUDIO);
 
     return true;
 }
 
 void Client::stop() {
     m_running = false;
+    m_conn.stop();
+    m_udp.stop();
     if (m_audioPlayback) {
         m_audioPlayback->stop();
         delete m_audioPlayback;
         m_audioPlayback = nullptr;
     }
     if (m_threadRecv.joinable()) m_threadRecv.join();
-    if (m_sockVideo != INVALID_SOCKET) closesocket(m_sockVideo);
-    if (m_sockControl != INVALID_SOCKET) closesocket(m_sockControl);
-    if (m_sockAudio != INVALID_SOCKET) closesocket(m_sockAudio);
+    m_udp.stop();
+    m_conn.close();
     if (renderWnd) {
         renderWnd->destroy();
         delete renderWnd;
@@ -1201,23 +6550,39 @@ void Client::stop() {
 }
 
 void Client::sendMouseMove(int x, int y) {
-    if (m_sockControl == INVALID_SOCKET) return;
+    if (!m_conn.connected()) return;
     uint8_t t = 1;
     char buf[1+8]; buf[0]=(char)t; memcpy(buf+1,&x,4); memcpy(buf+5,&y,4);
-    sendAll(m_sockControl, buf, sizeof(buf));
+    m_conn.send(MUX_CONTROL, buf, sizeof(buf));
 }
 
 void Client::sendMouseButton(uint8_t downOrUp, uint8_t button, int x, int y) {
-    if (m_sockControl == INVALID_SOCKET) return;
+    if (!m_conn.connected()) return;
     uint8_t t = downOrUp;
     char buf[1+1+8]; buf[0]=(char)t; buf[1]=(char)button; memcpy(buf+2,&x,4); memcpy(buf+6,&y,4);
-    sendAll(m_sockControl, buf, sizeof(buf));
+    m_conn.send(MUX_CONTROL, buf, sizeof(buf));
 }
 
 void Client::sendKey(uint8_t isDown, uint16_t vk) {
-    if (m_sockControl == INVALID_SOCKET) return;
+    if (!m_conn.connected()) return;
     char buf[1+1+2]; buf[0]=4; buf[1]=isDown; memcpy(buf+2,&vk,2);
-    sendAll(m_sockControl, buf, sizeof(buf));
+    m_conn.send(MUX_CONTROL, buf, sizeof(buf));
+}
+
+// Tells the server how much video has been processed; its rate
+// controller derives round trip time and throughput from these
+void Client::sendFrameAck(uint64_t bytesReceived) {
+    if (!m_conn.connected()) return;
+    char buf[1+8]; buf[0]=(char)CTRL_FRAME_ACK; memcpy(buf+1,&bytesReceived,8);
+    m_conn.send(MUX_CONTROL, buf, sizeof(buf));
+}
+
+// Reports a UDP video message the receiver gave up on; the server
+// resends the tiles it carried
+void Client::sendVideoLost(uint32_t seq) {
+    if (!m_conn.connected()) return;
+    char buf[1+4]; buf[0]=(char)CTRL_VIDEO_LOST; memcpy(buf+1,&seq,4);
+    m_conn.send(MUX_CONTROL, buf, sizeof(buf));
 }
 
 bool Client::waitForWindow(int timeoutMs) {
@@ -1242,28 +6607,70 @@ void Client::recvLoop() {
     }
 
     renderWnd = new ClientWindow();
+    ClientTileCache tileCache;
+    ClientJpegTables jpegTables;
+    std::vector<BYTE> decoded, jpeg;
+    // abbreviated tile JPEG -> bitmap
+    auto decodeJpeg = [&](const BYTE* data, size_t size) -> HBITMAP {
+        return jpegTables.expand(data, size, jpeg) ? DecodeJPEGBytesToHBITMAP(jpeg.data(), jpeg.size()) : NULL;
+    };
+    uint64_t received = 0;      // video bytes, acknowledged after each frame
+    VideoDecoder videoDecoder;
+    std::vector<BYTE> message;
+    bool udpVideo = false;
 
     while (m_running) {
-        uint32_t magic = 0;
-        int r = recvAll(m_sockVideo, (char*)&magic, 4);
-        if (r != 4) {
-            if (r == SOCKET_ERROR) {
-                std::cerr << "Socket error while receiving magic\n";
-            } else {
+        WireHeader msg;
+        if (udpVideo) {
+            UdpDelivery d;
+            if (!m_udp.next(d)) break;
+            if (d.lost) {
+                sendVideoLost(d.seq);
+                if (d.endOffset) {
+                    received = d.endOffset;
+                    sendFrameAck(received);
+                }
+                continue;
+            }
+            if (d.message.size() < WIRE_HEADER_BYTES || !ParseWireHeader(d.message.data(), msg) ||
+                !WireHeaderReadable(msg) || msg.bodySize != d.message.size() - WIRE_HEADER_BYTES) {
+                std::cerr << "Invalid UDP message\n";
+                continue;
+            }
+            message.assign(d.message.begin() + WIRE_HEADER_BYTES, d.message.end());
+            // UDP stream offsets count only what went over UDP, as the server's rate controller does
+            received = d.endOffset;
+        } else {
+            BYTE header[WIRE_HEADER_BYTES];
+            int r = m_conn.recv(MUX_VIDEO, header, (int)WIRE_HEADER_BYTES);
+            if (r != (int)WIRE_HEADER_BYTES) {
                 std::cerr << "Connection closed by server\n";
+                break;
             }
-            break;
+            if (!ParseWireHeader(header, msg)) { std::cerr<<"Bad magic\n"; break; }
+            if (!WireHeaderReadable(msg)) {
+                std::cerr << "Unsupported message: protocol version " << (int)msg.version << ", " << msg.bodySize << " bytes\n";
+                break;
+            }
+            message.resize(msg.bodySize);
+            if (msg.bodySize > 0 && m_conn.recv(MUX_VIDEO, message.data(), (int)msg.bodySize) != (int)msg.bodySize) break;
+            if (msg.type == MSG_UDP_SETUP) {
+                if (msg.bodySize < 4) { std::cerr << "Invalid UDP setup\n"; break; }
+                sockaddr_in srv{}; srv.sin_family = AF_INET; srv.sin_port = htons(m_port);
+                InetPton(AF_INET, m_ip.c_str(), &srv.sin_addr);
+                if (!m_udp.start(srv, GetLE32(message.data()))) { std::cerr << "Cannot open UDP socket\n"; break; }
+                m_conn.closeChannel(MUX_VIDEO);
+                udpVideo = true;
+                continue;
+            }
+            received += WIRE_HEADER_BYTES + msg.bodySize;
         }
-        if (magic != 0x49535332) { std::cerr<<"Bad magic\n"; break; }
-
-        uint32_t w,h,tW,tH,count;
-        if (recvAll(m_sockVideo, (char*)&w,4) != 4) break;
-        if (recvAll(m_sockVideo, (char*)&h,4) != 4) break;
-        if (recvAll(m_sockVideo, (char*)&tW,4) != 4) break;
-        if (recvAll(m_sockVideo, (char*)&tH,4) != 4) break;
-        if (recvAll(m_sockVideo, (char*)&count,4) != 4) break;
+        // newer message types are skipped
+        if (msg.type != MSG_FRAME) continue;
 
-        if (w > 10000 || h > 10000 || tW > 1000 || tH > 1000 || count > 10000) {
+        FrameReader reader(message.data(), message.size());
+        uint32_t w,h,tW,tH;
+        if (!reader.geometry(w, h, tW, tH) || w > 10000 || h > 10000 || tW > 1000 || tH > 1000) {
             std::cerr << "Invalid frame data\n";
             break;
         }
@@ -1278,29 +6685,99 @@ void Client::recvLoop() {
             }
         }
 
-        for (uint32_t i=0; i<count && m_running; ++i) {
-            uint32_t tx,ty,tw,th,sz;
-            if (recvAll(m_sockVideo, (char*)&tx,4) != 4) break;
-            if (recvAll(m_sockVideo, (char*)&ty,4) != 4) break;
-            if (recvAll(m_sockVideo, (char*)&tw,4) != 4) break;
-            if (recvAll(m_sockVideo, (char*)&th,4) != 4) break;
-            if (recvAll(m_sockVideo, (char*)&sz,4) != 4) break;
+        WireRecord rec;
+        for (uint32_t i=0; i<msg.count && m_running; ++i) {
+            if (!reader.next(rec)) {
+                std::cerr << "Invalid record\n";
+                break;
+            }
+            uint32_t type = rec.type, tx = rec.x, ty = rec.y, tw = rec.w, th = rec.h, sz = rec.size;
+            const BYTE* data = rec.data;
+            if (sz == 0) {
+                std::cerr << "Invalid tile size\n";
+                continue;
+            }
 
-            if (tx > w || ty > h || tw > tW || th > tH || sz == 0 || sz > 100*1024*1024) {
+            if (tx > w || ty > h || tw > w || th > h || tx + tw > w || ty + th > h) {
                 std::cerr << "Invalid tile data\n";
                 continue;
             }
 
-            std::vector<BYTE> data(sz);
-            if (recvAll(m_sockVideo, (char*)data.data(), (int)sz) != (int)sz) break;
-
-            HBITMAP tile = DecodeJPEGBytesToHBITMAP(data.data(), data.size());
-            if (tile) {
-                renderWnd->updateTile((int)tx, (int)ty, tile);
-                DeleteObject(tile);
+            if (type == REC_COPY) {
+                if (sz != 8) { std::cerr << "Invalid copy record\n"; continue; }
+                uint32_t sx = GetLE32(data), sy = GetLE32(data + 4);
+                if (sx > w || sy > h || sx + tw > w || sy + th > h) { std::cerr << "Invalid copy source\n"; continue; }
+                renderWnd->copyRect((int)sx, (int)sy, (int)tx, (int)ty, (int)tw, (int)th);
+            } else if (type == REC_JPEG) {
+                HBITMAP tile = decodeJpeg(data, sz);
+                if (tile) {
+                    renderWnd->updateTile((int)tx, (int)ty, tile);
+                    DeleteObject(tile);
+                }
+            } else if (type == REC_JPEG_STORE) {
+                if (tw > tW || th > tH || sz <= 4) { std::cerr << "Invalid cached tile\n"; continue; }
+                uint32_t slot = GetLE32(data);
+                HBITMAP tile = decodeJpeg(data + 4, sz - 4);
+                std::vector<BYTE> pixels;
+                int pw = 0, ph = 0;
+                if (tile && ClientWindow::ReadBitmapPixels(tile, pixels, pw, ph)) {
+                    renderWnd->drawPixels((int)tx, (int)ty, pw, ph, pixels.data());
+                    tileCache.store(slot, pw, ph, pixels.data());
+                }
+                if (tile) DeleteObject(tile);
+            } else if (type == REC_CACHE_REF) {
+                if (sz != 4) { std::cerr << "Invalid cache reference\n"; continue; }
+                uint32_t slot = GetLE32(data);
+                const ClientTileCache::Entry* e = tileCache.get(slot);
+                if (!e || e->w != (int)tw || e->h != (int)th) { std::cerr << "Missing cached tile " << slot << "\n"; continue; }
+                renderWnd->drawPixels((int)tx, (int)ty, e->w, e->h, e->pixels.data());
+            } else if (type == REC_FILL) {
+                if (sz != 4) { std::cerr << "Invalid fill record\n"; continue; }
+                uint32_t color = GetLE32(data);
+                renderWnd->fillRect((int)tx, (int)ty, (int)tw, (int)th, color);
+            } else if (type == REC_PALETTE) {
+                if (!renderWnd->drawPaletteRLE((int)tx, (int)ty, (int)tw, (int)th, data, sz)) {
+                    std::cerr << "Invalid palette tile\n";
+                }
+            } else if (type == REC_LOSSLESS || type == REC_LOSSLESS_STORE) {
+                bool store = type == REC_LOSSLESS_STORE;
+                uint32_t slot = 0;
+                if (tw == 0 || th == 0 || (store && (tw > tW || th > tH || sz <= 4))) { std::cerr << "Invalid lossless tile\n"; continue; }
+                if (store) slot = GetLE32(data);
+                size_t skip = store ? 4 : 0;
+                decoded.resize((size_t)tw * th * 4);
+                if (!DecodeLossless(data + skip, sz - skip, (int)tw, (int)th, decoded.data(), (int)tw * 4)) {
+                    std::cerr << "Invalid lossless tile\n";
+                    continue;
+                }
+                renderWnd->drawPixels((int)tx, (int)ty, (int)tw, (int)th, decoded.data());
+                if (store) tileCache.store(slot, (int)tw, (int)th, decoded.data());
+            } else if (type == REC_JPEG_HALF) {
+                HBITMAP tile = decodeJpeg(data, sz);
+                std::vector<BYTE> pixels;
+                int pw = 0, ph = 0;
+                if (tile && ClientWindow::ReadBitmapPixels(tile, pixels, pw, ph) && pw == (int)(tw + 1) / 2 && ph == (int)(th + 1) / 2) {
+                    decoded.resize((size_t)tw * th * 4);
+                    Upscale2x(pixels.data(), pw, ph, decoded.data(), (int)tw, (int)th);
+                    renderWnd->drawPixels((int)tx, (int)ty, (int)tw, (int)th, decoded.data());
+                }
+                if (tile) DeleteObject(tile);
+            } else if (type == REC_JPEG_TABLES) {
+                if (!jpegTables.add(data, sz)) std::cerr << "Invalid JPEG tables\n";
+            } else if (type == REC_VIDEO) {
+                if (tw == 0 || th == 0) { std::cerr << "Invalid video frame\n"; continue; }
+                decoded.resize((size_t)tw * th * 4);
+                if (!videoDecoder.decode(data, sz, (int)tw, (int)th, decoded.data(), (int)tw * 4)) {
+                    std::cerr << "Invalid video frame\n";
+                    continue;
+                }
+                renderWnd->drawPixels((int)tx, (int)ty, (int)tw, (int)th, decoded.data());
             }
         }
+        if (msg.flags & MSG_FLAG_END_OF_FRAME) sendFrameAck(received);
     }
+    // video that nobody draws must not hold up audio
+    m_conn.closeChannel(MUX_VIDEO);
 
     if (token) GdiplusShutdown(token);
     if (renderWnd) {
@@ -1308,12 +6785,825 @@ void Client::recvLoop() {
         renderWnd = nullptr;
     }
 }
+#endif
+
+// ---------- traffic shaper ----------
+// Test proxy that makes local connections behave like a slow link, for
+// exercising rate control. Each direction of a proxied connection goes
+// through a bottleneck of the given bit rate followed by a fixed one-way
+// delay. The bottleneck queue is bounded. While it is full the proxy
+// stops reading, so the sender sees backpressure as on a congested path.
+// Datagrams to the same ports are relayed too, but a full queue drops
+// them instead, and --loss drops a share of them at random.
+struct ShaperConfig {
+    int kbps = 2000;
+    int delayMs = 50;
+    size_t queueBytes = 256 * 1024;
+    double lossPercent = 0;         // UDP only
+};
+
+// One direction of a proxied connection
+class ShapedPipe {
+public:
+    ShapedPipe(SOCKET from, SOCKET to, const ShaperConfig& cfg) : m_from(from), m_to(to), m_cfg(cfg) {}
+
+    // Forwards until the source closes or the destination fails
+    void run() {
+        std::thread writer(&ShapedPipe::writeLoop, this);
+        readLoop();
+        writer.join();
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    struct Chunk { Clock::time_point due; std::vector<char> data; };
+
+    SOCKET m_from, m_to;
+    ShaperConfig m_cfg;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Chunk> m_queue;
+    Clock::time_point m_linkFree;   // when the bottleneck finishes what it has
+    bool m_eof = false, m_failed = false;
+
+    void readLoop() {
+        // small reads keep the pacing smooth at low rates
+        std::vector<char> buf(4096);
+        auto maxBacklog = std::chrono::microseconds((int64_t)m_cfg.queueBytes * 8000 / m_cfg.kbps);
+        m_linkFree = Clock::now();
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (!m_failed && m_linkFree - Clock::now() > maxBacklog) m_cv.wait_until(lock, m_linkFree - maxBacklog);
+                if (m_failed) break;
+            }
+            int r = recv(m_from, buf.data(), (int)buf.size(), 0);
+            if (r <= 0) break;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Clock::time_point now = Clock::now();
+            if (m_linkFree < now) m_linkFree = now;
+            m_linkFree += std::chrono::microseconds((int64_t)r * 8000 / m_cfg.kbps);
+            m_queue.push_back({ m_linkFree + std::chrono::milliseconds(m_cfg.delayMs), std::vector<char>(buf.begin(), buf.begin() + r) });
+            m_cv.notify_all();
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_eof = true;
+        m_cv.notify_all();
+    }
+
+    void writeLoop() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;) {
+            if (m_queue.empty()) {
+                if (m_eof) break;
+                m_cv.wait(lock);
+                continue;
+            }
+            Clock::time_point due = m_queue.front().due;
+            if (Clock::now() < due) {
+                m_cv.wait_until(lock, due);
+                continue;
+            }
+            Chunk chunk = std::move(m_queue.front());
+            m_queue.pop_front();
+            lock.unlock();
+            bool ok = sendAll(m_to, chunk.data.data(), (int)chunk.data.size()) == (int)chunk.data.size();
+            lock.lock();
+            if (!ok) {
+                m_failed = true;
+                m_cv.notify_all();
+                // unblocks the reader's recv
+                shutdown(m_from, SD_BOTH);
+                break;
+            }
+        }
+        shutdown(m_to, SD_SEND);
+    }
+};
+
+// Proxies one accepted connection to target until both directions end
+void ShapeConnection(SOCKET client, sockaddr_in target, ShaperConfig cfg) {
+    SOCKET server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server == INVALID_SOCKET || connect(server, (sockaddr*)&target, sizeof(target)) == SOCKET_ERROR) {
+        std::cerr << "shaper: cannot connect to port " << ntohs(target.sin_port) << "\n";
+        if (server != INVALID_SOCKET) closesocket(server);
+        closesocket(client);
+        return;
+    }
+    // a large receive buffer in the proxy would hide the bottleneck queue
+    int bufSize = 16 * 1024, noDelay = 1;
+    SOCKET both[2] = { client, server };
+    for (SOCKET s : both) {
+        setsockopt(s, SOL_SOCKET, SO_RCVBUF, (char*)&bufSize, sizeof(bufSize));
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+    }
+    ShapedPipe up(client, server, cfg), down(server, client, cfg);
+    std::thread upThread(&ShapedPipe::run, &up);
+    down.run();
+    upThread.join();
+    closesocket(server);
+    closesocket(client);
+}
+
+// One direction of relayed UDP traffic: same bottleneck and delay as
+// ShapedPipe, with tail drop and random loss in place of backpressure
+class ShapedDatagrams {
+public:
+    ShapedDatagrams(const ShaperConfig& cfg, std::function<void(const char*, int)> out) :
+        m_cfg(cfg), m_out(out), m_random(std::random_device()()) {}
+
+    void push(const char* data, int size) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (std::uniform_real_distribution<double>(0, 100)(m_random) < m_cfg.lossPercent) { m_lost++; return; }
+        Clock::time_point now = Clock::now();
+        if (m_linkFree < now) m_linkFree = now;
+        auto maxBacklog = std::chrono::microseconds((int64_t)m_cfg.queueBytes * 8000 / m_cfg.kbps);
+        if (m_linkFree - now > maxBacklog) { m_dropped++; return; }
+        m_linkFree += std::chrono::microseconds((int64_t)size * 8000 / m_cfg.kbps);
+        m_queue.push_back({ m_linkFree + std::chrono::milliseconds(m_cfg.delayMs), std::vector<char>(data, data + size) });
+        m_cv.notify_all();
+    }
+
+    // Delivers datagrams as they come due; never returns
+    void run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;) {
+            if (m_queue.empty()) {
+                m_cv.wait(lock);
+                continue;
+            }
+            Clock::time_point due = m_queue.front().due;
+            if (Clock::now() < due) {
+                m_cv.wait_until(lock, due);
+                continue;
+            }
+            std::vector<char> data = std::move(m_queue.front().data);
+            m_queue.pop_front();
+            lock.unlock();
+            m_out(data.data(), (int)data.size());
+            lock.lock();
+        }
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    struct Datagram { Clock::time_point due; std::vector<char> data; };
+
+    ShaperConfig m_cfg;
+    std::function<void(const char*, int)> m_out;
+    std::minstd_rand m_random;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Datagram> m_queue;
+    Clock::time_point m_linkFree;
+    uint64_t m_lost = 0, m_dropped = 0;
+};
+
+// Relays datagrams between the UDP port ls is bound to and target. Replies
+// go to whoever sent to ls last, which is enough for one client.
+void ShapeDatagrams(SOCKET ls, sockaddr_in target, ShaperConfig cfg) {
+    SOCKET server = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (server == INVALID_SOCKET || connect(server, (sockaddr*)&target, sizeof(target)) == SOCKET_ERROR) {
+        std::cerr << "shaper: cannot open UDP socket to port " << ntohs(target.sin_port) << "\n";
+        if (server != INVALID_SOCKET) closesocket(server);
+        return;
+    }
+    IgnoreUdpConnReset(ls);
+    IgnoreUdpConnReset(server);
+    std::mutex peerMutex;
+    sockaddr_in peer{};
+    bool havePeer = false;
+    ShapedDatagrams up(cfg, [server](const char* data, int size) { ::send(server, data, size, 0); });
+    ShapedDatagrams down(cfg, [&](const char* data, int size) {
+        sockaddr_in to;
+        {
+            std::lock_guard<std::mutex> lock(peerMutex);
+            if (!havePeer) return;
+            to = peer;
+        }
+        sendto(ls, data, size, 0, (sockaddr*)&to, sizeof(to));
+    });
+    std::thread(&ShapedDatagrams::run, &up).detach();
+    std::thread(&ShapedDatagrams::run, &down).detach();
+    std::thread([server, &down] {
+        std::vector<char> buf(65536);
+        for (;;) {
+            int r = recv(server, buf.data(), (int)buf.size(), 0);
+            if (r > 0) down.push(buf.data(), r);
+        }
+    }).detach();
+    std::vector<char> buf(65536);
+    for (;;) {
+        sockaddr_in from{};
+        socklen_t fromLen = sizeof(from);
+        int r = recvfrom(ls, buf.data(), (int)buf.size(), 0, (sockaddr*)&from, &fromLen);
+        if (r <= 0) continue;
+        {
+            std::lock_guard<std::mutex> lock(peerMutex);
+            peer = from;
+            havePeer = true;
+        }
+        up.push(buf.data(), r);
+    }
+}
 
 void printUsage() {
     std::cout << "Usage:\n";
-    std::cout << "  Server mode: mytry.exe server [video_port] [control_port] [web_port] [audio_port]\n";
-    std::cout << "  Client mode: mytry.exe client <server_ip> [video_port] [control_port] [audio_port]\n";
+    std::cout << "  Server mode: mytry.exe server [port] [web_port]\n";
+    std::cout << "  Client mode: mytry.exe client <server_ip> [port]\n";
     std::cout << "  Interactive mode: mytry.exe (no arguments)\n";
+    std::cout << "  Record capture:   mytry.exe record <file> [frames]\n";
+    std::cout << "  Benchmark:        mytry.exe bench pipeline <source> [frames] [server options]\n";
+    std::cout << "                    mytry.exe bench encode [source] [frames] [server options]\n";
+    std::cout << "                    mytry.exe bench jpeg [iterations]\n";
+    std::cout << "                    mytry.exe bench hash [iterations]\n";
+    std::cout << "                    mytry.exe bench color [iterations]\n";
+    std::cout << "                    mytry.exe bench diff [iterations]\n";
+    std::cout << "                    mytry.exe bench wire [iterations]\n";
+    std::cout << "                    mytry.exe bench send [frames]\n";
+    std::cout << "  Link emulation:   mytry.exe shaper <kbps> <delay_ms> <listen_port>:<host>:<port>... [--queue=<KB>] [--loss=<UDP %>]\n";
+    std::cout << "Server options: --source=gdi|synthetic:<scroll|video|drag|typing|ide>[:WxH]|replay:<file>\n";
+    std::cout << "                --diff=hash|compare --refine=32|64|off --motion=on|off --merge=on|off\n";
+    std::cout << "                --tile-cache=<slots> --encode-cache=<MB> --encode-threads=<n, 0 = per core>\n";
+    std::cout << "                --draft-quality=<1-89, 0 = off> --upgrade-tiles=<per frame>\n";
+    std::cout << "                --rate-control=on|off --latency-target=<ms> --frame-budget=<KB, 0 = auto>\n";
+    std::cout << "                --frame-window=<unacknowledged frames, 0 = off; with or without rate control>\n";
+    std::cout << "                --video=off|auto|full --framing=stream|batch --transport=tcp|udp\n";
+}
+
+void printPipelineStats(const PipelineStats& st, double seconds) {
+    double frames = (double)(st.frames ? st.frames : 1);
+    std::cout << "frames:        " << st.frames << " (" << st.framesSent << " with changes)\n";
+    std::cout << "fps:           " << (seconds > 0 ? st.frames / seconds : 0) << "\n";
+    std::cout << "bytes/frame:   " << st.bytesSent / frames << ", " << st.sendCalls / frames << " sends of "
+              << (st.sendCalls ? (double)st.sendBuffers / st.sendCalls : 0.0) << " buffers\n";
+    std::cout << "tiles/frame:   " << st.tilesSent / frames << "\n";
+    std::cout << "copies/frame:  " << st.copiesSent / frames << "\n";
+    std::cout << "fills/frame:   " << st.fillsSent / frames << ", palette tiles/frame " << st.palettesSent / frames
+              << ", lossless tiles/frame " << st.losslessSent / frames << "\n";
+    std::cout << "drafts/frame:  " << st.draftsSent / frames << ", upgrades/frame " << st.upgradesSent / frames << "\n";
+    std::cout << "merged/frame:  " << st.rectsMerged / frames << " rects\n";
+    std::cout << "budget:        " << st.framesBudgeted << " frames budgeted, " << st.framesOverBudget << " over, "
+              << st.budgetLoweredTiles / frames << " tiles/frame lowered, max frame " << st.maxFrameBytes << " bytes\n";
+    if (st.videoFrames) {
+        std::cout << "video:         " << st.videoFrames << " frames (" << st.videoKeyframes << " keyframes), "
+                  << st.videoBytes / (double)st.videoFrames << " bytes/video frame\n";
+    }
+    uint64_t lookups = st.cacheHits + st.cacheMisses;
+    std::cout << "cache hits:    " << st.cacheHits << "/" << lookups << " (" << (lookups ? 100.0 * st.cacheHits / lookups : 0.0) << "%)\n";
+    uint64_t encodeLookups = st.encodeCacheHits + st.encodeCacheMisses;
+    std::cout << "encode reuse:  " << st.encodeCacheHits << "/" << encodeLookups << " ("
+              << (encodeLookups ? 100.0 * st.encodeCacheHits / encodeLookups : 0.0) << "%)\n";
+    std::cout << "ms/frame:      capture " << st.captureMs / frames << ", diff " << st.diffMs / frames
+              << ", encode " << st.encodeMs / frames << ", send " << st.sendMs / frames << "\n";
+    double sent = (double)(st.framesSent ? st.framesSent : 1);
+    std::cout << "latency:       first record " << st.firstRecordMs / sent << " ms, whole frame " << st.frameSentMs / sent
+              << " ms after capture start\n";
+}
+
+// Old additive per-tile checksum, kept as the baseline for "bench hash"
+uint32_t AdditiveChecksum(const BYTE* pixels, int stride, int w, int h) {
+    uint32_t csum = 0;
+    for (int y=0; y<h; ++y) {
+        const uint32_t* row = (const uint32_t*)(pixels + (size_t)y * stride);
+        for (int x=0; x<w; ++x) csum += row[x];
+    }
+    return csum;
+}
+
+// Milliseconds per call of fn averaged over iterations
+template <class F> double BenchMs(int iterations, F fn) {
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i=0; i<iterations; ++i) fn();
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count() / iterations;
+}
+
+// Hashes every 256x256 tile of a 4K frame with each available variant
+int benchHash(int iterations) {
+    const int W = 3840, H = 2160, T = 256;
+    SyntheticFrameSource src("scroll", W, H);
+    int w = 0, h = 0;
+    if (!src.open(w, h)) return 1;
+    std::vector<BYTE> frame((size_t)W * H * 4);
+    src.grab(frame.data());
+
+    volatile uint64_t sink = 0;
+    auto perFrame = [&](const char* name, auto tileFn) {
+        double ms = BenchMs(iterations, [&] {
+            uint64_t acc = 0;
+            for (int ty=0; ty<H; ty+=T)
+                for (int tx=0; tx<W; tx+=T)
+                    acc += tileFn(frame.data() + ((size_t)ty * W + tx) * 4, W * 4, min(T, W - tx), min(T, H - ty));
+            sink = sink + acc;
+        });
+        std::cout << name << ms << " ms/frame\n";
+    };
+    perFrame("additive sum:  ", AdditiveChecksum);
+    perFrame("hash scalar:   ", HashTileScalar);
+#ifdef ISS_X86
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.sse2) perFrame("hash sse2:     ", HashTileSSE2);
+    if (cpu.avx2) perFrame("hash avx2:     ", HashTileAVX2);
+#endif
+
+    // Swapping two different pixels of the first tile keeps the additive
+    // sum but must change the hash
+    std::vector<BYTE> swapped(frame);
+    uint32_t* px = (uint32_t*)swapped.data();
+    size_t other = 0;
+    for (int y=0; y<T && !other; ++y)
+        for (int x=0; x<T && !other; ++x)
+            if (px[(size_t)y * W + x] != px[0]) other = (size_t)y * W + x;
+    if (!other) { std::cerr << "first tile is one color\n"; return 1; }
+    std::swap(px[0], px[other]);
+    bool sumSees = AdditiveChecksum(frame.data(), W * 4, T, T) != AdditiveChecksum(swapped.data(), W * 4, T, T);
+    bool hashSees = HashTile(frame.data(), W * 4, T, T) != HashTile(swapped.data(), W * 4, T, T);
+    std::cout << "pixel swap:    additive " << (sumSees ? "detected" : "MISSED") << ", hash " << (hashSees ? "detected" : "MISSED") << "\n";
+    return hashSees ? 0 : 1;
+}
+
+// BGRX -> YCbCr of every 256x256 tile of a 4K frame with each available
+// variant, checked byte for byte against the scalar one
+int benchColor(int iterations) {
+    const int W = 3840, H = 2160, T = 256;
+    SyntheticFrameSource src("video", W, H);
+    int w = 0, h = 0;
+    if (!src.open(w, h)) return 1;
+    std::vector<BYTE> frame((size_t)W * H * 4);
+    src.grab(frame.data());
+
+    // each tile lands at its place in full-frame planes
+    std::vector<BYTE> ref[2][3], out[3];
+    bool allMatch = true;
+    double scalarMs[2] = { 0, 0 };
+    auto perFrame = [&](const char* name, bool sub, YuvRowsFn fn) {
+        int cw = sub ? W / 2 : W, ch = sub ? H / 2 : H;
+        out[0].assign((size_t)W * H, 0);
+        out[1].assign((size_t)cw * ch, 0);
+        out[2].assign((size_t)cw * ch, 0);
+        auto convert = [&] {
+            for (int ty=0; ty<H; ty+=T) {
+                for (int tx=0; tx<W; tx+=T) {
+                    PixelView view = { frame.data() + ((size_t)ty * W + tx) * 4, W * 4, min(T, W - tx), min(T, H - ty) };
+                    int cx = sub ? tx / 2 : tx, cy = sub ? ty / 2 : ty;
+                    YuvPlanes planes = { out[0].data() + (size_t)ty * W + tx, out[1].data() + (size_t)cy * cw + cx, out[2].data() + (size_t)cy * cw + cx, W, cw };
+                    fn(view, planes, view.w, 0, view.h);
+                }
+            }
+        };
+        double ms = BenchMs(iterations, convert);
+        std::vector<BYTE>* expect = ref[sub ? 0 : 1];
+        bool match = true;
+        if (expect[0].empty()) {
+            for (int i=0; i<3; ++i) expect[i] = out[i];
+            scalarMs[sub ? 0 : 1] = ms;
+        } else {
+            for (int i=0; i<3; ++i) match = match && expect[i] == out[i];
+        }
+        allMatch = allMatch && match;
+        std::cout << name << ms << " ms/frame, " << (double)W * H / (ms * 1000.0) << " Mpixel/s, "
+                  << scalarMs[sub ? 0 : 1] / ms << "x scalar" << (match ? "" : ", MISMATCH") << "\n";
+    };
+    perFrame("420 scalar:    ", true, Yuv420RowsScalar);
+#ifdef ISS_X86
+    const CpuFeatures& cpu = GetCpuFeatures();
+    if (cpu.sse2) perFrame("420 sse2:      ", true, Yuv420RowsSSE2);
+    if (cpu.avx2) perFrame("420 avx2:      ", true, Yuv420RowsAVX2);
+#endif
+#ifdef ISS_NEON
+    perFrame("420 neon:      ", true, Yuv420RowsNeon);
+#endif
+    perFrame("444 scalar:    ", false, Yuv444RowsScalar);
+#ifdef ISS_X86
+    if (cpu.sse2) perFrame("444 sse2:      ", false, Yuv444RowsSSE2);
+    if (cpu.avx2) perFrame("444 avx2:      ", false, Yuv444RowsAVX2);
+#endif
+#ifdef ISS_NEON
+    perFrame("444 neon:      ", false, Yuv444RowsNeon);
+#endif
+    return allMatch ? 0 : 1;
+}
+
+// Hash mode vs previous-frame compare on 4K frame pairs from a few workloads
+int benchDiff(int iterations) {
+    const int W = 3840, H = 2160, T = 256;
+    const char* patterns[] = { "typing", "scroll", "video" };
+    std::vector<BYTE> prev((size_t)W * H * 4), cur(prev.size());
+    volatile uint64_t sink = 0;
+
+    for (const char* pattern : patterns) {
+        SyntheticFrameSource src(pattern, W, H);
+        int w = 0, h = 0;
+        if (!src.open(w, h)) return 1;
+        // typing needs a few frames before consecutive frames differ
+        for (int i=0; i<20; ++i) src.grab(prev.data());
+        src.grab(cur.data());
+
+        int changedTiles = 0;
+        double hashMs = BenchMs(iterations, [&] {
+            uint64_t acc = 0;
+            for (int ty=0; ty<H; ty+=T)
+                for (int tx=0; tx<W; tx+=T)
+                    acc += HashTile(cur.data() + ((size_t)ty * W + tx) * 4, W * 4, min(T, W - tx), min(T, H - ty));
+            sink = sink + acc;
+        });
+        double cmpMs = BenchMs(iterations, [&] {
+            int n = 0;
+            for (int ty=0; ty<H; ty+=T)
+                for (int tx=0; tx<W; tx+=T) {
+                    size_t off = ((size_t)ty * W + tx) * 4;
+                    if (FirstDifferingRow(cur.data() + off, prev.data() + off, W * 4, min(T, W - tx), min(T, H - ty)) >= 0) ++n;
+                }
+            changedTiles = n;
+        });
+        std::cout << pattern << ": " << changedTiles << " changed tiles, hash " << hashMs << " ms/frame, compare " << cmpMs << " ms/frame\n";
+    }
+    return 0;
+}
+
+// A busy frame's worth of records with random payloads: mostly small
+// tiles, some large JPEGs, 4-byte fills and references
+struct BenchRecord { uint32_t type, x, y, w, h; std::vector<BYTE> data; };
+std::vector<BenchRecord> MakeBenchRecords(int count) {
+    std::vector<BenchRecord> recs;
+    uint32_t seed = 1;
+    auto rnd = [&](uint32_t n) { seed = seed * 1664525 + 1013904223; return (seed >> 8) % n; };
+    for (int i=0; i<count; ++i) {
+        BenchRecord r = { rnd(REC_JPEG_TABLES + 1), rnd(1920), rnd(1080), 1 + rnd(256), 1 + rnd(256), {} };
+        r.data.resize(r.type == REC_FILL || r.type == REC_CACHE_REF ? 4 : rnd(8) == 0 ? 20000 + rnd(60000) : 16 + rnd(3000));
+        for (BYTE& b : r.data) b = (BYTE)rnd(256);
+        recs.push_back(std::move(r));
+    }
+    return recs;
+}
+
+// Frame messages: FrameWriter/FrameReader round trip on a busy frame,
+// truncated messages, and header overhead against the old layout of six
+// 4-byte fields per record
+int benchWire(int iterations) {
+    std::vector<BenchRecord> recs = MakeBenchRecords(80);
+    size_t payloadBytes = 0;
+    for (const BenchRecord& r : recs) payloadBytes += r.data.size();
+
+    FrameWriter writer;
+    auto serialize = [&] {
+        writer.begin(1920, 1080, 256, 256);
+        for (const BenchRecord& r : recs) writer.add(r.type, r.x, r.y, r.w, r.h, r.data.data(), r.data.size());
+        writer.finish(true);
+    };
+    double writeMs = BenchMs(iterations, serialize);
+    const std::vector<WireSpan>& spans = writer.finish(true);
+    std::vector<BYTE> msg;
+    for (const WireSpan& span : spans) msg.insert(msg.end(), span.data, span.data + span.size);
+
+    // whole records out of a body; false as soon as one doesn't parse
+    auto parse = [&](const BYTE* body, size_t size, uint32_t count) -> bool {
+        FrameReader reader(body, size);
+        uint32_t w, h, tW, tH;
+        if (!reader.geometry(w, h, tW, tH) || w != 1920 || h != 1080 || tW != 256 || tH != 256) return false;
+        WireRecord rec;
+        for (uint32_t i=0; i<count; ++i) {
+            if (!reader.next(rec)) return false;
+            const BenchRecord& r = recs[i];
+            if (rec.type != r.type || rec.x != r.x || rec.y != r.y || rec.w != r.w || rec.h != r.h ||
+                rec.size != r.data.size() || memcmp(rec.data, r.data.data(), rec.size) != 0) return false;
+        }
+        return reader.done();
+    };
+    WireHeader hdr = {};
+    bool headerOk = ParseWireHeader(msg.data(), hdr) && WireHeaderReadable(hdr) && hdr.type == MSG_FRAME &&
+                    (hdr.flags & MSG_FLAG_END_OF_FRAME) && hdr.count == recs.size() && hdr.bodySize == msg.size() - WIRE_HEADER_BYTES;
+    bool roundTrip = headerOk;
+    const BYTE* volatile body = msg.data() + WIRE_HEADER_BYTES;    // keeps repeated parses from being folded
+    double readMs = BenchMs(iterations, [&] { roundTrip = parse(body, hdr.bodySize, hdr.count) && roundTrip; });
+
+    // a cut-off body never yields all its records; each cut is copied to
+    // an exact-size buffer so overreads show up under a checker
+    bool truncatedRejected = true;
+    std::vector<BYTE> cut;
+    for (size_t size=0; size<hdr.bodySize; size += 1 + size / 64) {
+        cut.assign(msg.begin() + WIRE_HEADER_BYTES, msg.begin() + WIRE_HEADER_BYTES + size);
+        if (parse(cut.data(), cut.size(), hdr.count)) truncatedRejected = false;
+    }
+
+    size_t oldHeaderBytes = 24 + 24 * recs.size();
+    std::cout << "records:       " << recs.size() << ", " << payloadBytes << " payload bytes\n";
+    std::cout << "header bytes:  " << msg.size() - payloadBytes << ", old layout " << oldHeaderBytes << "\n";
+    std::cout << "serialize:     " << writeMs << " ms/frame into " << spans.size() << " spans, "
+              << msg.size() / (writeMs * 1000.0) << " MB/s\n";
+    std::cout << "parse:         " << readMs << " ms/frame, " << msg.size() / (readMs * 1000.0) << " MB/s\n";
+    std::cout << "round trip:    " << (roundTrip ? "ok" : "MISMATCH") << ", truncated bodies " << (truncatedRejected ? "rejected" : "ACCEPTED") << "\n";
+    return roundTrip && truncatedRejected ? 0 : 1;
+}
+
+// Video channel send paths over loopback TCP: the per-field sendAll loop
+// the server used to have, the message copied into one buffer, and the
+// gathering send of FrameWriter spans. Reports send calls per frame and
+// the sending thread's CPU time per MB.
+int benchSend(int frames) {
+    std::vector<BenchRecord> recs = MakeBenchRecords(80);
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) return 1;
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET; addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK); addr.sin_port = 0;
+    socklen_t addrLen = sizeof(addr);
+    if (listener == INVALID_SOCKET || bind(listener, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+        listen(listener, 1) == SOCKET_ERROR || getsockname(listener, (sockaddr*)&addr, &addrLen) == SOCKET_ERROR) {
+        std::cerr << "loopback listen failed\n";
+        WSACleanup();
+        return 1;
+    }
+    auto cpuMs = [] {
+#ifdef _WIN32
+        FILETIME created, exited, kernel, user;
+        GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user);
+        uint64_t k = (uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime;
+        uint64_t u = (uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime;
+        return (k + u) / 10000.0;
+#else
+        timespec t;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+        return t.tv_sec * 1000.0 + t.tv_nsec / 1e6;
+#endif
+    };
+
+    // sendFrame returns the send calls it made, or -1 on error
+    bool allOk = true;
+    auto run = [&](const char* name, const std::function<int(SOCKET)>& sendFrame) {
+        SOCKET out = socket(AF_INET, SOCK_STREAM, 0);
+        if (out == INVALID_SOCKET || connect(out, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) { allOk = false; return; }
+        SOCKET in = accept(listener, NULL, NULL);
+        if (in == INVALID_SOCKET) { closesocket(out); allOk = false; return; }
+        uint64_t received = 0;
+        std::thread reader([&] {
+            std::vector<char> buf(1 << 20);
+            int r;
+            while ((r = recv(in, buf.data(), (int)buf.size(), 0)) > 0) received += r;
+        });
+        uint64_t calls = 0;
+        bool ok = true;
+        double cpu0 = cpuMs();
+        auto t0 = std::chrono::steady_clock::now();
+        for (int f=0; f<frames && ok; ++f) {
+            int n = sendFrame(out);
+            ok = n >= 0;
+            calls += n;
+        }
+        double cpu = cpuMs() - cpu0;
+        shutdown(out, SD_SEND);
+        reader.join();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        closesocket(out);
+        closesocket(in);
+        allOk = allOk && ok;
+        double mb = received / (1024.0 * 1024.0);
+        std::cout << name << (double)calls / frames << " sends/frame, " << (mb > 0 ? cpu / mb : 0) << " ms CPU/MB, "
+                  << (seconds > 0 ? mb / seconds : 0) << " MB/s" << (ok ? "" : ", FAILED") << "\n";
+    };
+
+    run("per field:     ", [&](SOCKET s) {
+        uint32_t header[6] = { WIRE_MAGIC, 1920, 1080, 256, 256, (uint32_t)recs.size() };
+        int calls = 0;
+        for (uint32_t v : header) {
+            calls++;
+            if (sendAll(s, (char*)&v, 4) == SOCKET_ERROR) return -1;
+        }
+        for (const BenchRecord& r : recs) {
+            uint32_t fields[6] = { r.type, r.x, r.y, r.w, r.h, (uint32_t)r.data.size() };
+            for (uint32_t v : fields) {
+                calls++;
+                if (sendAll(s, (char*)&v, 4) == SOCKET_ERROR) return -1;
+            }
+            calls++;
+            if (sendAll(s, (const char*)r.data.data(), (int)r.data.size()) == SOCKET_ERROR) return -1;
+        }
+        return calls;
+    });
+    FrameWriter writer;
+    std::vector<BYTE> copy;
+    run("one copy:      ", [&](SOCKET s) {
+        writer.begin(1920, 1080, 256, 256);
+        for (const BenchRecord& r : recs) writer.add(r.type, r.x, r.y, r.w, r.h, r.data.data(), r.data.size());
+        copy.clear();
+        for (const WireSpan& span : writer.finish(true)) copy.insert(copy.end(), span.data, span.data + span.size);
+        return sendAll(s, (const char*)copy.data(), (int)copy.size()) == SOCKET_ERROR ? -1 : 1;
+    });
+    std::vector<WSABUF> bufs;
+    run("gather:        ", [&](SOCKET s) {
+        writer.begin(1920, 1080, 256, 256);
+        for (const BenchRecord& r : recs) writer.add(r.type, r.x, r.y, r.w, r.h, r.data.data(), r.data.size());
+        bufs.clear();
+        for (const WireSpan& span : writer.finish(true)) bufs.push_back({ (ULONG)span.size, (char*)span.data });
+        int calls = 0;
+        return sendGather(s, bufs.data(), (DWORD)bufs.size(), calls) == SOCKET_ERROR ? -1 : calls;
+    });
+    closesocket(listener);
+    WSACleanup();
+    return allOk ? 0 : 1;
+}
+
+// JpegEncoder vs GDI+ (on Windows) on 256x256 tiles of a few workloads
+int benchJpeg(int iterations) {
+    const int W = 1920, H = 1080, T = 256;
+    const char* patterns[] = { "typing", "scroll", "video" };
+    std::vector<BYTE> frame((size_t)W * H * 4);
+    JpegEncoder enc;
+    std::vector<BYTE> out;
+
+#ifdef _WIN32
+    GdiplusStartupInput gdiIn; ULONG_PTR token = 0;
+    bool haveGdiplus = GdiplusStartup(&token, &gdiIn, NULL) == Ok;
+#endif
+    for (const char* pattern : patterns) {
+        SyntheticFrameSource src(pattern, W, H);
+        int w = 0, h = 0;
+        if (!src.open(w, h)) return 1;
+        for (int i=0; i<20; ++i) src.grab(frame.data());
+        // tile at the centre of the content
+        const BYTE* tile = frame.data() + ((size_t)(H / 2 - T / 2) * W + (W / 2 - T / 2)) * 4;
+        PixelView view = { tile, W * 4, T, T };
+
+        size_t bytes = 0;
+        double encMs = BenchMs(iterations, [&] {
+            out.clear();
+            enc.encode(view, 90, out);
+            bytes = out.size();
+        });
+        std::cout << pattern << ": JpegEncoder " << encMs << " ms/tile (" << bytes << " bytes)";
+#ifdef _WIN32
+        if (haveGdiplus) {
+            double gdiMs = BenchMs(iterations, [&] {
+                out.clear();
+                EncodeBGRAToJPEGBytes(tile, W * 4, T, T, out, 90);
+                bytes = out.size();
+            });
+            std::cout << ", GDI+ " << gdiMs << " ms/tile (" << bytes << " bytes)";
+        }
+#endif
+        std::cout << "\n";
+    }
+#ifdef _WIN32
+    if (haveGdiplus) GdiplusShutdown(token);
+#endif
+    return 0;
+}
+
+// Pipeline runs with 1, 2, 4, ... encode threads up to the core count
+int benchEncode(const std::string& spec, int frames, ServerOptions opts) {
+    int cores = (int)std::thread::hardware_concurrency();
+    if (cores <= 0) cores = 1;
+    std::vector<int> counts;
+    for (int n=1; n<cores; n*=2) counts.push_back(n);
+    counts.push_back(cores);
+
+    std::cout << "source: " << spec << ", " << frames << " frames, " << cores << " cores\n";
+    double baseMs = 0;
+    for (int n : counts) {
+        std::unique_ptr<FrameSource> source(CreateFrameSource(spec, NULL));
+        if (!source) { printUsage(); return 1; }
+        opts.encodeThreads = n;
+        Server s(9632, 8080, opts);
+        auto t0 = std::chrono::steady_clock::now();
+        PipelineStats st = s.benchmark(*source, frames);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        double f = (double)(st.frames ? st.frames : 1);
+        double encodeMs = st.encodeMs / f;
+        if (n == 1) baseMs = encodeMs;
+        std::cout << n << " threads: encode " << encodeMs << " ms/frame, " << st.tilesSent / f << " tiles/frame, "
+                  << (seconds > 0 ? st.frames / seconds : 0) << " fps, speedup " << (encodeMs > 0 ? baseMs / encodeMs : 0) << "x\n";
+    }
+    return 0;
+}
+
+// Splits trailing "--name=value" arguments off into server options
+bool ParseBenchOptions(int argc, char* argv[], int first, ServerOptions& opts, std::vector<std::string>& pos) {
+    for (int i=first; i<argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0) { pos.push_back(arg); continue; }
+        if (!ParseServerOption(arg, opts)) { std::cerr << "Unknown option " << arg << "\n"; return false; }
+    }
+    return true;
+}
+
+// bench <what> ...: offline measurements of pipeline stages
+int runBench(int argc, char* argv[]) {
+    std::string what = argc >= 3 ? argv[2] : "";
+    if (what == "pipeline") {
+        ServerOptions opts;
+        std::vector<std::string> pos;
+        if (!ParseBenchOptions(argc, argv, 3, opts, pos)) return 1;
+        std::string spec = pos.size() >= 1 ? pos[0] : "synthetic:scroll";
+        int frames = pos.size() >= 2 ? atoi(pos[1].c_str()) : 200;
+        std::unique_ptr<FrameSource> source(CreateFrameSource(spec, NULL));
+        if (!source || frames <= 0) { printUsage(); return 1; }
+
+        Server s(9632, 8080, opts);
+        auto t0 = std::chrono::steady_clock::now();
+        PipelineStats st = s.benchmark(*source, frames);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::cout << "source:        " << spec << "\n";
+        printPipelineStats(st, seconds);
+        return 0;
+    }
+    if (what == "encode") {
+        ServerOptions opts;
+        std::vector<std::string> pos;
+        if (!ParseBenchOptions(argc, argv, 3, opts, pos)) return 1;
+        std::string spec = pos.size() >= 1 ? pos[0] : "synthetic:video:2560x1440";
+        int frames = pos.size() >= 2 ? atoi(pos[1].c_str()) : 50;
+        if (frames <= 0) { printUsage(); return 1; }
+        return benchEncode(spec, frames, opts);
+    }
+    if (what == "jpeg") return benchJpeg(argc >= 4 ? max(1, atoi(argv[3])) : 200);
+    if (what == "hash") return benchHash(argc >= 4 ? max(1, atoi(argv[3])) : 50);
+    if (what == "color") return benchColor(argc >= 4 ? max(1, atoi(argv[3])) : 50);
+    if (what == "diff") return benchDiff(argc >= 4 ? max(1, atoi(argv[3])) : 50);
+    if (what == "wire") return benchWire(argc >= 4 ? max(1, atoi(argv[3])) : 200);
+    if (what == "send") return benchSend(argc >= 4 ? max(1, atoi(argv[3])) : 500);
+    printUsage();
+    return 1;
+}
+
+// shaper <kbps> <delay_ms> <listen_port>:<host>:<port>...: proxies each
+// listen port to its target through an emulated slow link
+int runShaper(int argc, char* argv[]) {
+    ShaperConfig cfg;
+    std::vector<std::pair<int, sockaddr_in>> routes;
+    for (int i=2; i<argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 8, "--queue=") == 0) { cfg.queueBytes = (size_t)atoi(arg.c_str() + 8) * 1024; continue; }
+        if (arg.compare(0, 7, "--loss=") == 0) { cfg.lossPercent = atof(arg.c_str() + 7); continue; }
+        if (i == 2) { cfg.kbps = atoi(arg.c_str()); continue; }
+        if (i == 3) { cfg.delayMs = atoi(arg.c_str()); continue; }
+        size_t c1 = arg.find(':'), c2 = arg.rfind(':');
+        if (c1 == std::string::npos || c1 == c2) { printUsage(); return 1; }
+        sockaddr_in target{};
+        target.sin_family = AF_INET;
+        target.sin_port = htons((u_short)atoi(arg.c_str() + c2 + 1));
+        if (InetPton(AF_INET, arg.substr(c1 + 1, c2 - c1 - 1).c_str(), &target.sin_addr) != 1) { printUsage(); return 1; }
+        routes.push_back({ atoi(arg.c_str()), target });
+    }
+    if (cfg.kbps <= 0 || cfg.delayMs < 0 || cfg.queueBytes == 0 || cfg.lossPercent < 0 || cfg.lossPercent > 100 || routes.empty()) { printUsage(); return 1; }
+
+    WSADATA w;
+    if (WSAStartup(MAKEWORD(2,2), &w) != 0) { std::cerr<<"WSAStartup failed\n"; return 1; }
+    std::vector<std::thread> listeners;
+    for (const auto& route : routes) {
+        SOCKET ls = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET; addr.sin_addr.s_addr = INADDR_ANY; addr.sin_port = htons((u_short)route.first);
+        int opt = 1; setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, (char*)&opt, sizeof(opt));
+        if (ls == INVALID_SOCKET || bind(ls, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR || listen(ls, 4) == SOCKET_ERROR) {
+            std::cerr << "shaper: cannot listen on port " << route.first << "\n";
+            WSACleanup();
+            return 1;
+        }
+        sockaddr_in target = route.second;
+        SOCKET us = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if (us == INVALID_SOCKET || bind(us, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+            std::cerr << "shaper: cannot bind UDP port " << route.first << "\n";
+            WSACleanup();
+            return 1;
+        }
+        listeners.emplace_back(ShapeDatagrams, us, target, cfg);
+        listeners.emplace_back([ls, target, cfg] {
+            for (;;) {
+                SOCKET client = accept(ls, NULL, NULL);
+                if (client == INVALID_SOCKET) break;
+                std::thread(ShapeConnection, client, target, cfg).detach();
+            }
+        });
+        std::cout << "shaper: port " << route.first << " -> " << ntohs(target.sin_port) << " at "
+                  << cfg.kbps << " kbit/s, " << cfg.delayMs << " ms, queue " << cfg.queueBytes / 1024 << " KB, UDP loss "
+                  << cfg.lossPercent << "%\n";
+    }
+    for (std::thread& t : listeners) t.join();
+    WSACleanup();
+    return 0;
+}
+
+// record <file> [frames]: saves live desktop frames for replay:<file>
+int runRecord(int argc, char* argv[]) {
+    if (argc < 3) { printUsage(); return 1; }
+#ifdef _WIN32
+    int frames = argc >= 4 ? atoi(argv[3]) : 250;
+    GdiFrameSource source(NULL);
+    int w = 0, h = 0;
+    if (!source.open(w, h)) return 1;
+    FrameRecorder rec;
+    if (!rec.open(argv[2], w, h)) { std::cerr << "Cannot write " << argv[2] << "\n"; return 1; }
+    std::vector<BYTE> buf((size_t)w * h * 4);
+    for (int i=0; i<frames; ++i) {
+        if (!source.grab(buf.data()) || !rec.write(buf.data())) return 1;
+        std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    }
+    std::cout << "Recorded " << frames << " frames of " << w << "x" << h << " to " << argv[2] << "\n";
+    return 0;
+#else
+    std::cerr << "record needs desktop capture, which is Windows only\n";
+    return 1;
+#endif
 }
 
 int getUserChoice() {
@@ -1329,48 +7619,34 @@ int getUserChoice() {
     return choice;
 }
 
-void getServerConfig(int& videoPort, int& controlPort, int& webPort, int& audioPort) {
-    std::cout << "Enter video port (default 9632): ";
+void getServerConfig(int& port, int& webPort) {
+    std::cout << "Enter port (default 9632): ";
     std::string input;
     std::getline(std::cin, input);
-    if (!input.empty()) videoPort = atoi(input.c_str());
-
-    std::cout << "Enter control port (default 9633): ";
-    std::getline(std::cin, input);
-    if (!input.empty()) controlPort = atoi(input.c_str());
+    if (!input.empty()) port = atoi(input.c_str());
 
     std::cout << "Enter web port (default 8080): ";
     std::getline(std::cin, input);
     if (!input.empty()) webPort = atoi(input.c_str());
 
-    std::cout << "Enter audio port (default 9634): ";
-    std::getline(std::cin, input);
-    if (!input.empty()) audioPort = atoi(input.c_str());
-
     std::cin.clear();
 }
 
-void getClientConfig(std::string& serverIP, int& videoPort, int& controlPort, int& audioPort) {
+void getClientConfig(std::string& serverIP, int& port) {
     std::cout << "Enter server IP (default 127.0.0.1): ";
     std::getline(std::cin, serverIP);
     if (serverIP.empty()) serverIP = "127.0.0.1";
 
-    std::cout << "Enter video port (default 9632): ";
+    std::cout << "Enter port (default 9632): ";
     std::string input;
     std::getline(std::cin, input);
-    if (!input.empty()) videoPort = atoi(input.c_str());
-
-    std::cout << "Enter control port (default 9633): ";
-    std::getline(std::cin, input);
-    if (!input.empty()) controlPort = atoi(input.c_str());
-
-    std::cout << "Enter audio port (default 9634): ";
-    std::getline(std::cin, input);
-    if (!input.empty()) audioPort = atoi(input.c_str());
+    if (!input.empty()) port = atoi(input.c_str());
 
     std::cin.clear();
 }
 
+// tests include this file with MYTRY_NO_MAIN and bring their own main
+#ifndef MYTRY_NO_MAIN
 int main(int argc, char* argv[]) {
     std::string mode;
 
@@ -1383,10 +7659,10 @@ int main(int argc, char* argv[]) {
 
         if (choice == 1) {
             mode = "server";
-            int vp = 9632, cp = 9633, wp = 8080, ap = 9634;
-            getServerConfig(vp, cp, wp, ap);
+            int port = 9632, wp = 8080;
+            getServerConfig(port, wp);
 
-            Server s(vp, cp, wp, ap);
+            Server s(port, wp);
             if (!s.start()) { 
                 std::cerr<<"Failed to start server\n"; 
                 CoUninitialize();
@@ -1401,10 +7677,10 @@ int main(int argc, char* argv[]) {
         } else if (choice == 2) {
             mode = "client";
             std::string ip = "127.0.0.1";
-            int vp = 9632, cp = 9633, ap = 9634;
-            getClientConfig(ip, vp, cp, ap);
-
-            Client c(ip, vp, cp, ap);
+            int port = 9632;
+            getClientConfig(ip, port);
+#ifdef _WIN32
+            Client c(ip, port);
             if (!c.start()) { 
                 std::cerr<<"Failed to start client\n"; 
                 CoUninitialize();
@@ -1433,6 +7709,10 @@ int main(int argc, char* argv[]) {
             c.stop();
             CoUninitialize();
             return 0;
+#else
+            std::cerr << "The client is Windows only\n";
+            return 1;
+#endif
         } else {
             std::cerr << "Invalid choice.\n";
             printUsage();
@@ -1443,13 +7723,23 @@ int main(int argc, char* argv[]) {
         mode = argv[1];
 
         if (mode == "server") {
-            int vp = 9632, cp = 9633, wp = 8080, ap = 9634;
-            if (argc >= 3) vp = atoi(argv[2]);
-            if (argc >= 4) cp = atoi(argv[3]);
-            if (argc >= 5) wp = atoi(argv[4]);
-            if (argc >= 6) ap = atoi(argv[5]);
+            int port = 9632, wp = 8080;
+            ServerOptions opts;
+            std::vector<std::string> pos;
+            for (int i=2; i<argc; ++i) {
+                std::string arg = argv[i];
+                if (arg.compare(0, 2, "--") != 0) { pos.push_back(arg); continue; }
+                if (!ParseServerOption(arg, opts)) {
+                    std::cerr << "Unknown option " << arg << "\n";
+                    printUsage();
+                    CoUninitialize();
+                    return 1;
+                }
+            }
+            if (pos.size() >= 1) port = atoi(pos[0].c_str());
+            if (pos.size() >= 2) wp = atoi(pos[1].c_str());
 
-            Server s(vp, cp, wp, ap);
+            Server s(port, wp, opts);
             if (!s.start()) { 
                 std::cerr<<"Failed to start server\n"; 
                 CoUninitialize();
@@ -1461,13 +7751,12 @@ int main(int argc, char* argv[]) {
             return 0;
         } else if (mode == "client") {
             if (argc < 3) { printUsage(); CoUninitialize(); return 1; }
+#ifdef _WIN32
             std::string ip = argv[2];
-            int vp = 9632, cp = 9633, ap = 9634;
-            if (argc >= 4) vp = atoi(argv[3]);
-            if (argc >= 5) cp = atoi(argv[4]);
-            if (argc >= 6) ap = atoi(argv[5]);
+            int port = 9632;
+            if (argc >= 4) port = atoi(argv[3]);
 
-            Client c(ip, vp, cp, ap);
+            Client c(ip, port);
             if (!c.start()) { 
                 std::cerr<<"Failed to start client\n"; 
                 CoUninitialize();
@@ -1495,6 +7784,22 @@ int main(int argc, char* argv[]) {
             c.stop();
             CoUninitialize();
             return 0;
+#else
+            std::cerr << "The client is Windows only\n";
+            return 1;
+#endif
+        } else if (mode == "bench") {
+            int rc = runBench(argc, argv);
+            CoUninitialize();
+            return rc;
+        } else if (mode == "record") {
+            int rc = runRecord(argc, argv);
+            CoUninitialize();
+            return rc;
+        } else if (mode == "shaper") {
+            int rc = runShaper(argc, argv);
+            CoUninitialize();
+            return rc;
         } else {
             printUsage();
             CoUninitialize();
@@ -1503,4 +7808,5 @@ int main(int argc, char* argv[]) {
     }
     CoUninitialize();
     return 0;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
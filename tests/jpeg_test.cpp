@@ -0,0 +1,218 @@
+// JpegEncoder checks: tiles of the synthetic workloads are decoded with
+// libjpeg and compared with the source pixels and with libjpeg's own
+// encode, strided input must encode like a packed copy, and re-encodes
+// into a reserved vector must not allocate. Run with tests/run.sh.
+#include <cstdio>
+#include <cstdlib>
+#include <csetjmp>
+#include <cmath>
+#include <new>
+#include <jpeglib.h>
+
+#define MYTRY_NO_MAIN
+#include "../fixed_mytry2.cpp"
+
+// every heap allocation in the process goes through here
+static size_t g_allocs = 0;
+void* operator new(size_t n) {
+    ++g_allocs;
+    if (void* p = malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+static int g_failures = 0;
+#define CHECK(cond, what) do { if (!(cond)) { ++g_failures; std::cerr << "FAIL " << what << " (" #cond ")\n"; } } while (0)
+
+struct DecodeError { jpeg_error_mgr mgr; jmp_buf jump; };
+
+static void OnDecodeError(j_common_ptr cinfo) {
+    longjmp(((DecodeError*)cinfo->err)->jump, 1);
+}
+
+// Decodes img to packed RGB; tables, if not empty, is a tables-only
+// stream read first for an abbreviated img
+static bool DecodeJpeg(const std::vector<BYTE>& tables, const std::vector<BYTE>& img, int& w, int& h, std::vector<BYTE>& rgb) {
+    jpeg_decompress_struct cinfo;
+    DecodeError err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = OnDecodeError;
+    if (setjmp(err.jump)) { jpeg_destroy_decompress(&cinfo); return false; }
+    jpeg_create_decompress(&cinfo);
+    if (!tables.empty()) {
+        jpeg_mem_src(&cinfo, tables.data(), (unsigned long)tables.size());
+        if (jpeg_read_header(&cinfo, FALSE) != JPEG_HEADER_TABLES_ONLY) { jpeg_destroy_decompress(&cinfo); return false; }
+    }
+    jpeg_mem_src(&cinfo, img.data(), (unsigned long)img.size());
+    if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) { jpeg_destroy_decompress(&cinfo); return false; }
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    w = (int)cinfo.output_width; h = (int)cinfo.output_height;
+    rgb.resize((size_t)w * h * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = rgb.data() + (size_t)cinfo.output_scanline * w * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+// libjpeg's baseline 4:2:0 encode of the same pixels, as the reference
+static std::vector<BYTE> ReferenceJpeg(const PixelView& img, int quality) {
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr err;
+    cinfo.err = jpeg_std_error(&err);
+    jpeg_create_compress(&cinfo);
+    unsigned char* buf = nullptr; unsigned long size = 0;
+    jpeg_mem_dest(&cinfo, &buf, &size);
+    cinfo.image_width = img.w; cinfo.image_height = img.h;
+    cinfo.input_components = 3; cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    std::vector<BYTE> row((size_t)img.w * 3);
+    for (int y=0; y<img.h; ++y) {
+        const BYTE* p = img.pixels + (size_t)y * img.stride;
+        for (int x=0; x<img.w; ++x) { row[x*3] = p[x*4+2]; row[x*3+1] = p[x*4+1]; row[x*3+2] = p[x*4]; }
+        JSAMPROW r = row.data();
+        jpeg_write_scanlines(&cinfo, &r, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    std::vector<BYTE> out(buf, buf + size);
+    free(buf);
+    return out;
+}
+
+// PSNR in dB of decoded RGB against the BGRA source
+static double Psnr(const PixelView& img, const std::vector<BYTE>& rgb) {
+    double se = 0;
+    for (int y=0; y<img.h; ++y) {
+        const BYTE* p = img.pixels + (size_t)y * img.stride;
+        const BYTE* q = rgb.data() + (size_t)y * img.w * 3;
+        for (int x=0; x<img.w; ++x)
+            for (int c=0; c<3; ++c) { double d = (double)p[x*4 + 2 - c] - q[x*3 + c]; se += d * d; }
+    }
+    double mse = se / ((double)img.w * img.h * 3);
+    return mse == 0 ? 99.0 : 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+// Top-left of the 256x256 grid cell with the most detail, so that flat
+// regions of a workload do not make the checks trivial
+static const BYTE* BusiestTile(const std::vector<BYTE>& frame, int W, int H) {
+    const BYTE* best = frame.data();
+    long bestScore = -1;
+    for (int ty=0; ty+256<=H; ty+=128) {
+        for (int tx=0; tx+256<=W; tx+=128) {
+            const BYTE* t = frame.data() + ((size_t)ty * W + tx) * 4;
+            long score = 0;
+            for (int y=0; y<256; y+=2)
+                for (int x=1; x<256; x+=2) score += std::abs((int)t[((size_t)y * W + x) * 4 + 1] - (int)t[((size_t)y * W + x - 1) * 4 + 1]);
+            if (score > bestScore) { bestScore = score; best = t; }
+        }
+    }
+    return best;
+}
+
+static std::vector<BYTE> Packed(const PixelView& img) {
+    std::vector<BYTE> out((size_t)img.w * img.h * 4);
+    for (int y=0; y<img.h; ++y) memcpy(out.data() + (size_t)y * img.w * 4, img.pixels + (size_t)y * img.stride, (size_t)img.w * 4);
+    return out;
+}
+
+// Full and abbreviated streams of tiles of each workload at several
+// sizes, including ones that are not whole MCUs, decode to the tile
+static void TestRoundTrip(JpegEncoder& enc, const BYTE* tile, int W, const char* pattern) {
+    static const int sizes[][2] = { {256, 256}, {64, 64}, {1, 1}, {17, 9}, {255, 3}, {40, 130} };
+    for (int quality : { 30, 75, 90 }) {
+        std::vector<BYTE> tables;
+        enc.encodeTables(quality, tables);
+        for (const auto& s : sizes) {
+            int tw = s[0], th = s[1];
+            PixelView view = { tile, W * 4, tw, th };
+            std::string what = std::string(pattern) + " " + std::to_string(tw) + "x" + std::to_string(th) + " q" + std::to_string(quality);
+
+            std::vector<BYTE> full, abbreviated, rgb, refRgb;
+            CHECK(enc.encode(view, quality, full), what + " encode");
+            CHECK(enc.encode(view, quality, abbreviated, true), what + " abbreviated encode");
+            CHECK(abbreviated.size() < full.size(), what + " abbreviated stream carries no tables");
+
+            int w = 0, h = 0;
+            CHECK(DecodeJpeg({}, full, w, h, rgb), what + " decodes");
+            CHECK(w == tw && h == th, what + " size");
+            if (w != tw || h != th) continue;
+            double psnr = Psnr(view, rgb);
+
+            std::vector<BYTE> rgb2;
+            CHECK(DecodeJpeg(tables, abbreviated, w, h, rgb2), what + " abbreviated decodes");
+            CHECK(rgb2 == rgb, what + " abbreviated decodes like the full stream");
+
+            std::vector<BYTE> ref = ReferenceJpeg(view, quality);
+            CHECK(DecodeJpeg({}, ref, w, h, refRgb), what + " reference decodes");
+            double refPsnr = Psnr(view, refRgb);
+            // the float AAN DCT may round differently from libjpeg's islow,
+            // and a small tile can be one flat color, so one rounded DC value
+            if (tw * th < 64 * 64) continue;
+            CHECK(psnr >= refPsnr - 1.0, what + " psnr " + std::to_string(psnr) + " vs libjpeg " + std::to_string(refPsnr));
+            CHECK(full.size() <= ref.size() * 5 / 4 + 64, what + " size " + std::to_string(full.size()) + " vs libjpeg " + std::to_string(ref.size()));
+        }
+    }
+}
+
+// A view into a wider frame must encode exactly like a packed copy of
+// the same pixels: nothing right of w or below h is read
+static void TestStride(JpegEncoder& enc, const BYTE* tile, int W, const char* pattern) {
+    for (int tw : { 256, 100, 33 }) {
+        int th = tw == 256 ? 256 : 45;
+        PixelView view = { tile, W * 4, tw, th };
+        std::vector<BYTE> packed = Packed(view);
+        PixelView packedView = { packed.data(), tw * 4, tw, th };
+        std::vector<BYTE> a, b;
+        enc.encode(view, 80, a);
+        enc.encode(packedView, 80, b);
+        CHECK(a == b, std::string(pattern) + " stride " + std::to_string(tw) + "x" + std::to_string(th));
+    }
+}
+
+// Once the planes have grown and out has capacity, encodes of the same
+// or smaller tiles, at any quality and with tables, do not allocate
+static void TestNoAllocation(JpegEncoder& enc, const std::vector<BYTE>& frame, int W, int H) {
+    std::vector<BYTE> out;
+    out.reserve(1 << 20);
+    PixelView big = { frame.data(), W * 4, 256, 256 };
+    PixelView small = { frame.data() + ((size_t)100 * W + 300) * 4, W * 4, 37, 90 };
+    enc.encode(big, 90, out);
+    size_t before = g_allocs;
+    for (int i=0; i<20; ++i) {
+        out.clear();
+        enc.encode(i % 2 ? big : small, 30 + i * 3, out, i % 3 == 0);
+        enc.encodeTables(50, out);
+    }
+    CHECK(g_allocs == before, "steady state encodes allocated " + std::to_string(g_allocs - before) + " times");
+}
+
+int main() {
+    const int W = 1920, H = 1080;
+    std::vector<BYTE> frame((size_t)W * H * 4);
+    JpegEncoder enc;
+    for (const char* pattern : { "typing", "scroll", "video", "ide", "drag" }) {
+        SyntheticFrameSource src(pattern, W, H);
+        int w = 0, h = 0;
+        if (!src.open(w, h)) { std::cerr << "cannot open synthetic:" << pattern << "\n"; return 1; }
+        for (int i=0; i<20; ++i) src.grab(frame.data());
+        const BYTE* tile = BusiestTile(frame, W, H);
+        TestRoundTrip(enc, tile, W, pattern);
+        TestStride(enc, tile, W, pattern);
+    }
+    TestNoAllocation(enc, frame, W, H);
+
+    PixelView empty = { frame.data(), W * 4, 0, 16 };
+    std::vector<BYTE> out;
+    CHECK(!enc.encode(empty, 90, out) && out.empty(), "empty image is refused");
+
+    if (g_failures) { std::cerr << g_failures << " jpeg checks failed\n"; return 1; }
+    std::cout << "jpeg_test: ok\n";
+    return 0;
+}
@@ -0,0 +1,9 @@
+#!/bin/sh
+# Builds and runs the headless tests with g++; jpeg_test needs libjpeg
+cd "$(dirname "$0")" || exit 1
+out=$(mktemp -d) || exit 1
+trap 'rm -rf "$out"' EXIT
+failed=0
+g++ -std=c++17 -O2 -pthread wire_test.cpp -o "$out/wire_test" && "$out/wire_test" || failed=1
+g++ -std=c++17 -O2 -pthread jpeg_test.cpp -o "$out/jpeg_test" -ljpeg && "$out/jpeg_test" || failed=1
+exit $failed
@@ -0,0 +1,172 @@
+// Wire format checks: varint edges, FrameWriter/FrameReader round trips
+// across the inline payload limit, every truncation of a body, and
+// headers of another version or size. Run with tests/run.sh.
+#define MYTRY_NO_MAIN
+#include "../fixed_mytry2.cpp"
+
+static int g_failures = 0;
+#define CHECK(cond, what) do { if (!(cond)) { ++g_failures; std::cerr << "FAIL " << what << " (" #cond ")\n"; } } while (0)
+
+static std::vector<BYTE> Join(const std::vector<WireSpan>& spans) {
+    std::vector<BYTE> out;
+    for (const WireSpan& span : spans) out.insert(out.end(), span.data, span.data + span.size);
+    return out;
+}
+
+static void TestVarint() {
+    struct Case { uint32_t v; std::vector<BYTE> bytes; };
+    const Case cases[] = {
+        { 0, { 0x00 } },
+        { 1, { 0x01 } },
+        { 127, { 0x7F } },
+        { 128, { 0x80, 0x01 } },
+        { 16383, { 0xFF, 0x7F } },
+        { 16384, { 0x80, 0x80, 0x01 } },
+        { 0xFFFFFFFFu, { 0xFF, 0xFF, 0xFF, 0xFF, 0x0F } },
+    };
+    for (const Case& c : cases) {
+        std::string what = "varint " + std::to_string(c.v);
+        std::vector<BYTE> out;
+        PutVarint(out, c.v);
+        CHECK(out == c.bytes, what + " encoding");
+
+        // exact-size copies, so an overread shows up under a checker
+        std::vector<BYTE> in(c.bytes);
+        const BYTE* p = in.data();
+        uint32_t v = 12345;
+        CHECK(GetVarint(p, in.data() + in.size(), v) && v == c.v && p == in.data() + in.size(), what + " decodes");
+        for (size_t cut=0; cut<in.size(); ++cut) {
+            std::vector<BYTE> part(in.begin(), in.begin() + cut);
+            p = part.data();
+            CHECK(!GetVarint(p, part.data() + part.size(), v), what + " cut to " + std::to_string(cut) + " bytes");
+        }
+    }
+
+    // a 5th byte with bits past 32, or a 6th byte, is not a uint32
+    std::vector<BYTE> tooBig = { 0xFF, 0xFF, 0xFF, 0xFF, 0x1F };
+    std::vector<BYTE> tooLong = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x00 };
+    uint32_t v;
+    const BYTE* p = tooBig.data();
+    CHECK(!GetVarint(p, tooBig.data() + tooBig.size(), v), "varint over 32 bits");
+    p = tooLong.data();
+    CHECK(!GetVarint(p, tooLong.data() + tooLong.size(), v), "varint of 6 bytes");
+}
+
+struct TestRecord { uint32_t type, x, y, w, h; std::vector<BYTE> data; };
+
+// Records whose fields sit on varint boundaries and whose payloads are
+// empty, inline, just past the inline limit and large
+static std::vector<TestRecord> MakeRecords() {
+    std::vector<TestRecord> recs;
+    const size_t sizes[] = { 0, 1, 12, WIRE_INLINE_BYTES, WIRE_INLINE_BYTES + 1, 5000, 70000 };
+    const uint32_t coords[] = { 0, 127, 128, 16383, 16384, 65535 };
+    uint32_t seed = 1;
+    for (size_t i=0; i<sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        TestRecord r;
+        r.type = i == 0 ? 0xFFFFFFFFu : (uint32_t)i % 11;
+        r.x = coords[i % 6]; r.y = coords[(i + 1) % 6];
+        r.w = coords[(i + 2) % 6]; r.h = coords[(i + 3) % 6];
+        r.data.resize(sizes[i]);
+        for (BYTE& b : r.data) b = (BYTE)(seed = SynthHash(seed));
+        recs.push_back(r);
+    }
+    return recs;
+}
+
+static std::vector<BYTE> WriteMessage(FrameWriter& writer, const std::vector<TestRecord>& recs, bool endOfFrame) {
+    writer.begin(1920, 1080, 256, 128);
+    for (const TestRecord& r : recs) writer.add(r.type, (int)r.x, (int)r.y, (int)r.w, (int)r.h, r.data.data(), r.data.size());
+    CHECK(writer.records() == recs.size(), "writer record count");
+    std::vector<BYTE> msg = Join(writer.finish(endOfFrame));
+    CHECK(msg.size() == writer.size(), "writer size matches the spans");
+    return msg;
+}
+
+// True if body holds the geometry and exactly recs
+static bool ReadsBack(const BYTE* body, size_t size, const std::vector<TestRecord>& recs) {
+    FrameReader reader(body, size);
+    uint32_t w, h, tW, tH;
+    if (!reader.geometry(w, h, tW, tH) || w != 1920 || h != 1080 || tW != 256 || tH != 128) return false;
+    for (const TestRecord& r : recs) {
+        WireRecord rec;
+        if (!reader.next(rec)) return false;
+        if (rec.type != r.type || rec.x != r.x || rec.y != r.y || rec.w != r.w || rec.h != r.h ||
+            rec.size != r.data.size() || (rec.size && memcmp(rec.data, r.data.data(), rec.size) != 0)) return false;
+    }
+    return reader.done();
+}
+
+static void TestRoundTrip() {
+    std::vector<TestRecord> recs = MakeRecords();
+    FrameWriter writer;
+    for (bool endOfFrame : { true, false }) {
+        std::vector<BYTE> msg = WriteMessage(writer, recs, endOfFrame);
+        WireHeader h;
+        CHECK(msg.size() >= WIRE_HEADER_BYTES && ParseWireHeader(msg.data(), h), "header parses");
+        CHECK(WireHeaderReadable(h), "own header is readable");
+        CHECK(h.version == WIRE_VERSION && h.type == MSG_FRAME && h.count == recs.size(), "header fields");
+        CHECK(h.flags == (endOfFrame ? MSG_FLAG_END_OF_FRAME : 0), "end of frame flag");
+        CHECK(h.bodySize == msg.size() - WIRE_HEADER_BYTES, "body size");
+        CHECK(ReadsBack(msg.data() + WIRE_HEADER_BYTES, msg.size() - WIRE_HEADER_BYTES, recs), "records read back");
+    }
+
+    // a reused writer starts clean, including its out-of-line payloads
+    std::vector<TestRecord> one(recs.begin() + 1, recs.begin() + 2);
+    std::vector<BYTE> msg = WriteMessage(writer, one, true);
+    CHECK(ReadsBack(msg.data() + WIRE_HEADER_BYTES, msg.size() - WIRE_HEADER_BYTES, one), "reused writer");
+    msg = WriteMessage(writer, {}, true);
+    CHECK(ReadsBack(msg.data() + WIRE_HEADER_BYTES, msg.size() - WIRE_HEADER_BYTES, {}), "message without records");
+}
+
+// Every cut of the body fails somewhere before the last record, without
+// reading past the cut
+static void TestTruncated() {
+    std::vector<TestRecord> recs = MakeRecords();
+    FrameWriter writer;
+    std::vector<BYTE> msg = WriteMessage(writer, recs, true);
+    std::vector<BYTE> body(msg.begin() + WIRE_HEADER_BYTES, msg.end());
+    size_t accepted = 0;
+    for (size_t size=0; size<body.size(); ++size) {
+        std::vector<BYTE> cut(body.begin(), body.begin() + size);
+        if (ReadsBack(cut.data(), cut.size(), recs)) ++accepted;
+    }
+    CHECK(accepted == 0, std::to_string(accepted) + " truncated bodies read as whole");
+
+    // trailing bytes are not a whole message either
+    body.push_back(0);
+    CHECK(!ReadsBack(body.data(), body.size(), recs), "body with a trailing byte");
+}
+
+static void TestHeaders() {
+    BYTE p[WIRE_HEADER_BYTES];
+    WireHeader h;
+    PutWireHeader(p, MSG_UDP_SETUP, 0, 0, 4);
+    CHECK(ParseWireHeader(p, h) && WireHeaderReadable(h) && h.type == MSG_UDP_SETUP && h.bodySize == 4, "setup header");
+
+    // another version parses, so it can be reported, but is not read on
+    for (BYTE version : { (BYTE)(WIRE_VERSION - 1), (BYTE)(WIRE_VERSION + 1), (BYTE)0, (BYTE)255 }) {
+        PutWireHeader(p, MSG_FRAME, MSG_FLAG_END_OF_FRAME, 3, 100);
+        p[4] = version;
+        CHECK(ParseWireHeader(p, h) && h.version == version && h.count == 3 && h.bodySize == 100, "version " + std::to_string(version) + " parses");
+        CHECK(!WireHeaderReadable(h), "version " + std::to_string(version) + " is refused");
+    }
+
+    PutWireHeader(p, MSG_FRAME, 0, 1, WIRE_MAX_BODY);
+    CHECK(ParseWireHeader(p, h) && WireHeaderReadable(h), "largest body");
+    PutWireHeader(p, MSG_FRAME, 0, 1, WIRE_MAX_BODY + 1);
+    CHECK(ParseWireHeader(p, h) && !WireHeaderReadable(h), "oversized body");
+
+    PutWireHeader(p, MSG_FRAME, 0, 1, 10);
+    p[0] ^= 1;
+    CHECK(!ParseWireHeader(p, h), "bad magic");
+}
+
+int main() {
+    TestVarint();
+    TestRoundTrip();
+    TestTruncated();
+    TestHeaders();
+    if (g_failures) { std::cerr << g_failures << " wire checks failed\n"; return 1; }
+    std::cout << "wire_test: ok\n";
+    return 0;
+}